@@ -0,0 +1,240 @@
+/** @file cache_policy.c
+ *  @brief Cache-Control and Expires of static responses, by url
+ *
+ *  One rule per line of CACHE_POLICY_FILENAME, '#' starts a comment:
+ *
+ *      <pattern> <directive>
+ *
+ *  A pattern starting with '/' matches urls by prefix, one starting
+ *  with '*' matches them by what follows the '*', case insensitively
+ *  ("*.png"). The directive is max-age=<secs>, immutable (a year, and
+ *  the client never revalidates), no-cache or no-store. Of all the
+ *  rules matching a url, the first one in the table applies.
+ *
+ *  Prefixes go into one trie and reversed suffixes into another, both
+ *  kept as first child / next sibling nodes in a fixed array; a lookup
+ *  walks the path of the url down the first and its tail up the second.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache_policy.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+struct trie_node{
+        char c;
+        short child;                     /* first child, 0 if none */
+        short sibling;                   /* next sibling, 0 if none */
+        short rule;                      /* rule ending here, -1 if none */
+};
+
+typedef struct trie_node trie_node_t;
+
+
+#define PREFIX_ROOT 0
+#define SUFFIX_ROOT 1
+
+/* used if there is no CACHE_POLICY_FILENAME */
+static const char *default_rules[] = {
+        "*.css      max-age=86400",
+        "*.js       max-age=86400",
+        "*.png      max-age=604800",
+        "*.jpg      max-age=604800",
+        "*.jpeg     max-age=604800",
+        "*.gif      max-age=604800",
+        "*.svg      max-age=604800",
+        "*.ico      max-age=604800",
+        "*.woff     max-age=2592000",
+        "*.woff2    max-age=2592000",
+};
+
+static cache_rule_t cache_rules[CACHE_RULE_MAX];
+static int rule_ctr = 0;
+static trie_node_t trie[CACHE_TRIE_MAX];
+static int trie_used = 2;
+
+
+static int trie_child(int node, char c)
+{
+        int child;
+
+        for(child = trie[node].child; child; child = trie[child].sibling){
+                if(trie[child].c == c){
+                        return child;
+                }
+        }
+        return 0;
+}
+
+/* insert str from its first char on (step 1) or its last one (step -1) */
+static int trie_insert(int node, char *str, int len, int step, int rule)
+{
+        int child;
+        int i;
+
+        for(i = 0; i < len; i++){
+                char c = str[step > 0 ? i : len - 1 - i];
+
+                if(!(child = trie_child(node, c))){
+                        if(trie_used == CACHE_TRIE_MAX){
+                                return -1;
+                        }
+                        child = trie_used++;
+                        trie[child].c = c;
+                        trie[child].child = 0;
+                        trie[child].rule = -1;
+                        trie[child].sibling = trie[node].child;
+                        trie[node].child = child;
+                }
+                node = child;
+        }
+        /* the same pattern twice, the first stays */
+        if(trie[node].rule < 0){
+                trie[node].rule = rule;
+        }
+        return 0;
+}
+
+/**
+ * @brief parse one line of the table and add its rule
+ * @return 0 on success or for a blank line, -1 if the line is invalid
+ */
+static int add_rule(const char *line)
+{
+        char pattern[CACHE_PATTERN_MAX];
+        char directive[CACHE_CTRL_MAX];
+        cache_rule_t *rule = &cache_rules[rule_ctr];
+        char *end;
+        int len;
+        int i;
+
+        line += strspn(line, " \t\r\n");
+        if(!*line || *line == '#'){
+                return 0;
+        }
+        if(sscanf(line, "%63s %63s", pattern, directive) != 2 ||
+           rule_ctr == CACHE_RULE_MAX){
+                return -1;
+        }
+
+        if(!strncmp(directive, "max-age=", 8)){
+                errno = 0;
+                rule->max_age = strtol(directive + 8, &end, 10);
+                if(errno || *end || end == directive + 8 ||
+                   rule->max_age < 0){
+                        return -1;
+                }
+                snprintf(rule->cache_ctrl, CACHE_CTRL_MAX, "max-age=%ld",
+                         rule->max_age);
+        }else if(!strcmp(directive, "immutable")){
+                rule->max_age = CACHE_IMMUTABLE_AGE;
+                snprintf(rule->cache_ctrl, CACHE_CTRL_MAX,
+                         "max-age=%d, immutable", CACHE_IMMUTABLE_AGE);
+        }else if(!strcmp(directive, "no-cache") ||
+                 !strcmp(directive, "no-store")){
+                rule->max_age = -1;
+                snprintf(rule->cache_ctrl, CACHE_CTRL_MAX, "%s", directive);
+        }else{
+                return -1;
+        }
+
+        len = strlen(pattern);
+        if(pattern[0] == '/'){
+                if(trie_insert(PREFIX_ROOT, pattern, len, 1, rule_ctr) < 0){
+                        return -1;
+                }
+        }else if(pattern[0] == '*' && len > 1){
+                for(i = 1; i < len; i++){
+                        pattern[i] = tolower((unsigned char)pattern[i]);
+                }
+                if(trie_insert(SUFFIX_ROOT, pattern + 1, len - 1, -1,
+                               rule_ctr) < 0){
+                        return -1;
+                }
+        }else{
+                return -1;
+        }
+        rule_ctr++;
+        return 0;
+}
+
+/**
+ * @brief compile the table of rules
+ * @return 0 on success, ERR_CACHE_POLICY if a rule was left out
+ */
+int cache_policy_init(void)
+{
+        char line[CACHE_PATTERN_MAX + CACHE_CTRL_MAX + 32];
+        int lineno = 0;
+        int ret = 0;
+        unsigned int i;
+        FILE *fp;
+
+        trie[PREFIX_ROOT].child = trie[SUFFIX_ROOT].child = 0;
+        trie[PREFIX_ROOT].rule = trie[SUFFIX_ROOT].rule = -1;
+
+        if(!(fp = fopen(CACHE_POLICY_FILENAME, "r"))){
+                if(errno != ENOENT){
+                        err_printf("open %s failed", CACHE_POLICY_FILENAME);
+                        ret = ERR_CACHE_POLICY;
+                }
+                for(i = 0; i < sizeof(default_rules) / sizeof(char *); i++){
+                        add_rule(default_rules[i]);
+                }
+                return ret;
+        }
+        while(fgets(line, sizeof(line), fp)){
+                lineno++;
+                if(add_rule(line) < 0){
+                        err_printf("%s:%d: rule left out",
+                                   CACHE_POLICY_FILENAME, lineno);
+                        ret = ERR_CACHE_POLICY;
+                }
+        }
+        fclose(fp);
+        dbg_printf("%d cache rules, %d trie nodes", rule_ctr, trie_used);
+        return ret;
+}
+
+/**
+ * @brief find the rule for a url
+ * @param url the request url, a query is ignored
+ * @return the rule, or NULL if none matches
+ */
+const cache_rule_t *cache_policy_lookup(char *url)
+{
+        int len = strcspn(url, "?#");
+        int best = -1;
+        int node;
+        int i;
+
+        for(node = PREFIX_ROOT, i = 0; i < len; i++){
+                if(!(node = trie_child(node, url[i]))){
+                        break;
+                }
+                if(trie[node].rule >= 0 &&
+                   (best < 0 || trie[node].rule < best)){
+                        best = trie[node].rule;
+                }
+        }
+        for(node = SUFFIX_ROOT, i = len - 1; i >= 0; i--){
+                if(!(node = trie_child(node,
+                                       tolower((unsigned char)url[i])))){
+                        break;
+                }
+                if(trie[node].rule >= 0 &&
+                   (best < 0 || trie[node].rule < best)){
+                        best = trie[node].rule;
+                }
+        }
+        return best < 0 ? NULL : &cache_rules[best];
+}
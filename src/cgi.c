@@ -7,10 +7,12 @@
 
 
 
+#define _GNU_SOURCE              /* memmem */
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -19,6 +21,8 @@
 
 #include "srv_def.h"
 #include "http.h"
+#include "compress.h"
+#include "rsp.h"
 #include "err_code.h"
 #include "debug_define.h"
 
@@ -75,19 +79,6 @@ static int create_cgi_arg(char ***argv, req_msg_t *req_msg)
         return 0;
 }
 
-static char *get_field_value(req_msg_t *req_msg, char *field_name)
-{
-        msg_hdr_t *msg_hdr;
-        list_for_each_entry(msg_hdr, &req_msg->msg_hdr_list, 
-                            msg_hdr_link){
-
-                if(!strcmp(msg_hdr->field_name, field_name)){
-                        return msg_hdr->field_value;
-                }
-        }
-        return NULL;
-}
-
 static int create_cgi_env(char ***envp, req_msg_t *req_msg, 
                           cli_cb_base_t *cgi_parent)
 {
@@ -595,6 +586,167 @@ static int create_cgi_env(char ***envp, req_msg_t *req_msg,
         return 0;
 }
 
+/** @brief filter the cgi output through a comp stream if it may be
+ *         compressed */
+static void cgi_comp_start(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb)
+{
+        int enc;
+
+        tcp_cb->comp_stream = NULL;
+        /* chunked needs http/1.1, and a HEAD has no body to compress */
+        if(req_msg->req_line.req == HEAD ||
+           strcmp(req_msg->req_line.ver, "HTTP/1.1") ||
+           !(enc = comp_choose_enc(req_msg))){
+                return;
+        }
+        tcp_cb->comp_stream = comp_stream_new(enc, COMP_CGI_HDR, NULL, NULL);
+}
+
+/* the response header field of name, within [hdr, hdr_end), or NULL */
+static char *cgi_hdr_field(char *hdr, char *hdr_end, char *name)
+{
+        int len = strlen(name);
+        char *line;
+
+        for(line = hdr; line < hdr_end; line += 2){
+                if(hdr_end - line > len && !strncasecmp(line, name, len) &&
+                   line[len] == ':'){
+                        return line + len + 1;
+                }
+                if(!(line = memmem(line, hdr_end - line, LINE_END_STR, 2))){
+                        break;
+                }
+        }
+        return NULL;
+}
+
+/**
+ * @brief decide from the header of the cgi output whether to compress it
+ *
+ * The cgi writes the whole response, status line included. If its body
+ * may be compressed, the header is copied into buf_out with the
+ * Content-Length dropped and the encoding and chunked framing added;
+ * otherwise the output is copied through untouched.
+ *
+ * @param tcp_cb the parent connection, buf_out must be empty
+ * @return Void
+ */
+static void cgi_comp_hdr(cli_cb_tcp_t *tcp_cb)
+{
+        comp_stream_t *cs = tcp_cb->comp_stream;
+        char *hdr_end;
+        char *line, *line_end;
+        char *field;
+        int status;
+        int hdr_len;
+        int ctr;
+        rsp_t rsp;
+
+        if(!(hdr_end = memmem(cs->in_buf, cs->in_ctr, "\r\n\r\n", 4))){
+                if(cs->in_ctr == BUF_OUT_SIZE || cs->in_eof){
+                        /* not a header we understand */
+                        cs->mode = COMP_CGI_RAW;
+                }
+                return;
+        }
+        hdr_end += 2;
+        hdr_len = hdr_end + 2 - cs->in_buf;
+        cs->mode = COMP_CGI_RAW;
+
+        if(sscanf(cs->in_buf, "HTTP/%*d.%*d %d", &status) != 1 ||
+           status < 200 || status == 204 || status == 304){
+                return;
+        }
+        if(!(field = cgi_hdr_field(cs->in_buf, hdr_end, "Content-Type")) ||
+           !comp_is_compressible(field) ||
+           cgi_hdr_field(cs->in_buf, hdr_end, "Content-Encoding") ||
+           cgi_hdr_field(cs->in_buf, hdr_end, "Transfer-Encoding")){
+                return;
+        }
+
+        /* rewrite the header, it only gets shorter but for the fields
+         * added at the end */
+        rsp_init(&rsp, tcp_cb->buf_out, BUF_OUT_SIZE);
+        for(line = cs->in_buf; line < hdr_end; line = line_end + 2){
+                line_end = memmem(line, hdr_end - line, LINE_END_STR, 2);
+                if(!strncasecmp(line, "Content-Length:", 15)){
+                        continue;
+                }
+                rsp_bytes(&rsp, line, line_end + 2 - line);
+        }
+        rsp_field(&rsp, "Content-Encoding", comp_enc_name(cs->enc));
+        rsp_lit(&rsp, "Vary: Accept-Encoding\r\n"
+                "Transfer-Encoding: chunked\r\n");
+        rsp_end(&rsp);
+        if((ctr = rsp_done(&rsp)) < 0){
+                /* no room for the new fields, leave the output alone */
+                tcp_cb->buf_out_ctr = 0;
+                return;
+        }
+        tcp_cb->buf_out_ctr = ctr;
+        cs->in_pos = hdr_len;
+        cs->mode = COMP_CGI_DEFLATE;
+}
+
+/**
+ * @brief move pending cgi output through the comp stream into buf_out
+ *
+ * Called whenever cgi output arrives or buf_out may have drained. Once
+ * the cgi is gone and the stream ended, the parent leaves cgi pending.
+ *
+ * @param tcp_cb the parent connection
+ * @return 0 on success, negative error code on failure
+ */
+int cgi_comp_drain(cli_cb_tcp_t *tcp_cb)
+{
+        comp_stream_t *cs = tcp_cb->comp_stream;
+        int consumed;
+        int ctr;
+
+        if(!is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){
+                return 0;
+        }
+        tcp_cb->buf_out_ctr = 0;
+        if(cs->mode == COMP_CGI_HDR){
+                cgi_comp_hdr(tcp_cb);
+        }
+
+        if(cs->mode == COMP_CGI_DEFLATE){
+                ctr = comp_deflate_chunk(cs, cs->in_buf + cs->in_pos,
+                                         cs->in_ctr - cs->in_pos, &consumed,
+                                         cs->in_eof,
+                                         tcp_cb->buf_out + tcp_cb->buf_out_ctr,
+                                         BUF_OUT_SIZE - tcp_cb->buf_out_ctr);
+                if(ctr < 0){
+                        return ctr;
+                }
+                cs->in_pos += consumed;
+                tcp_cb->buf_out_ctr += ctr;
+        }else if(cs->mode == COMP_CGI_RAW){
+                ctr = cs->in_ctr - cs->in_pos;
+                memcpy(tcp_cb->buf_out, cs->in_buf + cs->in_pos, ctr);
+                cs->in_pos += ctr;
+                tcp_cb->buf_out_ctr = ctr;
+                cs->is_done = cs->in_eof;
+        }
+        tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
+        /* move what deflate left over to the front, or a full in_buf
+         * would never take another read from the cgi */
+        if(cs->in_pos > 0){
+                memmove(cs->in_buf, cs->in_buf + cs->in_pos,
+                        cs->in_ctr - cs->in_pos);
+                cs->in_ctr -= cs->in_pos;
+                cs->in_pos = 0;
+        }
+
+        if(cs->is_done && cs->in_pos == cs->in_ctr){
+                comp_stream_free(cs);
+                tcp_cb->comp_stream = NULL;
+                tcp_cb->is_cgi_pending = 0;
+        }
+        return 0;
+}
+
 int handle_cgi(req_msg_t *req_msg, cli_cb_base_t *cb)
 {
         pid_t pid;
@@ -698,7 +850,7 @@ int handle_cgi(req_msg_t *req_msg, cli_cb_base_t *cb)
                         ret = ERR_INIT_CLI;
                         goto out4;                        
                 }                
-                
+                cgi_comp_start(req_msg, tcp_cb);
         }
 
         return 0;        
@@ -0,0 +1,375 @@
+/** @file compress.c
+ *  @brief on-the-fly gzip/deflate of responses, and the cache of
+ *         compressed static resources
+ *
+ *  A comp stream deflates a response body piece by piece, each piece
+ *  framed as one http/1.1 chunk, so a response is compressed only as
+ *  fast as buf_out drains and is never buffered as a whole.
+ *
+ *  While a static resource is compressed, its output is also collected
+ *  into a comp entry, which is published into the cache when the stream
+ *  ends. Later requests are served straight from the entry, with a
+ *  Content-Length. Entries are keyed by path, mtime, size, inode and
+ *  encoding, so a modified file simply misses and its stale entries age
+ *  out of the lru. Entries are refcounted since eviction may happen
+ *  while a connection is still sending one.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "list.h"
+#include "http.h"
+#include "srv_def.h"
+#include "compress.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+static struct list_head comp_hash[COMP_CACHE_HASH_SIZE];
+static struct list_head comp_lru;        /* most recently used first */
+static int comp_cache_bytes = 0;
+static int comp_cache_inited = 0;
+
+/* mime types worth compressing, matched as prefixes */
+static char *comp_types[] = {
+        "text/",
+        "application/javascript",
+        "application/json",
+        "application/xml",
+        "image/svg+xml",
+        NULL,
+};
+
+
+/**
+ * @brief pick the encoding to compress the response with
+ * @return ENC_GZIP, ENC_DEFLATE, or 0 if the client accepts neither
+ */
+int comp_choose_enc(req_msg_t *req_msg)
+{
+        char *field_value;
+        int enc;
+
+        if(!(field_value = get_field_value(req_msg, "Accept-Encoding"))){
+                return 0;
+        }
+        enc = parse_accept_encoding(field_value);
+        if(enc & ENC_GZIP){
+                return ENC_GZIP;
+        }
+        return enc & ENC_DEFLATE;
+}
+
+char *comp_enc_name(int enc)
+{
+        switch(enc){
+        case ENC_GZIP:
+                return "gzip";
+        case ENC_DEFLATE:
+                return "deflate";
+        case ENC_BR:
+                return "br";
+        }
+        return NULL;
+}
+
+int comp_is_compressible(char *mime_type)
+{
+        int i;
+        mime_type += strspn(mime_type, " \t");
+        for(i = 0; comp_types[i]; i++){
+                if(!strncasecmp(mime_type, comp_types[i],
+                                strlen(comp_types[i]))){
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+
+static unsigned int hash_path(char *path)
+{
+        uint32_t h = 2166136261U;
+        while(*path){
+                h ^= (unsigned char)*(path++);
+                h *= 16777619U;
+        }
+        return h % COMP_CACHE_HASH_SIZE;
+}
+
+static void init_cache(void)
+{
+        int i;
+        for(i = 0; i < COMP_CACHE_HASH_SIZE; i++){
+                INIT_LIST_HEAD(&comp_hash[i]);
+        }
+        INIT_LIST_HEAD(&comp_lru);
+        comp_cache_inited = 1;
+}
+
+static void free_entry(comp_entry_t *entry)
+{
+        free(entry->data);
+        free(entry);
+}
+
+static void evict_entry(comp_entry_t *entry)
+{
+        dbg_printf("comp cache evict (%s)", entry->path);
+        list_del(&entry->hash_link);
+        list_del(&entry->lru_link);
+        comp_cache_bytes -= entry->len;
+        entry->is_cached = 0;
+        if(!entry->ref){
+                free_entry(entry);
+        }
+}
+
+/** @brief link a completed entry into the cache, evicting lru entries */
+static void publish_entry(comp_entry_t *entry)
+{
+        comp_entry_t *item;
+        struct list_head *bucket;
+
+        if(!comp_cache_inited){
+                init_cache();
+        }
+        bucket = &comp_hash[hash_path(entry->path)];
+        list_for_each_entry(item, bucket, hash_link){
+                if(item->enc == entry->enc && !strcmp(item->path, entry->path)
+                   && item->mtime == entry->mtime && item->size == entry->size
+                   && item->ino == entry->ino){
+                        /* a concurrent sender won the race */
+                        return;
+                }
+        }
+        while(comp_cache_bytes + entry->len > COMP_CACHE_MAX_BYTES &&
+              !list_empty(&comp_lru)){
+                evict_entry(list_entry(comp_lru.prev, comp_entry_t,
+                                       lru_link));
+        }
+        list_add(&entry->hash_link, bucket);
+        list_add(&entry->lru_link, &comp_lru);
+        comp_cache_bytes += entry->len;
+        entry->is_cached = 1;
+        entry->ref++;
+        dbg_printf("comp cache insert (%s), len(%d)", entry->path, entry->len);
+}
+
+/**
+ * @brief look up the compressed body of a static resource
+ * @param path the path of the resource
+ * @param statbuf the stat of the opened resource
+ * @param enc the encoding
+ * @return the entry with a reference taken, or NULL on a miss
+ */
+comp_entry_t *comp_cache_get(char *path, struct stat *statbuf, int enc)
+{
+        comp_entry_t *entry, *entry_next;
+
+        if(!comp_cache_inited){
+                return NULL;
+        }
+        list_for_each_entry_safe(entry, entry_next,
+                                 &comp_hash[hash_path(path)], hash_link){
+                if(entry->enc != enc || strcmp(entry->path, path)){
+                        continue;
+                }
+                if(entry->mtime != statbuf->st_mtime ||
+                   entry->size != statbuf->st_size ||
+                   entry->ino != statbuf->st_ino){
+                        /* the file changed under the entry */
+                        evict_entry(entry);
+                        continue;
+                }
+                list_del(&entry->lru_link);
+                list_add(&entry->lru_link, &comp_lru);
+                entry->ref++;
+                return entry;
+        }
+        return NULL;
+}
+
+void comp_entry_put(comp_entry_t *entry)
+{
+        if(--entry->ref == 0 && !entry->is_cached){
+                free_entry(entry);
+        }
+}
+
+static comp_entry_t *new_entry(char *path, struct stat *statbuf, int enc)
+{
+        comp_entry_t *entry;
+
+        if(!(entry = (comp_entry_t *)malloc(sizeof(comp_entry_t)))){
+                return NULL;
+        }
+        snprintf(entry->path, FILENAME_MAX_LEN, "%s", path);
+        entry->mtime = statbuf->st_mtime;
+        entry->size = statbuf->st_size;
+        entry->ino = statbuf->st_ino;
+        entry->enc = enc;
+        entry->data = NULL;
+        entry->len = 0;
+        entry->cap = 0;
+        entry->ref = 1;
+        entry->is_cached = 0;
+        return entry;
+}
+
+/* collect output for the cache, give up on it if it grows too big */
+static void append_entry(comp_stream_t *cs, char *data, int len)
+{
+        comp_entry_t *entry = cs->entry;
+        int cap;
+        char *buf;
+
+        if(entry->len + len > COMP_CACHE_MAX_FILE){
+                goto out1;
+        }
+        if(entry->len + len > entry->cap){
+                cap = entry->cap ? entry->cap : BUF_OUT_SIZE;
+                while(cap < entry->len + len){
+                        cap *= 2;
+                }
+                if(!(buf = (char *)realloc(entry->data, cap))){
+                        goto out1;
+                }
+                entry->data = buf;
+                entry->cap = cap;
+        }
+        memcpy(entry->data + entry->len, data, len);
+        entry->len += len;
+        return;
+ out1:
+        comp_entry_put(entry);
+        cs->entry = NULL;
+}
+
+
+/**
+ * @brief set up a comp stream
+ * @param enc ENC_GZIP or ENC_DEFLATE
+ * @param mode what the stream compresses
+ * @param path path of the static resource to cache the output for,
+ *        NULL if the output is not to be cached
+ * @param statbuf stat of the static resource, or NULL
+ * @return the stream, or NULL on failure
+ */
+comp_stream_t *comp_stream_new(int enc, enum comp_mode mode,
+                               char *path, struct stat *statbuf)
+{
+        comp_stream_t *cs;
+        int window_bits = enc == ENC_GZIP ? 15 + 16 : 15;
+
+        if(!(cs = (comp_stream_t *)malloc(sizeof(comp_stream_t)))){
+                return NULL;
+        }
+        memset(&cs->strm, 0, sizeof(cs->strm));
+        if(deflateInit2(&cs->strm, COMP_LEVEL, Z_DEFLATED, window_bits,
+                        8, Z_DEFAULT_STRATEGY) != Z_OK){
+                free(cs);
+                return NULL;
+        }
+        cs->enc = enc;
+        cs->mode = mode;
+        cs->is_flush_pending = 0;
+        cs->is_done = 0;
+        cs->entry = NULL;
+        cs->in_pos = 0;
+        cs->in_ctr = 0;
+        cs->in_eof = 0;
+        if(path && statbuf->st_size <= COMP_CACHE_MAX_FILE){
+                cs->entry = new_entry(path, statbuf, enc);
+        }
+        return cs;
+}
+
+void comp_stream_free(comp_stream_t *cs)
+{
+        deflateEnd(&cs->strm);
+        if(cs->entry){
+                comp_entry_put(cs->entry);
+        }
+        free(cs);
+}
+
+/**
+ * @brief deflate input into one chunk of at most room bytes
+ *
+ * With finish set, in must hold all the remaining input; once the
+ * stream ends the last chunk is appended as well and is_done is set.
+ * Without finish the output is flushed, so the client gets everything
+ * fed in so far. Call again without input while a full chunk comes
+ * back, zlib may still hold output.
+ *
+ * @param cs the comp stream
+ * @param in the input
+ * @param in_len # of input bytes
+ * @param consumed set to the # of input bytes consumed
+ * @param finish whether in holds the end of the input
+ * @param out where the chunk goes
+ * @param room # of bytes available at out
+ * @return # of bytes written to out, negative error code on failure
+ */
+int comp_deflate_chunk(comp_stream_t *cs, char *in, int in_len,
+                       int *consumed, int finish, char *out, int room)
+{
+        char chunk_hdr[COMP_CHUNK_HDR_LEN + 1];
+        int data_room;
+        int ctr = 0;
+        int produced;
+        int ret;
+
+        *consumed = 0;
+        if(cs->is_done || room < COMP_CHUNK_MIN_ROOM){
+                return 0;
+        }
+        data_room = room - COMP_CHUNK_OVERHEAD - (sizeof(COMP_LAST_CHUNK) - 1);
+        if(data_room > 0xffff){
+                data_room = 0xffff;
+        }
+
+        cs->strm.next_in = (Bytef *)in;
+        cs->strm.avail_in = in_len;
+        cs->strm.next_out = (Bytef *)(out + COMP_CHUNK_HDR_LEN);
+        cs->strm.avail_out = data_room;
+        ret = deflate(&cs->strm, finish ? Z_FINISH : Z_SYNC_FLUSH);
+        if(ret == Z_STREAM_ERROR){
+                err_printf("deflate failed");
+                return ERR_COMPRESS;
+        }
+        *consumed = in_len - cs->strm.avail_in;
+        produced = data_room - cs->strm.avail_out;
+        cs->is_flush_pending = !cs->strm.avail_out;
+
+        if(produced){
+                snprintf(chunk_hdr, sizeof(chunk_hdr), "%04x\r\n", produced);
+                memcpy(out, chunk_hdr, COMP_CHUNK_HDR_LEN);
+                memcpy(out + COMP_CHUNK_HDR_LEN + produced, LINE_END_STR, 2);
+                ctr = produced + COMP_CHUNK_OVERHEAD;
+                if(cs->entry){
+                        append_entry(cs, out + COMP_CHUNK_HDR_LEN, produced);
+                }
+        }
+        if(ret == Z_STREAM_END){
+                memcpy(out + ctr, COMP_LAST_CHUNK, sizeof(COMP_LAST_CHUNK) - 1);
+                ctr += sizeof(COMP_LAST_CHUNK) - 1;
+                cs->is_done = 1;
+                if(cs->entry){
+                        publish_entry(cs->entry);
+                        comp_entry_put(cs->entry);
+                        cs->entry = NULL;
+                }
+        }
+        return ctr;
+}
@@ -0,0 +1,143 @@
+/** @file docroot.c
+ *  @brief opening resources beneath the docroot
+ *
+ *  Paths handed in are the ones the server keys its caches by, i.e. the
+ *  docroot followed by the url; the docroot prefix is stripped and the
+ *  rest is walked from the docroot fd, so the kernel doesn't walk the
+ *  docroot itself on every request and the cwd no longer matters.
+ *
+ *  openat2 with RESOLVE_BENEATH refuses anything that resolves outside
+ *  the docroot, be it through ".." or a symlink. On kernels without it
+ *  openat is used, after a lexical check that the path has no ".."
+ *  segment. If the docroot can't be opened, paths are opened as they
+ *  are, from the cwd.
+ *
+ *  @author Chen Chen
+ *  @bug symlinks pointing out of the docroot are only refused by openat2
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+#include "srv_def.h"
+#include "docroot.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+static int docroot_fd = -1;
+static char *docroot_prefix = NULL;
+static int has_openat2 = 0;
+
+
+static int openat2_beneath(int dirfd, char *path)
+{
+        struct open_how how;
+
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH;
+        return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+/**
+ * @brief open the docroot, and find out whether openat2 is there
+ * @param docroot the docroot, as paths to open are prefixed with
+ * @return 0 on success, negative error code on failure
+ */
+int docroot_init(char *docroot)
+{
+        int fd;
+
+        if((docroot_fd = open(docroot, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+           < 0){
+                err_printf("open docroot %s failed", docroot);
+                return ERR_DOCROOT;
+        }
+        docroot_prefix = docroot;
+        if((fd = openat2_beneath(docroot_fd, ".")) >= 0){
+                close(fd);
+                has_openat2 = 1;
+        }
+        dbg_printf("docroot fd(%d), openat2(%d)", docroot_fd, has_openat2);
+        return 0;
+}
+
+/* the path relative to the docroot */
+static char *rel_path(char *path)
+{
+        size_t len = strlen(docroot_prefix);
+
+        if(!strncmp(path, docroot_prefix, len)){
+                path += len;
+        }
+        path += strspn(path, "/");
+        return *path ? path : ".";
+}
+
+/* lexical stand-in for RESOLVE_BENEATH: no ".." segment */
+static int is_beneath(char *path)
+{
+        char *seg;
+
+        for(seg = path; seg; seg = strchr(seg, '/')){
+                seg += *seg == '/';
+                if(seg[0] == '.' && seg[1] == '.' &&
+                   (seg[2] == '/' || !seg[2])){
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/**
+ * @brief open a resource read only
+ * @param path the docroot followed by the path of the resource
+ * @return the fd, -1 with errno set on failure; EXDEV if the path
+ *         leads out of the docroot
+ */
+int docroot_open(char *path)
+{
+        if(docroot_fd < 0){
+                return open(path, O_RDONLY | O_CLOEXEC);
+        }
+        path = rel_path(path);
+        if(has_openat2){
+                return openat2_beneath(docroot_fd, path);
+        }
+        if(!is_beneath(path)){
+                errno = EXDEV;
+                return -1;
+        }
+        return openat(docroot_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * @brief stat a resource without opening it
+ *
+ * Only the lexical check applies here, there is no stat with
+ * RESOLVE_BENEATH; what is served is always opened by docroot_open.
+ *
+ * @param path the docroot followed by the path of the resource
+ * @param statbuf filled on success
+ * @return 0 on success, -1 with errno set on failure
+ */
+int docroot_stat(char *path, struct stat *statbuf)
+{
+        if(docroot_fd < 0){
+                return stat(path, statbuf);
+        }
+        path = rel_path(path);
+        if(!is_beneath(path)){
+                errno = EXDEV;
+                return -1;
+        }
+        return fstatat(docroot_fd, path, statbuf, 0);
+}
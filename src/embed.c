@@ -0,0 +1,60 @@
+/** @file embed.c
+ *  @brief lookup of the static site compiled into the server binary
+ *
+ *  The table is a weak reference: it is only there if embed_site.o is
+ *  linked in, see `make embed`.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <string.h>
+
+#include "http.h"
+#include "embed.h"
+
+
+extern const embed_site_t embed_site __attribute__((weak));
+
+
+/**
+ * @brief look up an embedded resource
+ * @param path the normalized url path
+ * @return the resource, or NULL if it is not embedded
+ */
+const embed_rsrc_t *embed_lookup(char *path)
+{
+        const embed_site_t *site = &embed_site;
+        const embed_rsrc_t *rsrc;
+        int idx;
+
+        if(!site || !site->slot_ctr){
+                return NULL;
+        }
+        idx = site->slots[embed_hash(path, site->seed) % site->slot_ctr];
+        if(idx < 0){
+                return NULL;
+        }
+        rsrc = &site->rsrcs[idx];
+        return strcmp(rsrc->path, path) ? NULL : rsrc;
+}
+
+/**
+ * @brief pick the smallest variant the client accepts
+ * @param rsrc the resource
+ * @param accepted mask of ENC_* the client accepts
+ * @return the variant, identity if nothing else is accepted
+ */
+const embed_var_t *embed_select(const embed_rsrc_t *rsrc, int accepted)
+{
+        const embed_var_t *best = &rsrc->vars[0];
+        int i;
+
+        for(i = 1; i < rsrc->var_ctr; i++){
+                if((rsrc->vars[i].enc & accepted) &&
+                   rsrc->vars[i].len < best->len){
+                        best = &rsrc->vars[i];
+                }
+        }
+        return best;
+}
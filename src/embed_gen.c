@@ -0,0 +1,355 @@
+/** @file embed_gen.c
+ *  @brief compile the docroot into a C translation unit, see embed.h
+ *
+ *  usage: embed_gen <docroot> > embed_site.c
+ *
+ *  Every regular file below docroot becomes a resource, except the
+ *  .gz/.br sidecars, which become variants of the file they belong to.
+ *  A gzip variant is added when it saves at least EMBED_MIN_SAVING of
+ *  the size. The headers are rendered the way fill_rsp_hdr() prints
+ *  them, with the Date left to be patched in by the server.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#define _GNU_SOURCE              /* nftw */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "http.h"
+#include "embed.h"
+#include "hdr_cache.h"
+
+
+#define EMBED_RSRC_MAX     4096
+#define EMBED_MIN_SAVING   10        /* in percent */
+#define EMBED_SEED_TRIES   (1 << 20)
+#define EMBED_DATE_DUMMY   "Thu, 01 Jan 1970 00:00:00 GMT"
+
+struct gen_var{
+        int enc;
+        char *body;
+        long len;
+};
+
+struct gen_rsrc{
+        char path[FILENAME_MAX_LEN];
+        char *mime_type;
+        char etag[ETAG_MAX_LEN];
+        time_t mtime;
+        int var_ctr;
+        struct gen_var vars[EMBED_VAR_MAX];
+        int alias_of;                    /* index of the original, or -1 */
+};
+
+
+static struct gen_rsrc rsrcs[EMBED_RSRC_MAX];
+static int rsrc_ctr = 0;
+static int root_len;
+
+
+static char *read_file(const char *path, long *len)
+{
+        FILE *fp;
+        char *buf;
+        struct stat statbuf;
+
+        if(stat(path, &statbuf) < 0 || !(fp = fopen(path, "rb"))){
+                return NULL;
+        }
+        /* one extra byte, so an empty file still gets a buffer */
+        if(!(buf = malloc(statbuf.st_size + 1))){
+                fclose(fp);
+                return NULL;
+        }
+        *len = fread(buf, 1, statbuf.st_size, fp);
+        fclose(fp);
+        return buf;
+}
+
+static char *gzip_buf(char *in, long in_len, long *out_len)
+{
+        z_stream strm;
+        char *out;
+        long cap;
+
+        memset(&strm, 0, sizeof(strm));
+        if(deflateInit2(&strm, 9, Z_DEFLATED, 15 + 16, 9,
+                        Z_DEFAULT_STRATEGY) != Z_OK){
+                return NULL;
+        }
+        cap = deflateBound(&strm, in_len) + 64;
+        if(!(out = malloc(cap))){
+                deflateEnd(&strm);
+                return NULL;
+        }
+        strm.next_in = (Bytef *)in;
+        strm.avail_in = in_len;
+        strm.next_out = (Bytef *)out;
+        strm.avail_out = cap;
+        if(deflate(&strm, Z_FINISH) != Z_STREAM_END){
+                deflateEnd(&strm);
+                free(out);
+                return NULL;
+        }
+        *out_len = cap - strm.avail_out;
+        deflateEnd(&strm);
+        return out;
+}
+
+/* strong tag from the content, so rebuilds of the same site agree */
+static void content_etag(char *body, long len, char *etag)
+{
+        uint64_t h = 0xcbf29ce484222325ULL;
+        long i;
+        for(i = 0; i < len; i++){
+                h ^= (unsigned char)body[i];
+                h *= 0x100000001b3ULL;
+        }
+        snprintf(etag, ETAG_MAX_LEN, "e%016llx-%lx", (unsigned long long)h,
+                 len);
+}
+
+static int has_suffix(const char *path, const char *suffix)
+{
+        int len = strlen(path);
+        int suffix_len = strlen(suffix);
+        return len > suffix_len && !strcmp(path + len - suffix_len, suffix);
+}
+
+static int add_rsrc(const char *fpath, const struct stat *sb, int type,
+                    struct FTW *ftwbuf)
+{
+        struct gen_rsrc *rsrc;
+        char sidecar[FILENAME_MAX_LEN];
+        char *body;
+        long len;
+
+        if(type != FTW_F || has_suffix(fpath, ".gz") ||
+           has_suffix(fpath, ".br")){
+                return 0;
+        }
+        if(rsrc_ctr == EMBED_RSRC_MAX ||
+           strlen(fpath + root_len) + 2 > FILENAME_MAX_LEN){
+                fprintf(stderr, "embed_gen: skipping %s\n", fpath);
+                return 0;
+        }
+        if(!(body = read_file(fpath, &len))){
+                fprintf(stderr, "embed_gen: can't read %s\n", fpath);
+                return -1;
+        }
+        rsrc = &rsrcs[rsrc_ctr++];
+        snprintf(rsrc->path, FILENAME_MAX_LEN, "/%s", fpath + root_len);
+        rsrc->mime_type = hdr_mime_type(rsrc->path);
+        content_etag(body, len, rsrc->etag);
+        rsrc->mtime = sb->st_mtime;
+        rsrc->alias_of = -1;
+        rsrc->vars[0].enc = 0;
+        rsrc->vars[0].body = body;
+        rsrc->vars[0].len = len;
+        rsrc->var_ctr = 1;
+
+        if((body = gzip_buf(rsrc->vars[0].body, len, &len))){
+                if(len * 100 <= rsrc->vars[0].len * (100 - EMBED_MIN_SAVING)){
+                        rsrc->vars[rsrc->var_ctr].enc = ENC_GZIP;
+                        rsrc->vars[rsrc->var_ctr].body = body;
+                        rsrc->vars[rsrc->var_ctr].len = len;
+                        rsrc->var_ctr++;
+                }else{
+                        free(body);
+                }
+        }
+        snprintf(sidecar, FILENAME_MAX_LEN, "%s.br", fpath);
+        if((body = read_file(sidecar, &len))){
+                rsrc->vars[rsrc->var_ctr].enc = ENC_BR;
+                rsrc->vars[rsrc->var_ctr].body = body;
+                rsrc->vars[rsrc->var_ctr].len = len;
+                rsrc->var_ctr++;
+        }
+        return 0;
+}
+
+
+/* print str as a C string literal */
+static void put_str(const char *str, int len)
+{
+        int i;
+        putchar('"');
+        for(i = 0; i < len; i++){
+                unsigned char c = str[i];
+                if(c == '"' || c == '\\' || c < 0x20 || c >= 0x7f){
+                        printf("\\%03o", c);
+                }else{
+                        putchar(c);
+                }
+        }
+        putchar('"');
+}
+
+static void put_body(int i, int j, struct gen_var *var)
+{
+        long k;
+
+        printf("static const char body_%d_%d[] = {", i, j);
+        for(k = 0; k < var->len; k++){
+                printf("%s0x%02x,", k % 12 ? " " : "\n        ",
+                       (unsigned char)var->body[k]);
+        }
+        printf("%s};\n", var->len ? "\n" : "0");
+}
+
+static char *enc_name(int enc)
+{
+        return enc == ENC_GZIP ? "gzip" : enc == ENC_BR ? "br" : NULL;
+}
+
+/* the header fill_rsp_hdr() would print for a full 200 */
+static void put_hdr(int i, int j, struct gen_rsrc *rsrc)
+{
+        struct gen_var *var = &rsrc->vars[j];
+        char hdr[HDR_TMPL_MAX * 2];
+        char date[HTTP_DATE_LEN + 1];
+        int ctr = 0;
+
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT",
+                 gmtime(&rsrc->mtime));
+        ctr += snprintf(hdr + ctr, sizeof(hdr) - ctr,
+                        "HTTP/1.1 200 OK\r\nDate: " EMBED_DATE_DUMMY "\r\n"
+                        "Content-Type: %s\r\n", rsrc->mime_type);
+        if(var->enc){
+                ctr += snprintf(hdr + ctr, sizeof(hdr) - ctr,
+                                "Content-Encoding: %s\r\n",
+                                enc_name(var->enc));
+        }
+        if(rsrc->var_ctr > 1){
+                ctr += snprintf(hdr + ctr, sizeof(hdr) - ctr,
+                                "Vary: Accept-Encoding\r\n");
+        }
+        ctr += snprintf(hdr + ctr, sizeof(hdr) - ctr,
+                        "ETag: \"%s%s%s\"\r\n"
+                        "Last-Modified: %s\r\n"
+                        "Accept-Ranges: bytes\r\n"
+                        "Content-Length: %ld\r\n\r\n",
+                        rsrc->etag, var->enc ? "-" : "",
+                        var->enc ? enc_name(var->enc) : "", date, var->len);
+        printf("static const char hdr_%d_%d[] = ", i, j);
+        put_str(hdr, ctr);
+        printf(";\n");
+}
+
+/* find a seed under which no two paths share a slot */
+static int find_seed(uint32_t slot_ctr, uint32_t *seed, int16_t *slots)
+{
+        uint32_t s;
+        uint32_t h;
+        int i;
+
+        for(s = 0; s < EMBED_SEED_TRIES; s++){
+                memset(slots, 0xff, sizeof(int16_t) * slot_ctr);
+                for(i = 0; i < rsrc_ctr; i++){
+                        h = embed_hash(rsrcs[i].path, s) % slot_ctr;
+                        if(slots[h] >= 0){
+                                break;
+                        }
+                        slots[h] = i;
+                }
+                if(i == rsrc_ctr){
+                        *seed = s;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+
+int main(int argc, char *argv[])
+{
+        char root[FILENAME_MAX_LEN];
+        uint32_t slot_ctr = 8;
+        uint32_t seed;
+        int16_t *slots;
+        int i, j, n;
+
+        if(argc != 2){
+                fprintf(stderr, "usage: %s <docroot>\n", argv[0]);
+                return 1;
+        }
+        snprintf(root, sizeof(root), "%s%s", argv[1],
+                 has_suffix(argv[1], "/") ? "" : "/");
+        root_len = strlen(root);
+        if(nftw(root, add_rsrc, 16, FTW_PHYS) < 0){
+                fprintf(stderr, "embed_gen: can't walk %s\n", root);
+                return 1;
+        }
+        /* "/" is answered with the root index.html */
+        for(i = 0, n = rsrc_ctr; i < n && rsrc_ctr < EMBED_RSRC_MAX; i++){
+                if(!strcmp(rsrcs[i].path, "/index.html")){
+                        rsrcs[rsrc_ctr] = rsrcs[i];
+                        strcpy(rsrcs[rsrc_ctr].path, "/");
+                        rsrcs[rsrc_ctr].alias_of = i;
+                        rsrc_ctr++;
+                }
+        }
+
+        while(slot_ctr < 2 * (uint32_t)rsrc_ctr){
+                slot_ctr *= 2;
+        }
+        while(1){
+                if(!(slots = malloc(sizeof(int16_t) * slot_ctr))){
+                        return 1;
+                }
+                if(find_seed(slot_ctr, &seed, slots) == 0){
+                        break;
+                }
+                free(slots);
+                slot_ctr *= 2;
+        }
+
+        printf("/* generated by embed_gen from %s, do not edit */\n\n"
+               "#include <stdint.h>\n\n"
+               "#include \"http.h\"\n"
+               "#include \"embed.h\"\n\n", argv[1]);
+        for(i = 0; i < rsrc_ctr; i++){
+                if(rsrcs[i].alias_of >= 0){
+                        continue;
+                }
+                for(j = 0; j < rsrcs[i].var_ctr; j++){
+                        put_body(i, j, &rsrcs[i].vars[j]);
+                        put_hdr(i, j, &rsrcs[i]);
+                }
+        }
+
+        printf("\nstatic const embed_rsrc_t rsrcs[] = {\n");
+        for(i = 0; i < rsrc_ctr; i++){
+                n = rsrcs[i].alias_of >= 0 ? rsrcs[i].alias_of : i;
+                printf("        {");
+                put_str(rsrcs[i].path, strlen(rsrcs[i].path));
+                printf(", \"%s\", \"%s\", %lld, %d, {\n", rsrcs[i].mime_type,
+                       rsrcs[i].etag, (long long)rsrcs[i].mtime,
+                       rsrcs[i].var_ctr);
+                for(j = 0; j < rsrcs[i].var_ctr; j++){
+                        printf("                {%d, hdr_%d_%d, "
+                               "sizeof(hdr_%d_%d) - 1, body_%d_%d, %ld},\n",
+                               rsrcs[i].vars[j].enc, n, j, n, j, n, j,
+                               rsrcs[i].vars[j].len);
+                }
+                printf("        }},\n");
+        }
+        printf("};\n\nstatic const int16_t slots[] = {");
+        for(i = 0; i < (int)slot_ctr; i++){
+                printf("%s%d,", i % 16 ? " " : "\n        ", slots[i]);
+        }
+        printf("\n};\n\n"
+               "const embed_site_t embed_site = {\n"
+               "        rsrcs, %d, slots, %u, %u,\n"
+               "};\n", rsrc_ctr, slot_ctr, seed);
+        return 0;
+}
@@ -0,0 +1,1665 @@
+/** @file h2.c
+ *  @brief http/2 (RFC 9113) on top of a tcp or tls connection
+ *
+ *  The parse of the connection reassembles frames out of buf_in and acts
+ *  on them; once the header block and the body of a request are in, the
+ *  request is queued on its stream as an HTTP/1.1 req_msg. The
+ *  handle_req_msg of the connection then lets the handlers of each
+ *  stream run and frames what they wrote into buf_out of the connection,
+ *  the most urgent streams first. Control frames (acks, WINDOW_UPDATE,
+ *  RST_STREAM, GOAWAY) wait in a small buffer of their own and go out
+ *  ahead of any stream.
+ *
+ *  A response is taken apart as HTTP/1.1: the status line and fields
+ *  turn into HEADERS, connection-specific fields are dropped, a chunked
+ *  body is de-chunked. It ends once its stream has nothing pending any
+ *  more, with END_STREAM set on the last frame still in buf_out, or on
+ *  an empty DATA frame otherwise.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#define _GNU_SOURCE              /* memmem */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+
+#include "list.h"
+#include "http.h"
+#include "srv_def.h"
+#include "rsp.h"
+#include "h2.h"
+#include "hpack.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+/* room the control frames sent in answer to one frame take at most */
+#define CTL_RESERVE       64
+/* longer field names of a response are dropped */
+#define RSP_NAME_MAX      64
+/* HTTP2-Settings of an upgrade, decoded */
+#define UPGRADE_SETTINGS_MAX  60
+
+/* pseudo-header fields seen in a request */
+#define PSEUDO_METHOD     0x1
+#define PSEUDO_SCHEME     0x2
+#define PSEUDO_PATH       0x4
+#define PSEUDO_AUTHORITY  0x8
+#define PSEUDO_REQUIRED   (PSEUDO_METHOD | PSEUDO_SCHEME | PSEUDO_PATH)
+
+/* decoding a header block, into the request of s if there is one */
+struct hdr_ctx{
+        h2_stream_t *s;
+        int pseudo;
+        int is_regular;                  /* no more pseudo fields */
+        int err;                         /* h2 error of the stream, or 0 */
+};
+
+typedef struct hdr_ctx hdr_ctx_t;
+
+
+static const char *conn_fields[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+        "upgrade", NULL,
+};
+
+
+static uint32_t get_u32(const unsigned char *p)
+{
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_u32(unsigned char *p, uint32_t val)
+{
+        p[0] = val >> 24;
+        p[1] = val >> 16;
+        p[2] = val >> 8;
+        p[3] = val;
+}
+
+static int frame_len(const unsigned char *f)
+{
+        return (f[0] << 16) | (f[1] << 8) | f[2];
+}
+
+static void put_frame_hdr(char *out, int len, int type, int flags,
+                          uint32_t id)
+{
+        unsigned char *p = (unsigned char *)out;
+
+        p[0] = len >> 16;
+        p[1] = len >> 8;
+        p[2] = len;
+        p[3] = type;
+        p[4] = flags;
+        put_u32(p + 5, id & H2_WINDOW_MAX);
+}
+
+/* whether a field only means something to a single HTTP/1 hop */
+static int is_conn_field(const char *name)
+{
+        int i;
+
+        for(i = 0; conn_fields[i]; i++){
+                if(!strcmp(name, conn_fields[i])){
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* whether a comma separated field value has token, in any case */
+static int has_token(const char *value, int len, const char *token)
+{
+        int token_len = strlen(token);
+        int i = 0, start;
+
+        while(i < len){
+                while(i < len && (value[i] == ' ' || value[i] == '\t' ||
+                                  value[i] == ',')){
+                        i++;
+                }
+                start = i;
+                while(i < len && value[i] != ',' && value[i] != ' ' &&
+                      value[i] != '\t' && value[i] != ';'){
+                        i++;
+                }
+                if(i - start == token_len &&
+                   !strncasecmp(value + start, token, token_len)){
+                        return 1;
+                }
+                while(i < len && value[i] != ','){
+                        i++;
+                }
+        }
+        return 0;
+}
+
+
+/*
+ * control frames
+ */
+
+/* queue a control frame, the caller left CTL_RESERVE for it */
+static void ctl_frame(h2_conn_t *conn, int type, int flags, uint32_t id,
+                      const void *payload, int len)
+{
+        if(conn->ctl_ctr + H2_FRAME_HDR_LEN + len > H2_CTL_SIZE){
+                err_printf("h2 control frame dropped, type 0x%x", type);
+                return;
+        }
+        put_frame_hdr(conn->ctl + conn->ctl_ctr, len, type, flags, id);
+        memcpy(conn->ctl + conn->ctl_ctr + H2_FRAME_HDR_LEN, payload, len);
+        conn->ctl_ctr += H2_FRAME_HDR_LEN + len;
+}
+
+/**
+ * @brief move the control frames into buf_out, as far as it has room
+ * @return # of bytes still waiting; no stream frame may go out before
+ *         they are gone, or it would land inside one of them
+ */
+static int flush_ctl(h2_conn_t *conn)
+{
+        cli_cb_tcp_t *tcp_cb = conn->tcp_cb;
+        int n = BUF_OUT_SIZE - tcp_cb->buf_out_ctr;
+
+        if(n > conn->ctl_ctr){
+                n = conn->ctl_ctr;
+        }
+        memcpy(tcp_cb->buf_out + tcp_cb->buf_out_ctr, conn->ctl, n);
+        tcp_cb->buf_out_ctr += n;
+        tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
+        memmove(conn->ctl, conn->ctl + n, conn->ctl_ctr - n);
+        conn->ctl_ctr -= n;
+        return conn->ctl_ctr;
+}
+
+static void rst(h2_conn_t *conn, uint32_t id, int err)
+{
+        unsigned char payload[4];
+
+        put_u32(payload, err);
+        ctl_frame(conn, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+static void window_update(h2_conn_t *conn, uint32_t id, int inc)
+{
+        unsigned char payload[4];
+
+        put_u32(payload, inc);
+        ctl_frame(conn, H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/* a connection error: GOAWAY, then the connection is closed once it is
+ * out, nothing more is read */
+static void conn_error(h2_conn_t *conn, int err)
+{
+        unsigned char payload[8];
+
+        if(conn->is_goaway){
+                return;
+        }
+        dbg_printf("h2 conn(%d) error 0x%x", conn->tcp_cb->cli_fd, err);
+        put_u32(payload, conn->last_stream_id);
+        put_u32(payload + 4, err);
+        ctl_frame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+        conn->is_goaway = 1;
+}
+
+
+/*
+ * streams
+ */
+
+static h2_stream_t *find_stream(h2_conn_t *conn, uint32_t id)
+{
+        h2_stream_t *s;
+
+        list_for_each_entry(s, &conn->stream_list, link){
+                if(s->id == id){
+                        return s;
+                }
+        }
+        return NULL;
+}
+
+static h2_stream_t *stream_new(h2_conn_t *conn, uint32_t id)
+{
+        h2_stream_t *s;
+        int ret;
+
+        if(!(s = (h2_stream_t *)malloc(sizeof(h2_stream_t)))){
+                goto out1;
+        }
+        if(!(s->req_msg = (req_msg_t *)malloc(sizeof(req_msg_t)))){
+                goto out2;
+        }
+        init_req_msg(s->req_msg);
+        s->req_msg->req_line.req = EXT;
+        if(!(s->req_msg->req_line.ver = strncpy_alloc("HTTP/1.1", 8))){
+                goto out3;
+        }
+        if((ret = init_cli_cb(&s->tcp_base.base, &conn->tcp_cb->base, NULL,
+                              -1, -1, H2_STREAM)) < 0){
+                goto out4;
+        }
+        s->conn = conn;
+        s->id = id;
+        s->state = H2_STREAM_OPEN;
+        s->send_window = conn->peer_window_init;
+        s->recv_window = H2_WINDOW_INIT;
+        s->urgency = H2_URGENCY_DEFAULT;
+        s->is_incremental = 0;
+        s->hdr_list_len = 0;
+        s->rsp_state = H2_RSP_HDR;
+        s->rsp_hdr_ctr = 0;
+        s->is_hdr_done = 0;
+        s->is_final_sent = 0;
+        s->chunk_left = 0;
+        s->last_off = -1;
+        /* ids only grow, so the list stays in the order of opening */
+        list_add_tail(&s->link, &conn->stream_list);
+        conn->stream_ctr++;
+        return s;
+
+ out4:
+        clear_req_msg(s->req_msg);
+ out3:
+        free(s->req_msg);
+ out2:
+        free(s);
+ out1:
+        return NULL;
+}
+
+/* stop working on a stream, it is freed by the next h2_handle */
+static void stream_close(h2_stream_t *s)
+{
+        s->state = H2_STREAM_DONE;
+        s->tcp_base.base.mthd.close(&s->tcp_base.base);
+}
+
+static void stream_reset(h2_conn_t *conn, h2_stream_t *s, int err)
+{
+        dbg_printf("h2 stream(%u) reset, error 0x%x", s->id, err);
+        rst(conn, s->id, err);
+        stream_close(s);
+}
+
+static void stream_free(h2_conn_t *conn, h2_stream_t *s)
+{
+        list_del(&s->link);
+        conn->stream_ctr--;
+        if(s->req_msg){
+                clear_req_msg(s->req_msg);
+                free(s->req_msg);
+        }
+        s->tcp_base.base.mthd.destroy(&s->tcp_base.base);
+}
+
+/* the urgency and incremental of a Priority field value, "u=1, i" */
+static void parse_priority(h2_stream_t *s, const char *value, int len)
+{
+        const char *end = value + len;
+
+        while(value < end){
+                while(value < end && (*value == ' ' || *value == '\t' ||
+                                      *value == ',')){
+                        value++;
+                }
+                if(end - value >= 3 && value[0] == 'u' && value[1] == '=' &&
+                   value[2] >= '0' && value[2] < '0' + H2_URGENCY_LEVELS){
+                        s->urgency = value[2] - '0';
+                }else if(end - value >= 4 && !memcmp(value, "i=?", 3)){
+                        s->is_incremental = value[3] == '1';
+                }else if(value < end && value[0] == 'i' &&
+                         (end - value == 1 || value[1] == ',' ||
+                          value[1] == ' ' || value[1] == ';')){
+                        s->is_incremental = 1;
+                }
+                while(value < end && *value != ','){
+                        value++;
+                }
+        }
+}
+
+static int add_field(req_msg_t *req_msg, char *name, int name_len,
+                     char *value, int value_len)
+{
+        msg_hdr_t *msg_hdr;
+
+        if(!(msg_hdr = (msg_hdr_t *)malloc(sizeof(msg_hdr_t)))){
+                goto out1;
+        }
+        init_msg_hdr(msg_hdr);
+        if(!(msg_hdr->field_name = strncpy_alloc(name, name_len)) ||
+           !(msg_hdr->field_value = strncpy_alloc(value, value_len))){
+                goto out2;
+        }
+        insert_msg_hdr(msg_hdr, req_msg);
+        return 0;
+
+ out2:
+        free(msg_hdr->field_name);
+        free(msg_hdr);
+ out1:
+        return ERR_NO_MEM;
+}
+
+/* crumbs of a cookie come in fields of their own, HTTP/1 has them in one */
+static int add_cookie(req_msg_t *req_msg, char *value, int value_len)
+{
+        msg_hdr_t *msg_hdr;
+        char *joined;
+        int len;
+
+        list_for_each_entry(msg_hdr, &req_msg->msg_hdr_list, msg_hdr_link){
+                if(strcmp(msg_hdr->field_name, "cookie")){
+                        continue;
+                }
+                len = strlen(msg_hdr->field_value);
+                if(!(joined = (char *)malloc(len + 2 + value_len + 1))){
+                        return ERR_NO_MEM;
+                }
+                memcpy(joined, msg_hdr->field_value, len);
+                memcpy(joined + len, "; ", 2);
+                memcpy(joined + len + 2, value, value_len);
+                joined[len + 2 + value_len] = 0;
+                free(msg_hdr->field_value);
+                msg_hdr->field_value = joined;
+                return 0;
+        }
+        return add_field(req_msg, "cookie", 6, value, value_len);
+}
+
+/* a pseudo-header field of a request */
+static int on_pseudo_field(hdr_ctx_t *ctx, char *name, char *value,
+                           int value_len)
+{
+        req_msg_t *req_msg = ctx->s->req_msg;
+        int bit;
+
+        if(!strcmp(name, ":method")){
+                bit = PSEUDO_METHOD;
+                req_msg->req_line.req = parse_req_mthd(value);
+        }else if(!strcmp(name, ":scheme")){
+                bit = PSEUDO_SCHEME;
+        }else if(!strcmp(name, ":path")){
+                bit = PSEUDO_PATH;
+                if(!value_len || req_msg->req_line.url){
+                        return H2_PROTOCOL_ERROR;
+                }
+                if(!(req_msg->req_line.url = strncpy_alloc(value,
+                                                           value_len))){
+                        return H2_INTERNAL_ERROR;
+                }
+        }else if(!strcmp(name, ":authority")){
+                bit = PSEUDO_AUTHORITY;
+                if(add_field(req_msg, "host", 4, value, value_len) < 0){
+                        return H2_INTERNAL_ERROR;
+                }
+        }else{
+                return H2_PROTOCOL_ERROR;
+        }
+        if(ctx->is_regular || (ctx->pseudo & bit)){
+                return H2_PROTOCOL_ERROR;
+        }
+        ctx->pseudo |= bit;
+        return 0;
+}
+
+/* a field of a request, see hpack_field_fn */
+static int on_field(void *arg, char *name, int name_len, char *value,
+                    int value_len)
+{
+        hdr_ctx_t *ctx = (hdr_ctx_t *)arg;
+        h2_stream_t *s = ctx->s;
+        int i;
+
+        /* the block is decoded to the end regardless, for the table */
+        if(!s || ctx->err){
+                return 0;
+        }
+        s->hdr_list_len += name_len + value_len + HPACK_ENTRY_OVERHEAD;
+        if(s->hdr_list_len > H2_HDR_LIST_MAX){
+                ctx->err = H2_ENHANCE_YOUR_CALM;
+                return 0;
+        }
+        for(i = 0; i < name_len; i++){
+                if(isupper((unsigned char)name[i])){
+                        ctx->err = H2_PROTOCOL_ERROR;
+                        return 0;
+                }
+        }
+        if(name_len && name[0] == ':'){
+                ctx->err = on_pseudo_field(ctx, name, value, value_len);
+                return 0;
+        }
+        ctx->is_regular = 1;
+        if(!name_len || is_conn_field(name) ||
+           (!strcmp(name, "te") && strcmp(value, "trailers"))){
+                ctx->err = H2_PROTOCOL_ERROR;
+                return 0;
+        }
+        if(!strcmp(name, "host") && (ctx->pseudo & PSEUDO_AUTHORITY)){
+                /* :authority took its place */
+                return 0;
+        }
+        if(!strcmp(name, "priority")){
+                parse_priority(s, value, value_len);
+        }
+        if((!strcmp(name, "cookie") ?
+            add_cookie(s->req_msg, value, value_len) :
+            add_field(s->req_msg, name, name_len, value, value_len)) < 0){
+                ctx->err = H2_INTERNAL_ERROR;
+        }
+        return 0;
+}
+
+/* the request of a stream is in, queue it for the handlers */
+static void stream_req_done(h2_conn_t *conn, h2_stream_t *s)
+{
+        req_msg_t *req_msg = s->req_msg;
+        char *content_len = get_field_value(req_msg, "content-length");
+        char len_str[24];
+
+        if(content_len){
+                if(atoll(content_len) != req_msg->msg_body_len){
+                        stream_reset(conn, s, H2_PROTOCOL_ERROR);
+                        return;
+                }
+        }else if(req_msg->msg_body_len &&
+                 add_field(req_msg, "content-length", 14, len_str,
+                           rsp_itoa(req_msg->msg_body_len, len_str)) < 0){
+                stream_reset(conn, s, H2_INTERNAL_ERROR);
+                return;
+        }
+        dbg_printf("h2 stream(%u) %s", s->id, req_msg->req_line.url);
+        s->req_msg = NULL;
+        s->state = H2_STREAM_HALF_CLOSED;
+        insert_req_msg(req_msg, &s->tcp_base);
+}
+
+
+/*
+ * frames in
+ */
+
+/**
+ * @brief drop the padding of a DATA or HEADERS frame
+ * @return 0 on success, -1 if the padding is longer than the frame
+ */
+static int strip_padding(int flags, unsigned char **p, int *len)
+{
+        int pad_len;
+
+        if(!(flags & H2_FLAG_PADDED)){
+                return 0;
+        }
+        if(*len < 1 || (pad_len = (*p)[0]) > *len - 1){
+                return -1;
+        }
+        (*p)++;
+        *len -= 1 + pad_len;
+        return 0;
+}
+
+static void on_data(h2_conn_t *conn, int flags, uint32_t id,
+                    unsigned char *p, int len)
+{
+        req_msg_t *req_msg;
+        h2_stream_t *s;
+        int flow_len = len;
+        char *body;
+
+        if(!id || id > conn->last_stream_id ||
+           strip_padding(flags, &p, &len) < 0){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+                return;
+        }
+        /* the whole frame counts, padding included */
+        if((conn->recv_window -= flow_len) < 0){
+                conn_error(conn, H2_FLOW_CONTROL_ERROR);
+                return;
+        }
+        if(conn->recv_window < H2_WINDOW_INIT / 2){
+                window_update(conn, 0, H2_WINDOW_INIT - conn->recv_window);
+                conn->recv_window = H2_WINDOW_INIT;
+        }
+        if(!(s = find_stream(conn, id)) || s->state == H2_STREAM_DONE){
+                /* refused or reset, it may take the peer a while */
+                return;
+        }
+        if(s->state != H2_STREAM_OPEN){
+                stream_reset(conn, s, H2_STREAM_CLOSED);
+                return;
+        }
+        if((s->recv_window -= flow_len) < 0){
+                stream_reset(conn, s, H2_FLOW_CONTROL_ERROR);
+                return;
+        }
+        req_msg = s->req_msg;
+        if(req_msg->msg_body_len + len > H2_BODY_MAX){
+                stream_reset(conn, s, H2_ENHANCE_YOUR_CALM);
+                return;
+        }
+        if(len){
+                if(!(body = (char *)realloc(req_msg->msg_body,
+                                            req_msg->msg_body_len + len + 1))){
+                        stream_reset(conn, s, H2_INTERNAL_ERROR);
+                        return;
+                }
+                memcpy(body + req_msg->msg_body_len, p, len);
+                req_msg->msg_body = body;
+                req_msg->msg_body_len += len;
+                body[req_msg->msg_body_len] = 0;
+        }
+        if(flags & H2_FLAG_END_STREAM){
+                stream_req_done(conn, s);
+        }else if(s->recv_window < H2_WINDOW_INIT / 2){
+                window_update(conn, id, H2_WINDOW_INIT - s->recv_window);
+                s->recv_window = H2_WINDOW_INIT;
+        }
+}
+
+/* a header block is whole, CONTINUATIONs included */
+static void on_hdr_block(h2_conn_t *conn, uint32_t id)
+{
+        h2_stream_t *s = find_stream(conn, id);
+        hdr_ctx_t ctx = {NULL, 0, 0, 0};
+        int is_end = conn->hdr_flags & H2_FLAG_END_STREAM;
+        int is_new = id > conn->last_stream_id;
+
+        if(is_new){
+                conn->last_stream_id = id;
+                if(!conn->is_peer_goaway &&
+                   conn->stream_ctr < H2_STREAMS_MAX){
+                        s = stream_new(conn, id);
+                }
+                ctx.s = s;
+        }
+        if(hpack_decode(&conn->dec, conn->hdr_block, conn->hdr_block_ctr,
+                        on_field, &ctx) < 0){
+                conn_error(conn, H2_COMPRESSION_ERROR);
+                return;
+        }
+        if(!is_new){
+                /* trailers, dropped; or too late for the stream */
+                if(s && s->state == H2_STREAM_OPEN){
+                        if(is_end){
+                                stream_req_done(conn, s);
+                        }else{
+                                stream_reset(conn, s, H2_PROTOCOL_ERROR);
+                        }
+                }else if(!s || s->state != H2_STREAM_DONE){
+                        if(s){
+                                stream_close(s);
+                        }
+                        rst(conn, id, H2_STREAM_CLOSED);
+                }
+                return;
+        }
+        if(!s){
+                rst(conn, id, H2_REFUSED_STREAM);
+                return;
+        }
+        if(!ctx.err && (ctx.pseudo & PSEUDO_REQUIRED) != PSEUDO_REQUIRED){
+                ctx.err = H2_PROTOCOL_ERROR;
+        }
+        if(ctx.err){
+                stream_reset(conn, s, ctx.err);
+                return;
+        }
+        if(is_end){
+                stream_req_done(conn, s);
+        }
+}
+
+static void on_hdr_fragment(h2_conn_t *conn, int flags, unsigned char *p,
+                            int len)
+{
+        uint32_t id = conn->hdr_stream_id;
+
+        if(conn->hdr_block_ctr + len > H2_HDR_BLOCK_MAX){
+                conn_error(conn, H2_ENHANCE_YOUR_CALM);
+                return;
+        }
+        memcpy(conn->hdr_block + conn->hdr_block_ctr, p, len);
+        conn->hdr_block_ctr += len;
+        if(flags & H2_FLAG_END_HEADERS){
+                conn->hdr_stream_id = 0;
+                on_hdr_block(conn, id);
+        }
+}
+
+static void on_headers(h2_conn_t *conn, int flags, uint32_t id,
+                       unsigned char *p, int len)
+{
+        if(!id || !(id & 1) || strip_padding(flags, &p, &len) < 0){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+                return;
+        }
+        if(flags & H2_FLAG_PRIORITY){
+                /* the RFC 7540 priority scheme, deprecated and ignored */
+                if(len < 5){
+                        conn_error(conn, H2_FRAME_SIZE_ERROR);
+                        return;
+                }
+                p += 5;
+                len -= 5;
+        }
+        conn->hdr_stream_id = id;
+        conn->hdr_flags = flags;
+        conn->hdr_block_ctr = 0;
+        on_hdr_fragment(conn, flags, p, len);
+}
+
+static void on_rst_stream(h2_conn_t *conn, uint32_t id, int len)
+{
+        h2_stream_t *s;
+
+        if(len != 4){
+                conn_error(conn, H2_FRAME_SIZE_ERROR);
+        }else if(!id || id > conn->last_stream_id){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+        }else if((s = find_stream(conn, id)) &&
+                 s->state != H2_STREAM_DONE){
+                stream_close(s);
+        }
+}
+
+/**
+ * @brief take the parameters of a SETTINGS payload
+ * @return 0 on success, the h2 error of the connection on failure
+ */
+static int apply_settings(h2_conn_t *conn, const unsigned char *p, int len)
+{
+        h2_stream_t *s;
+        long long delta;
+        uint32_t val;
+        int i;
+
+        for(i = 0; i + 6 <= len; i += 6){
+                val = get_u32(p + i + 2);
+                switch((p[i] << 8) | p[i + 1]){
+                case H2_SET_ENABLE_PUSH:
+                        if(val > 1){
+                                return H2_PROTOCOL_ERROR;
+                        }
+                        break;
+                case H2_SET_INITIAL_WINDOW_SIZE:
+                        if(val > H2_WINDOW_MAX){
+                                return H2_FLOW_CONTROL_ERROR;
+                        }
+                        /* open streams move by the difference */
+                        delta = val - conn->peer_window_init;
+                        list_for_each_entry(s, &conn->stream_list, link){
+                                if((s->send_window += delta) >
+                                   H2_WINDOW_MAX){
+                                        return H2_FLOW_CONTROL_ERROR;
+                                }
+                        }
+                        conn->peer_window_init = val;
+                        break;
+                case H2_SET_MAX_FRAME_SIZE:
+                        if(val < H2_FRAME_MAX || val > 0xffffff){
+                                return H2_PROTOCOL_ERROR;
+                        }
+                        conn->peer_frame_max = val;
+                        break;
+                default:
+                        /* the encoder keeps no table, and we don't push */
+                        break;
+                }
+        }
+        return 0;
+}
+
+static void on_settings(h2_conn_t *conn, int flags, uint32_t id,
+                        unsigned char *p, int len)
+{
+        int err;
+
+        if(id){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+        }else if(flags & H2_FLAG_ACK){
+                if(len){
+                        conn_error(conn, H2_FRAME_SIZE_ERROR);
+                }
+        }else if(len % 6){
+                conn_error(conn, H2_FRAME_SIZE_ERROR);
+        }else if((err = apply_settings(conn, p, len))){
+                conn_error(conn, err);
+        }else{
+                ctl_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        }
+}
+
+static void on_ping(h2_conn_t *conn, int flags, uint32_t id,
+                    unsigned char *p, int len)
+{
+        if(len != 8){
+                conn_error(conn, H2_FRAME_SIZE_ERROR);
+        }else if(id){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+        }else if(!(flags & H2_FLAG_ACK)){
+                ctl_frame(conn, H2_PING, H2_FLAG_ACK, 0, p, len);
+        }
+}
+
+static void on_window_update(h2_conn_t *conn, uint32_t id,
+                             unsigned char *p, int len)
+{
+        h2_stream_t *s;
+        uint32_t inc;
+
+        if(len != 4){
+                conn_error(conn, H2_FRAME_SIZE_ERROR);
+                return;
+        }
+        inc = get_u32(p) & H2_WINDOW_MAX;
+        if(!id){
+                if(!inc){
+                        conn_error(conn, H2_PROTOCOL_ERROR);
+                }else if((conn->send_window += inc) > H2_WINDOW_MAX){
+                        conn_error(conn, H2_FLOW_CONTROL_ERROR);
+                }
+                return;
+        }
+        if(id > conn->last_stream_id){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+                return;
+        }
+        if(!(s = find_stream(conn, id)) || s->state == H2_STREAM_DONE){
+                return;
+        }
+        if(!inc){
+                stream_reset(conn, s, H2_PROTOCOL_ERROR);
+        }else if((s->send_window += inc) > H2_WINDOW_MAX){
+                stream_reset(conn, s, H2_FLOW_CONTROL_ERROR);
+        }
+}
+
+/* RFC 9218: a stream changing its urgency or incremental */
+static void on_priority_update(h2_conn_t *conn, uint32_t id,
+                               unsigned char *p, int len)
+{
+        h2_stream_t *s;
+        uint32_t prio_id;
+
+        if(id){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+                return;
+        }
+        if(len < 4){
+                conn_error(conn, H2_FRAME_SIZE_ERROR);
+                return;
+        }
+        prio_id = get_u32(p) & H2_WINDOW_MAX;
+        if(!prio_id){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+        }else if((s = find_stream(conn, prio_id))){
+                /* one for a stream not opened yet is dropped */
+                parse_priority(s, (char *)p + 4, len - 4);
+        }
+}
+
+/* a frame is in conn->frame, whole */
+static void on_frame(h2_conn_t *conn)
+{
+        unsigned char *f = conn->frame;
+        unsigned char *p = f + H2_FRAME_HDR_LEN;
+        int len = frame_len(f);
+        int type = f[3];
+        int flags = f[4];
+        uint32_t id = get_u32(f + 5) & H2_WINDOW_MAX;
+
+        /* a header block is only ever continued, nothing comes between */
+        if(conn->hdr_stream_id &&
+           (type != H2_CONTINUATION || id != conn->hdr_stream_id)){
+                conn_error(conn, H2_PROTOCOL_ERROR);
+                return;
+        }
+        switch(type){
+        case H2_DATA:
+                on_data(conn, flags, id, p, len);
+                break;
+        case H2_HEADERS:
+                on_headers(conn, flags, id, p, len);
+                break;
+        case H2_PRIORITY:
+                if(!id){
+                        conn_error(conn, H2_PROTOCOL_ERROR);
+                }else if(len != 5){
+                        rst(conn, id, H2_FRAME_SIZE_ERROR);
+                }
+                break;
+        case H2_RST_STREAM:
+                on_rst_stream(conn, id, len);
+                break;
+        case H2_SETTINGS:
+                on_settings(conn, flags, id, p, len);
+                break;
+        case H2_PUSH_PROMISE:
+                conn_error(conn, H2_PROTOCOL_ERROR);
+                break;
+        case H2_PING:
+                on_ping(conn, flags, id, p, len);
+                break;
+        case H2_GOAWAY:
+                if(id){
+                        conn_error(conn, H2_PROTOCOL_ERROR);
+                }else{
+                        conn->is_peer_goaway = 1;
+                }
+                break;
+        case H2_WINDOW_UPDATE:
+                on_window_update(conn, id, p, len);
+                break;
+        case H2_CONTINUATION:
+                if(!conn->hdr_stream_id){
+                        conn_error(conn, H2_PROTOCOL_ERROR);
+                }else{
+                        on_hdr_fragment(conn, flags, p, len);
+                }
+                break;
+        case H2_PRIORITY_UPDATE:
+                on_priority_update(conn, id, p, len);
+                break;
+        default:
+                /* unknown frames are ignored */
+                break;
+        }
+}
+
+/**
+ * @brief parse of an http/2 connection: act on the frames in buf_in
+ *
+ * Frames are reassembled in conn->frame. Parsing stops while the control
+ * frames wait for buf_out, so a peer that doesn't read can't make them
+ * pile up; what is left of buf_in is taken up again by h2_handle.
+ *
+ * @param cb the tcp or ssl connection
+ * @return 0 on success, negative error code on failure
+ */
+int h2_parse(cli_cb_base_t *cb)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+        h2_conn_t *conn = tcp_cb->h2;
+        unsigned char *in = (unsigned char *)tcp_cb->buf_in;
+        int pos = 0;
+        int need, take, len;
+
+        if(!conn){
+                /* closed while reading */
+                return 0;
+        }
+        while(pos < tcp_cb->buf_in_ctr && !conn->is_goaway &&
+              conn->ctl_ctr <= H2_CTL_SIZE - CTL_RESERVE){
+                if(conn->preface_ctr < H2_PREFACE_LEN){
+                        if(in[pos++] != H2_PREFACE[conn->preface_ctr++]){
+                                conn_error(conn, H2_PROTOCOL_ERROR);
+                        }
+                        continue;
+                }
+                need = H2_FRAME_HDR_LEN;
+                if(conn->frame_ctr >= H2_FRAME_HDR_LEN){
+                        need += frame_len(conn->frame);
+                }
+                take = need - conn->frame_ctr;
+                if(take > tcp_cb->buf_in_ctr - pos){
+                        take = tcp_cb->buf_in_ctr - pos;
+                }
+                memcpy(conn->frame + conn->frame_ctr, in + pos, take);
+                conn->frame_ctr += take;
+                pos += take;
+                if(conn->frame_ctr < H2_FRAME_HDR_LEN){
+                        continue;
+                }
+                if((len = frame_len(conn->frame)) > H2_FRAME_MAX){
+                        conn_error(conn, H2_FRAME_SIZE_ERROR);
+                        break;
+                }
+                if(conn->frame_ctr == H2_FRAME_HDR_LEN + len){
+                        conn->frame_ctr = 0;
+                        on_frame(conn);
+                }
+        }
+        if(conn->is_goaway || pos == tcp_cb->buf_in_ctr){
+                make_buf_empty(tcp_cb->buf_in, &tcp_cb->buf_in_ctr);
+        }else{
+                memmove(tcp_cb->buf_in, tcp_cb->buf_in + pos,
+                        tcp_cb->buf_in_ctr - pos);
+                tcp_cb->buf_in_ctr -= pos;
+                tcp_cb->buf_in[tcp_cb->buf_in_ctr] = 0;
+        }
+        return 0;
+}
+
+
+/*
+ * frames out
+ */
+
+/**
+ * @brief take the HTTP/1 header of a response into rsp_hdr
+ * @return # of bytes taken from p, -1 if the header is too long
+ */
+static int gather_hdr(h2_stream_t *s, char *p, int len)
+{
+        int from = s->rsp_hdr_ctr > 3 ? s->rsp_hdr_ctr - 3 : 0;
+        char *hdr_end;
+        int take = H2_RSP_HDR_MAX - s->rsp_hdr_ctr;
+        int hdr_len;
+
+        if(take > len){
+                take = len;
+        }
+        memcpy(s->rsp_hdr + s->rsp_hdr_ctr, p, take);
+        s->rsp_hdr_ctr += take;
+        if((hdr_end = memmem(s->rsp_hdr + from, s->rsp_hdr_ctr - from,
+                             REQ_END_STR, sizeof(REQ_END_STR) - 1))){
+                /* the body is given back */
+                hdr_len = hdr_end + sizeof(REQ_END_STR) - 1 - s->rsp_hdr;
+                take -= s->rsp_hdr_ctr - hdr_len;
+                s->rsp_hdr_ctr = hdr_len;
+                s->is_hdr_done = 1;
+        }else if(s->rsp_hdr_ctr == H2_RSP_HDR_MAX){
+                return -1;
+        }
+        s->rsp_hdr[s->rsp_hdr_ctr] = 0;
+        return take;
+}
+
+/**
+ * @brief send the header in rsp_hdr as a HEADERS frame
+ * @return 1 if it went out, 0 if buf_out has no room for it yet, -1 if
+ *         it isn't a response header
+ */
+static int send_hdr(h2_stream_t *s)
+{
+        h2_conn_t *conn = s->conn;
+        cli_cb_tcp_t *tcp_cb = conn->tcp_cb;
+        char *out = tcp_cb->buf_out + tcp_cb->buf_out_ctr + H2_FRAME_HDR_LEN;
+        int room = BUF_OUT_SIZE - tcp_cb->buf_out_ctr - H2_FRAME_HDR_LEN;
+        char name[RSP_NAME_MAX];
+        char *line, *line_end, *colon, *value;
+        int status, len, n, i, name_len, value_len;
+        int is_chunked = 0;
+
+        if(sscanf(s->rsp_hdr, "HTTP/%*d.%*d %d", &status) != 1 ||
+           status < 100 || status > 999 || status == 101){
+                return -1;
+        }
+        if(room > conn->peer_frame_max){
+                room = conn->peer_frame_max;
+        }
+        if(room < 0 || (len = hpack_encode_status(out, room, status)) < 0){
+                return 0;
+        }
+        line = strstr(s->rsp_hdr, LINE_END_STR) + 2;
+        while((line_end = strstr(line, LINE_END_STR)) != line){
+                if(!(colon = memchr(line, ':', line_end - line))){
+                        return -1;
+                }
+                name_len = colon - line;
+                value = colon + 1;
+                while(value < line_end && (*value == ' ' || *value == '\t')){
+                        value++;
+                }
+                value_len = line_end - value;
+                while(value_len && (value[value_len - 1] == ' ' ||
+                                    value[value_len - 1] == '\t')){
+                        value_len--;
+                }
+                line = line_end + 2;
+                if(!name_len || name_len >= RSP_NAME_MAX){
+                        err_printf("h2 response field dropped");
+                        continue;
+                }
+                for(i = 0; i < name_len; i++){
+                        name[i] = tolower((unsigned char)colon[i - name_len]);
+                }
+                name[name_len] = 0;
+                if(!strcmp(name, "transfer-encoding")){
+                        is_chunked = has_token(value, value_len, "chunked");
+                        continue;
+                }
+                if(is_conn_field(name)){
+                        continue;
+                }
+                if((n = hpack_encode_field(out + len, room - len, name,
+                                           value, value_len)) < 0){
+                        return 0;
+                }
+                len += n;
+        }
+        put_frame_hdr(out - H2_FRAME_HDR_LEN, len, H2_HEADERS,
+                      H2_FLAG_END_HEADERS, s->id);
+        s->last_off = tcp_cb->buf_out_ctr;
+        tcp_cb->buf_out_ctr += H2_FRAME_HDR_LEN + len;
+        tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
+        s->rsp_hdr_ctr = 0;
+        s->is_hdr_done = 0;
+        if(status >= 200){
+                /* 1xx are interim, another header follows */
+                s->is_final_sent = 1;
+                s->rsp_state = is_chunked ? H2_RSP_CHUNK_SIZE : H2_RSP_BODY;
+                s->chunk_left = 0;
+        }
+        return 1;
+}
+
+/* a byte of the chunked framing around the body, it is dropped */
+static int dechunk(h2_stream_t *s, char c)
+{
+        switch(s->rsp_state){
+        case H2_RSP_CHUNK_SIZE:
+                if(isxdigit((unsigned char)c)){
+                        if(s->chunk_left >> 40){
+                                return -1;
+                        }
+                        s->chunk_left = s->chunk_left * 16 +
+                                (isdigit((unsigned char)c) ? c - '0' :
+                                 tolower((unsigned char)c) - 'a' + 10);
+                        return 0;
+                }
+                s->rsp_state = H2_RSP_CHUNK_EXT;
+                return dechunk(s, c);
+        case H2_RSP_CHUNK_EXT:
+                if(c == '\n'){
+                        /* the last chunk has size 0, then the trailer */
+                        s->rsp_state = s->chunk_left ? H2_RSP_CHUNK_DATA :
+                                       H2_RSP_TRAILER;
+                }
+                return 0;
+        case H2_RSP_CHUNK_END:
+                if(c == '\n'){
+                        s->rsp_state = H2_RSP_CHUNK_SIZE;
+                        s->chunk_left = 0;
+                }
+                return 0;
+        case H2_RSP_TRAILER:
+                /* chunk_left counts the bytes of the line */
+                if(c == '\n'){
+                        if(!s->chunk_left){
+                                s->rsp_state = H2_RSP_DONE;
+                        }
+                        s->chunk_left = 0;
+                }else if(c != '\r'){
+                        s->chunk_left++;
+                }
+                return 0;
+        default:
+                return 0;
+        }
+}
+
+/* how much of n bytes of body a DATA frame may carry now */
+static int data_room(h2_stream_t *s, long long n)
+{
+        h2_conn_t *conn = s->conn;
+        long long room = BUF_OUT_SIZE - conn->tcp_cb->buf_out_ctr -
+                         H2_FRAME_HDR_LEN;
+
+        if(n > room){
+                n = room;
+        }
+        if(n > conn->peer_frame_max){
+                n = conn->peer_frame_max;
+        }
+        if(n > conn->send_window){
+                n = conn->send_window;
+        }
+        if(n > s->send_window){
+                n = s->send_window;
+        }
+        return n;
+}
+
+/**
+ * @brief frame what the handlers of a stream wrote into its buf_out
+ *
+ * What is framed, or dropped as chunked framing, leaves the buf_out of
+ * the stream; the handlers refill it once it is empty.
+ *
+ * @param s the stream
+ * @param is_one_frame stop after a frame
+ * @return # of frames written to buf_out of the connection, -1 if the
+ *         handlers wrote something that isn't a response
+ */
+static int reframe(h2_stream_t *s, int is_one_frame)
+{
+        cli_cb_tcp_t *src = &s->tcp_base;
+        cli_cb_tcp_t *dst = s->conn->tcp_cb;
+        char *p = src->buf_out;
+        char *end = src->buf_out + src->buf_out_ctr;
+        int frames = 0;
+        int n, ret;
+
+        while(!(is_one_frame && frames)){
+                if(s->rsp_state == H2_RSP_HDR){
+                        if(!s->is_hdr_done){
+                                if(p == end){
+                                        break;
+                                }
+                                if((n = gather_hdr(s, p, end - p)) < 0){
+                                        return -1;
+                                }
+                                p += n;
+                                if(!s->is_hdr_done){
+                                        break;
+                                }
+                        }
+                        if((ret = send_hdr(s)) < 0){
+                                return -1;
+                        }
+                        if(!ret){
+                                break;
+                        }
+                        frames++;
+                }else if(s->rsp_state == H2_RSP_BODY ||
+                         s->rsp_state == H2_RSP_CHUNK_DATA){
+                        n = s->rsp_state == H2_RSP_BODY ||
+                            end - p < s->chunk_left ?
+                            end - p : s->chunk_left;
+                        if((n = data_room(s, n)) <= 0){
+                                break;
+                        }
+                        put_frame_hdr(dst->buf_out + dst->buf_out_ctr, n,
+                                      H2_DATA, 0, s->id);
+                        memcpy(dst->buf_out + dst->buf_out_ctr +
+                               H2_FRAME_HDR_LEN, p, n);
+                        s->last_off = dst->buf_out_ctr;
+                        dst->buf_out_ctr += H2_FRAME_HDR_LEN + n;
+                        dst->buf_out[dst->buf_out_ctr] = 0;
+                        s->conn->send_window -= n;
+                        s->send_window -= n;
+                        p += n;
+                        frames++;
+                        if(s->rsp_state == H2_RSP_CHUNK_DATA &&
+                           !(s->chunk_left -= n)){
+                                s->rsp_state = H2_RSP_CHUNK_END;
+                        }
+                }else{
+                        if(p == end){
+                                break;
+                        }
+                        if(dechunk(s, *(p++)) < 0){
+                                return -1;
+                        }
+                }
+        }
+        if(p == end){
+                make_buf_empty(src->buf_out, &src->buf_out_ctr);
+        }else if(p != src->buf_out){
+                memmove(src->buf_out, p, end - p);
+                src->buf_out_ctr = end - p;
+                src->buf_out[src->buf_out_ctr] = 0;
+        }
+        return frames;
+}
+
+/* whether the handlers of a stream are done with its response */
+static int stream_is_done(h2_stream_t *s)
+{
+        cli_cb_tcp_t *tcp_cb = &s->tcp_base;
+
+        return s->state == H2_STREAM_HALF_CLOSED &&
+               list_empty(&tcp_cb->req_msg_list) &&
+               !tcp_cb->is_send_pending && !tcp_cb->is_cgi_pending &&
+               !tcp_cb->io_job &&
+               is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr) &&
+               !s->rsp_hdr_ctr;
+}
+
+/**
+ * @brief end a stream whose response is out, with END_STREAM
+ * @return 0 on success, -1 if buf_out has no room for it yet
+ */
+static int end_stream(h2_stream_t *s)
+{
+        h2_conn_t *conn = s->conn;
+        cli_cb_tcp_t *tcp_cb = conn->tcp_cb;
+
+        if(!s->is_final_sent){
+                /* the handlers had nothing to say */
+                stream_reset(conn, s, H2_INTERNAL_ERROR);
+                return 0;
+        }
+        if(s->last_off >= 0){
+                tcp_cb->buf_out[s->last_off + 4] |= H2_FLAG_END_STREAM;
+        }else if(BUF_OUT_SIZE - tcp_cb->buf_out_ctr >= H2_FRAME_HDR_LEN){
+                put_frame_hdr(tcp_cb->buf_out + tcp_cb->buf_out_ctr, 0,
+                              H2_DATA, H2_FLAG_END_STREAM, s->id);
+                tcp_cb->buf_out_ctr += H2_FRAME_HDR_LEN;
+                tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
+        }else{
+                return -1;
+        }
+        s->state = H2_STREAM_DONE;
+        return 0;
+}
+
+/**
+ * @brief let the handlers of a stream run, and frame what they wrote
+ * @param s the stream
+ * @param is_one_frame stop after a frame, to take turns
+ * @return whether a frame went out
+ */
+static int pump_stream(h2_stream_t *s, int is_one_frame)
+{
+        cli_cb_tcp_t *tcp_cb = &s->tcp_base;
+        cli_cb_base_t *cb = &tcp_cb->base;
+        int frames = 0;
+        int ret, ctr;
+
+        if(s->state == H2_STREAM_DONE){
+                /* reset while its cgi still runs, the output is dropped */
+                make_buf_empty(tcp_cb->buf_out, &tcp_cb->buf_out_ctr);
+                if(tcp_cb->is_cgi_pending){
+                        cb->mthd.handle_req_msg(cb);
+                }
+                return 0;
+        }
+        if(s->state != H2_STREAM_HALF_CLOSED){
+                return 0;
+        }
+        while(1){
+                if(cb->mthd.handle_req_msg(cb) < 0){
+                        stream_reset(s->conn, s, H2_INTERNAL_ERROR);
+                        break;
+                }
+                ctr = tcp_cb->buf_out_ctr;
+                if((ret = reframe(s, is_one_frame)) < 0){
+                        stream_reset(s->conn, s, H2_INTERNAL_ERROR);
+                        break;
+                }
+                frames += ret;
+                if(stream_is_done(s)){
+                        end_stream(s);
+                        break;
+                }
+                /* out of room or window, or the handlers wait on the
+                 * cgi or the pool */
+                if((is_one_frame && ret) ||
+                   !is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr) ||
+                   (!ctr && !ret)){
+                        break;
+                }
+        }
+        return frames > 0;
+}
+
+/* the streams of an urgency, RFC 9218 */
+static void pump_urgency(h2_conn_t *conn, int urgency)
+{
+        h2_stream_t *s;
+        int is_progress, pass;
+
+        /* one after the other, in the order they were opened */
+        list_for_each_entry(s, &conn->stream_list, link){
+                if(s->urgency == urgency && !s->is_incremental){
+                        pump_stream(s, 0);
+                }
+        }
+        /* incremental ones take turns, a frame each; a round starts
+         * after the one that sent last, as buf_out fills up mid-round */
+        do{
+                is_progress = 0;
+                for(pass = 0; pass < 2; pass++){
+                        list_for_each_entry(s, &conn->stream_list, link){
+                                if(s->urgency != urgency ||
+                                   !s->is_incremental ||
+                                   !pass != (s->id > conn->rr_id)){
+                                        continue;
+                                }
+                                if(pump_stream(s, 1)){
+                                        is_progress = 1;
+                                        conn->rr_id = s->id;
+                                }
+                        }
+                }
+        }while(is_progress);
+}
+
+/**
+ * @brief handle_req_msg of an http/2 connection: send what the streams
+ *        have for it
+ *
+ * Control frames go first. Then the streams run by urgency, as long as
+ * buf_out has room and the windows of the peer allow, and those done
+ * are freed. A connection that sent GOAWAY is closed once it is out.
+ *
+ * @param cb the tcp or ssl connection
+ * @return 0 on success, negative error code on failure
+ */
+int h2_handle(cli_cb_base_t *cb)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+        h2_conn_t *conn = tcp_cb->h2;
+        h2_stream_t *s, *next;
+        int urgency;
+
+        if(!conn){
+                return 0;
+        }
+        flush_ctl(conn);
+        if(!is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr)){
+                /* parsing stopped for the control frames */
+                h2_parse(cb);
+        }
+        if(flush_ctl(conn)){
+                return 0;
+        }
+        if(conn->is_goaway){
+                if(is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){
+                        cb->mthd.close(cb);
+                }
+                return 0;
+        }
+        list_for_each_entry(s, &conn->stream_list, link){
+                s->last_off = -1;
+        }
+        for(urgency = 0; urgency < H2_URGENCY_LEVELS; urgency++){
+                pump_urgency(conn, urgency);
+        }
+        list_for_each_entry_safe(s, next, &conn->stream_list, link){
+                if(s->state == H2_STREAM_DONE &&
+                   !s->tcp_base.is_cgi_pending){
+                        stream_free(conn, s);
+                }
+        }
+        if(conn->is_peer_goaway && !conn->stream_ctr && !conn->ctl_ctr &&
+           is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){
+                cb->mthd.close(cb);
+        }
+        return 0;
+}
+
+/**
+ * @brief send of a stream: frame what is in its buf_out now
+ *
+ * Handlers call it to get an interim response out ahead of the final
+ * one; the header is taken off buf_out even while it can't go out yet.
+ *
+ * @param cb the stream
+ * @return 0
+ */
+int h2_stream_send(cli_cb_base_t *cb)
+{
+        h2_stream_t *s = (h2_stream_t *)cb;
+
+        if(!s->conn || s->state == H2_STREAM_DONE){
+                return 0;
+        }
+        if(flush_ctl(s->conn)){
+                if(s->rsp_state == H2_RSP_HDR && !s->is_hdr_done &&
+                   gather_hdr(s, s->tcp_base.buf_out,
+                              s->tcp_base.buf_out_ctr) ==
+                   s->tcp_base.buf_out_ctr){
+                        make_buf_empty(s->tcp_base.buf_out,
+                                       &s->tcp_base.buf_out_ctr);
+                }
+                return 0;
+        }
+        if(reframe(s, 0) < 0){
+                stream_reset(s->conn, s, H2_INTERNAL_ERROR);
+        }
+        return 0;
+}
+
+
+/*
+ * starting and closing
+ */
+
+static int b64url_val(char c)
+{
+        if(c >= 'A' && c <= 'Z'){
+                return c - 'A';
+        }
+        if(c >= 'a' && c <= 'z'){
+                return c - 'a' + 26;
+        }
+        if(c >= '0' && c <= '9'){
+                return c - '0' + 52;
+        }
+        if(c == '-' || c == '+'){
+                return 62;
+        }
+        if(c == '_' || c == '/'){
+                return 63;
+        }
+        return -1;
+}
+
+/**
+ * @brief decode base64url, as HTTP2-Settings is, padding optional
+ * @return # of bytes decoded, -1 if it isn't base64url or too long
+ */
+static int b64url_decode(const char *in, unsigned char *out, int room)
+{
+        uint32_t bits = 0;
+        int nbits = 0, len = 0, val;
+
+        for(; *in && *in != '='; in++){
+                if((val = b64url_val(*in)) < 0){
+                        return -1;
+                }
+                bits = (bits << 6) | val;
+                if((nbits += 6) >= 8){
+                        if(len == room){
+                                return -1;
+                        }
+                        nbits -= 8;
+                        out[len++] = bits >> nbits;
+                }
+        }
+        return len;
+}
+
+/**
+ * @brief ALPN of the ssl port: h2 if the client has it, else http/1.1
+ *
+ * The callback of SSL_CTX_set_alpn_select_cb.
+ */
+int h2_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg)
+{
+        static const unsigned char protos[] = "\x02h2\x08http/1.1";
+
+        if(SSL_select_next_proto((unsigned char **)out, outlen, protos,
+                                 sizeof(protos) - 1, in, inlen) !=
+           OPENSSL_NPN_NEGOTIATED){
+                return SSL_TLSEXT_ERR_NOACK;
+        }
+        return SSL_TLSEXT_ERR_OK;
+}
+
+/* whether ALPN picked h2 for a tls connection */
+int h2_is_alpn(SSL *ssl)
+{
+        const unsigned char *alpn;
+        unsigned int alpn_len;
+
+        SSL_get0_alpn_selected(ssl, &alpn, &alpn_len);
+        return alpn_len == 2 && !memcmp(alpn, "h2", 2);
+}
+
+/* whether the first bytes of a connection are the client preface,
+ * that is, http/2 with prior knowledge */
+int h2_is_preface(char *buf, int len)
+{
+        if(len > H2_PREFACE_LEN){
+                len = H2_PREFACE_LEN;
+        }
+        return len >= 3 && !memcmp(buf, H2_PREFACE, len);
+}
+
+/* whether an HTTP/1.1 request on the tcp port asks to upgrade to h2c */
+int h2_is_upgrade(cli_cb_tcp_t *tcp_cb, req_msg_t *req_msg)
+{
+        unsigned char settings[UPGRADE_SETTINGS_MAX];
+        char *upgrade, *value;
+        int len;
+
+        if(tcp_cb->base.type != CONN_TCP || tcp_cb->h2 ||
+           !(upgrade = get_field_value(req_msg, "Upgrade")) ||
+           !has_token(upgrade, strlen(upgrade), "h2c") ||
+           !(value = get_field_value(req_msg, "HTTP2-Settings"))){
+                return 0;
+        }
+        len = b64url_decode(value, settings, sizeof(settings));
+        return len >= 0 && !(len % 6);
+}
+
+/* the request that asked for h2c becomes stream 1, half-closed */
+static int start_upgraded(h2_conn_t *conn, req_msg_t *req_msg)
+{
+        cli_cb_tcp_t *tcp_cb = conn->tcp_cb;
+        unsigned char settings[UPGRADE_SETTINGS_MAX];
+        h2_stream_t *s;
+        char *priority;
+        int len, ret;
+        rsp_t rsp;
+
+        rsp_init(&rsp, tcp_cb->buf_out + tcp_cb->buf_out_ctr,
+                 BUF_OUT_SIZE - tcp_cb->buf_out_ctr);
+        rsp_lit(&rsp, "HTTP/1.1 101 Switching Protocols" LINE_END_STR);
+        rsp_field(&rsp, "Connection", "Upgrade");
+        rsp_field(&rsp, "Upgrade", "h2c");
+        rsp_end(&rsp);
+        if((ret = rsp_done(&rsp)) < 0){
+                return ret;
+        }
+        if(!(s = stream_new(conn, 1))){
+                return ERR_NO_MEM;
+        }
+        tcp_cb->buf_out_ctr += ret;
+        len = b64url_decode(get_field_value(req_msg, "HTTP2-Settings"),
+                            settings, sizeof(settings));
+        apply_settings(conn, settings, len);
+        if((priority = get_field_value(req_msg, "Priority"))){
+                parse_priority(s, priority, strlen(priority));
+        }
+        conn->last_stream_id = 1;
+        clear_req_msg(s->req_msg);
+        free(s->req_msg);
+        s->req_msg = req_msg;
+        stream_req_done(conn, s);
+        return 0;
+}
+
+/**
+ * @brief switch a connection over to http/2
+ *
+ * The server preface, SETTINGS, is queued and the parse and the
+ * handle_req_msg of the connection are taken over; the client preface
+ * is expected next.
+ *
+ * @param tcp_cb the tcp or ssl connection, nothing queued on it
+ * @param upgrade the request of an h2c upgrade, it is answered as stream
+ *        1 after a 101 is put in buf_out; or NULL
+ * @return 0 on success, negative error code on failure; the upgrade
+ *         request is the caller's until then
+ */
+int h2_start(cli_cb_tcp_t *tcp_cb, req_msg_t *upgrade)
+{
+        unsigned char settings[12];
+        h2_conn_t *conn;
+        int one = 1;
+        int ret;
+
+        if(!(conn = (h2_conn_t *)malloc(sizeof(h2_conn_t)))){
+                return ERR_NO_MEM;
+        }
+        conn->tcp_cb = tcp_cb;
+        conn->preface_ctr = 0;
+        conn->frame_ctr = 0;
+        conn->hdr_block_ctr = 0;
+        conn->hdr_stream_id = 0;
+        conn->hdr_flags = 0;
+        conn->ctl_ctr = 0;
+        hpack_dec_init(&conn->dec);
+        INIT_LIST_HEAD(&conn->stream_list);
+        conn->stream_ctr = 0;
+        conn->last_stream_id = 0;
+        conn->rr_id = 0;
+        conn->send_window = H2_WINDOW_INIT;
+        conn->recv_window = H2_WINDOW_INIT;
+        conn->peer_window_init = H2_WINDOW_INIT;
+        conn->peer_frame_max = H2_FRAME_MAX;
+        conn->is_goaway = 0;
+        conn->is_peer_goaway = 0;
+
+        settings[0] = 0;
+        settings[1] = H2_SET_MAX_CONCURRENT_STREAMS;
+        put_u32(settings + 2, H2_STREAMS_MAX);
+        settings[6] = 0;
+        settings[7] = H2_SET_MAX_HEADER_LIST_SIZE;
+        put_u32(settings + 8, H2_HDR_LIST_MAX);
+        ctl_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+        if(upgrade && (ret = start_upgraded(conn, upgrade)) < 0){
+                hpack_dec_clear(&conn->dec);
+                free(conn);
+                return ret;
+        }
+        /* frames wait on WINDOW_UPDATEs, Nagle would hold back the tail
+         * of a window until the peer acks; buf_out batches them anyway */
+        setsockopt(tcp_cb->cli_fd, IPPROTO_TCP, TCP_NODELAY, &one,
+                   sizeof(one));
+        tcp_cb->h2 = conn;
+        tcp_cb->base.mthd.parse = h2_parse;
+        tcp_cb->base.mthd.handle_req_msg = h2_handle;
+        dbg_printf("conn(%d) speaks h2", tcp_cb->cli_fd);
+        return 0;
+}
+
+/**
+ * @brief drop the http/2 state of a connection being closed
+ *
+ * A stream whose cgi still runs is let go of rather than freed, the cgi
+ * writes to it until it exits.
+ */
+void h2_close(cli_cb_tcp_t *tcp_cb)
+{
+        h2_conn_t *conn = tcp_cb->h2;
+        h2_stream_t *s, *next;
+
+        if(!conn){
+                return;
+        }
+        list_for_each_entry_safe(s, next, &conn->stream_list, link){
+                if(s->state != H2_STREAM_DONE){
+                        stream_close(s);
+                }
+                if(s->tcp_base.is_cgi_pending){
+                        list_del(&s->link);
+                        s->conn = NULL;
+                        continue;
+                }
+                stream_free(conn, s);
+        }
+        hpack_dec_clear(&conn->dec);
+        free(conn);
+        tcp_cb->h2 = NULL;
+}
+
+void h2_init(void)
+{
+        hpack_init();
+}
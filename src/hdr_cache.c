@@ -0,0 +1,198 @@
+/** @file hdr_cache.c
+ *  @brief pre-serialized response headers of static resources, and the
+ *         table of mime types by extension
+ *
+ *  Header blocks live in a fixed pool of entries, hashed into buckets by
+ *  path and kept on an lru list. There is one entry per path and content
+ *  coding; it is only used while the entity tag (which covers inode,
+ *  size and mtime), the body length and the Cache-Control still match,
+ *  so a modified resource misses once and has its block replaced in
+ *  place.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "srv_def.h"
+#include "hdr_cache.h"
+#include "debug_define.h"
+
+
+struct hdr_entry{
+        char path[FILENAME_MAX_LEN];
+        char enc[HDR_ENC_MAX_LEN];       /* content coding, "" if none */
+        char etag[ETAG_MAX_LEN + 2];
+        long long len;
+        char cache_ctrl[HDR_CTRL_MAX_LEN];  /* "" if none */
+
+        char hdr[HDR_TMPL_MAX];
+        int hdr_len;
+
+        struct list_head hash_link;
+        struct list_head lru_link;
+};
+
+typedef struct hdr_entry hdr_entry_t;
+
+
+static hdr_entry_t hdr_pool[HDR_CACHE_SIZE];
+static struct list_head hdr_hash[HDR_CACHE_HASH_SIZE];
+static struct list_head hdr_lru;         /* most recently used first */
+static struct list_head hdr_free;
+
+/* mime types by extension, the first entry is the default */
+static struct{
+        char *ext;
+        char *type;
+} mime_types[] = {
+        {NULL, "application/octet-stream"},
+        {"html", "text/html"},
+        {"htm", "text/html"},
+        {"css", "text/css"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"xml", "application/xml"},
+        {"txt", "text/plain"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"svg", "image/svg+xml"},
+        {"ico", "image/x-icon"},
+        {"pdf", "application/pdf"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+};
+
+
+/** @brief look up the mime type of path by its extension */
+char *hdr_mime_type(char *path)
+{
+        char *ext = strrchr(path, '.');
+        unsigned int i;
+
+        if(!ext || strchr(ext, '/')){
+                return mime_types[0].type;
+        }
+        ext++;
+        for(i = 1; i < sizeof(mime_types) / sizeof(mime_types[0]); i++){
+                if(!strcasecmp(ext, mime_types[i].ext)){
+                        return mime_types[i].type;
+                }
+        }
+        return mime_types[0].type;
+}
+
+
+static unsigned int hash_path(char *path)
+{
+        uint32_t h = 2166136261U;
+        while(*path){
+                h ^= (unsigned char)*(path++);
+                h *= 16777619U;
+        }
+        return h % HDR_CACHE_HASH_SIZE;
+}
+
+static hdr_entry_t *find_entry(char *path, char *enc)
+{
+        hdr_entry_t *entry;
+        list_for_each_entry(entry, &hdr_hash[hash_path(path)], hash_link){
+                if(!strcmp(entry->path, path) && !strcmp(entry->enc, enc)){
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+void hdr_cache_init(void)
+{
+        int i;
+
+        INIT_LIST_HEAD(&hdr_lru);
+        INIT_LIST_HEAD(&hdr_free);
+        for(i = 0; i < HDR_CACHE_HASH_SIZE; i++){
+                INIT_LIST_HEAD(&hdr_hash[i]);
+        }
+        for(i = 0; i < HDR_CACHE_SIZE; i++){
+                list_add_tail(&hdr_pool[i].lru_link, &hdr_free);
+        }
+}
+
+/**
+ * @brief look up the header block of a representation
+ * @param path the path of the resource
+ * @param enc the content coding, NULL if none
+ * @param etag the quoted entity tag of the representation
+ * @param len the length of its body
+ * @param cache_ctrl the Cache-Control value, NULL if none
+ * @param hdr_len set to the length of the block
+ * @return the block, with the dates still to be patched in, or NULL
+ */
+char *hdr_cache_get(char *path, char *enc, char *etag, long long len,
+                    char *cache_ctrl, int *hdr_len)
+{
+        hdr_entry_t *entry;
+
+        if(!(entry = find_entry(path, enc ? enc : "")) ||
+           strcmp(entry->etag, etag) || entry->len != len ||
+           strcmp(entry->cache_ctrl, cache_ctrl ? cache_ctrl : "")){
+                return NULL;
+        }
+        list_del(&entry->lru_link);
+        list_add(&entry->lru_link, &hdr_lru);
+        *hdr_len = entry->hdr_len;
+        return entry->hdr;
+}
+
+/**
+ * @brief remember the header block of a representation
+ *
+ * The block must start with the Date field, then Expires if it has one,
+ * and end with the empty line. Blocks too long for an entry are not
+ * cached.
+ *
+ * @return Void
+ */
+void hdr_cache_put(char *path, char *enc, char *etag, long long len,
+                   char *cache_ctrl, char *hdr, int hdr_len)
+{
+        hdr_entry_t *entry;
+
+        enc = enc ? enc : "";
+        cache_ctrl = cache_ctrl ? cache_ctrl : "";
+        if(hdr_len > HDR_TMPL_MAX || strlen(path) >= FILENAME_MAX_LEN ||
+           strlen(enc) >= HDR_ENC_MAX_LEN || strlen(etag) >= ETAG_MAX_LEN + 2 ||
+           strlen(cache_ctrl) >= HDR_CTRL_MAX_LEN){
+                return;
+        }
+        if(!(entry = find_entry(path, enc))){
+                if(list_empty(&hdr_free)){
+                        entry = list_entry(hdr_lru.prev, hdr_entry_t,
+                                           lru_link);
+                        list_del(&entry->hash_link);
+                }else{
+                        entry = list_first_entry(&hdr_free, hdr_entry_t,
+                                                 lru_link);
+                }
+                strcpy(entry->path, path);
+                strcpy(entry->enc, enc);
+                list_add(&entry->hash_link, &hdr_hash[hash_path(path)]);
+        }
+        list_del(&entry->lru_link);
+        list_add(&entry->lru_link, &hdr_lru);
+
+        strcpy(entry->etag, etag);
+        entry->len = len;
+        strcpy(entry->cache_ctrl, cache_ctrl);
+        memcpy(entry->hdr, hdr, hdr_len);
+        entry->hdr_len = hdr_len;
+        dbg_printf("hdr cache insert (%s), hdr_len(%d)", path, hdr_len);
+}
@@ -0,0 +1,235 @@
+/** @file hints.c
+ *  @brief preload hints for the subresources of html documents
+ *
+ *  The head of a document (HINTS_SCAN_LEN bytes, where the stylesheets
+ *  and scripts are) is scanned for <link rel=stylesheet href>, <script
+ *  src> and <img src>. Urls of the same origin are resolved against the
+ *  directory of the document and joined into one Link field value:
+ *
+ *      </style.css>; rel=preload; as=style, </a.png>; rel=preload; as=image
+ *
+ *  Values are remembered in a small direct mapped cache keyed by path
+ *  and validated by the etag of the document, so a document is scanned
+ *  again only once it changed.
+ *
+ *  @author Chen Chen
+ *  @bug the scan is not an html parser: tags inside comments or scripts
+ *       are hinted too, which costs a useless preload at worst
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "srv_def.h"
+#include "hints.h"
+#include "debug_define.h"
+
+
+struct hints_entry{
+        char path[FILENAME_MAX_LEN];     /* empty if the slot is unused */
+        char etag[ETAG_MAX_LEN];
+        char value[HINTS_VALUE_MAX];     /* empty if nothing to hint */
+};
+
+typedef struct hints_entry hints_entry_t;
+
+
+static hints_entry_t hints_cache[HINTS_CACHE_SIZE];
+static char hints_buf[HINTS_SCAN_LEN];
+
+
+static unsigned int hash_path(char *path)
+{
+        uint32_t h = 2166136261U;
+        while(*path){
+                h ^= (unsigned char)*(path++);
+                h *= 16777619U;
+        }
+        return h % HINTS_CACHE_SIZE;
+}
+
+/**
+ * @brief find the value of an attribute in a tag
+ * @param tag the tag, after its name
+ * @param end the closing '>' of the tag
+ * @param name the attribute name
+ * @param len set to the length of the value
+ * @return the value, unquoted, or NULL if the attribute is absent
+ */
+static char *get_attr(char *tag, char *end, char *name, int *len)
+{
+        int name_len = strlen(name);
+        char *val;
+        char *p;
+
+        for(p = tag + 1; p + name_len < end; p++){
+                if(!isspace((unsigned char)p[-1]) ||
+                   strncasecmp(p, name, name_len)){
+                        continue;
+                }
+                for(val = p + name_len; val < end && *val == ' '; val++);
+                if(val == end || *val != '='){
+                        continue;
+                }
+                for(val++; val < end && *val == ' '; val++);
+                if(val < end && (*val == '"' || *val == '\'')){
+                        for(p = val + 1; p < end && *p != *val; p++);
+                        val++;
+                }else{
+                        for(p = val; p < end && !isspace((unsigned char)*p);
+                            p++);
+                }
+                *len = p - val;
+                return val;
+        }
+        return NULL;
+}
+
+/* whether the url is of the same origin and safe to put in a header */
+static int is_hintable(char *url, int len)
+{
+        int i;
+
+        if(!len || len >= HINTS_URL_MAX || (url[0] == '/' && url[1] == '/')){
+                return 0;
+        }
+        for(i = 0; i < len; i++){
+                if(url[i] == ':' || (unsigned char)url[i] <= ' ' ||
+                   strchr("<>,;\"'\\", url[i])){
+                        return 0;
+                }
+                if(strchr("/?#", url[i])){
+                        break;
+                }
+        }
+        for(; i < len; i++){
+                if((unsigned char)url[i] <= ' ' || strchr("<>,;\"'\\", url[i])){
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* append one link to the value, unless it is already in or won't fit */
+static void add_hint(char *value, char *dir, char *url, int len, char *as)
+{
+        char link[HINTS_URL_MAX * 2 + FILENAME_MAX_LEN];
+        int value_len = strlen(value);
+        int link_len;
+
+        if(!is_hintable(url, len)){
+                return;
+        }
+        link_len = snprintf(link, sizeof(link), "<%s%.*s>",
+                            url[0] == '/' ? "" : dir, len, url);
+        if(link_len >= sizeof(link) || strstr(value, link)){
+                return;
+        }
+        snprintf(link + link_len, sizeof(link) - link_len,
+                 "; rel=preload; as=%s", as);
+        if(value_len + (value_len ? 2 : 0) + strlen(link) >=
+           HINTS_VALUE_MAX){
+                return;
+        }
+        if(value_len){
+                strcat(value, ", ");
+        }
+        strcat(value, link);
+}
+
+/* scan a document for its subresources */
+static void scan(char *path, char *buf, int len, char *value)
+{
+        char dir[FILENAME_MAX_LEN];
+        char *end = buf + len;
+        char *p = buf, *tag_end;
+        char *url, *rel;
+        int url_len, rel_len;
+        char *slash;
+        char *as;
+
+        /* the url of the directory of the document */
+        if(!strncmp(path, DEFAULT_FD, sizeof(DEFAULT_FD) - 1)){
+                path += sizeof(DEFAULT_FD) - 1;
+        }
+        slash = strrchr(path, '/');
+        snprintf(dir, sizeof(dir), "/%.*s",
+                 slash ? (int)(slash - path + 1) : 0, path);
+
+        value[0] = 0;
+        while(p < end && (p = memchr(p, '<', end - p))){
+                p++;
+                if(!(tag_end = memchr(p, '>', end - p))){
+                        break;
+                }
+                url = NULL;
+                if(!strncasecmp(p, "link", 4) && isspace((unsigned char)p[4])){
+                        rel = get_attr(p + 4, tag_end, "rel", &rel_len);
+                        if(rel && rel_len == 10 &&
+                           !strncasecmp(rel, "stylesheet", 10)){
+                                url = get_attr(p + 4, tag_end, "href",
+                                               &url_len);
+                                as = "style";
+                        }
+                }else if(!strncasecmp(p, "script", 6) &&
+                         isspace((unsigned char)p[6])){
+                        url = get_attr(p + 6, tag_end, "src", &url_len);
+                        as = "script";
+                }else if(!strncasecmp(p, "img", 3) &&
+                         isspace((unsigned char)p[3])){
+                        url = get_attr(p + 3, tag_end, "src", &url_len);
+                        as = "image";
+                }
+                if(url){
+                        add_hint(value, dir, url, url_len, as);
+                }
+                p = tag_end + 1;
+        }
+}
+
+/**
+ * @brief get the Link value for a version of a document, scanning it
+ *        if that version wasn't yet
+ * @param path the path of the document
+ * @param etag the opaque tag of its version
+ * @param fd the opened document
+ * @return the value, or NULL if there is nothing to hint
+ */
+char *hints_get(char *path, char *etag, int fd)
+{
+        hints_entry_t *entry = &hints_cache[hash_path(path)];
+        ssize_t len;
+
+        if(strcmp(entry->path, path) || strcmp(entry->etag, etag)){
+                if((len = pread(fd, hints_buf, HINTS_SCAN_LEN, 0)) < 0){
+                        return NULL;
+                }
+                snprintf(entry->path, FILENAME_MAX_LEN, "%s", path);
+                snprintf(entry->etag, ETAG_MAX_LEN, "%s", etag);
+                scan(path, hints_buf, len, entry->value);
+                dbg_printf("hints (%s): %s", path, entry->value);
+        }
+        return entry->value[0] ? entry->value : NULL;
+}
+
+/**
+ * @brief get the Link value of whatever version of a document was last
+ *        scanned, without opening it; good enough for a hint
+ * @param path the path of the document
+ * @return the value, or NULL if there is nothing known to hint
+ */
+char *hints_peek(char *path)
+{
+        hints_entry_t *entry = &hints_cache[hash_path(path)];
+
+        if(strcmp(entry->path, path) || !entry->value[0]){
+                return NULL;
+        }
+        return entry->value;
+}
@@ -0,0 +1,207 @@
+/** @file hot_set.c
+ *  @brief the most requested static resources, kept across restarts
+ *
+ *  Resources are counted in a fixed pool of entries with the space
+ *  saving algorithm: once the pool is full, a resource not in it takes
+ *  over the entry with the lowest count, and goes on from that count.
+ *  The resources requested most never lose their entry that way, however
+ *  many others are requested once.
+ *
+ *  Every HOT_SET_SAVE_SECS at most, if anything was counted, the
+ *  HOT_SET_SAVE_MAX hottest resources are written to HOT_SET_FILENAME,
+ *  one "<count> <path>" per line, hottest first; the file is replaced
+ *  with a rename so a crash never leaves half a snapshot. At startup the
+ *  snapshot seeds the counts (halved, so that old popularity fades) and
+ *  the head of the hottest resources is read into the page cache.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "srv_def.h"
+#include "hot_set.h"
+#include "docroot.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+struct hot_entry{
+        char path[FILENAME_MAX_LEN];
+        unsigned long ctr;
+        struct list_head hash_link;
+};
+
+typedef struct hot_entry hot_entry_t;
+
+
+static hot_entry_t hot_pool[HOT_SET_SIZE];
+static int hot_used = 0;
+static struct list_head hot_hash[HOT_SET_HASH_SIZE];
+static int hot_dirty = 0;
+static time_t hot_saved = 0;
+
+
+static unsigned int hash_path(char *path)
+{
+        uint32_t h = 2166136261U;
+        while(*path){
+                h ^= (unsigned char)*(path++);
+                h *= 16777619U;
+        }
+        return h % HOT_SET_HASH_SIZE;
+}
+
+static void count(char *path, unsigned long ctr)
+{
+        struct list_head *bucket = &hot_hash[hash_path(path)];
+        hot_entry_t *entry, *min;
+        int i;
+
+        list_for_each_entry(entry, bucket, hash_link){
+                if(!strcmp(entry->path, path)){
+                        entry->ctr += ctr;
+                        return;
+                }
+        }
+        if(hot_used < HOT_SET_SIZE){
+                entry = &hot_pool[hot_used++];
+                entry->ctr = 0;
+        }else{
+                for(min = &hot_pool[0], i = 1; i < HOT_SET_SIZE; i++){
+                        if(hot_pool[i].ctr < min->ctr){
+                                min = &hot_pool[i];
+                        }
+                }
+                entry = min;
+                list_del(&entry->hash_link);
+        }
+        snprintf(entry->path, FILENAME_MAX_LEN, "%s", path);
+        entry->ctr += ctr;
+        list_add(&entry->hash_link, bucket);
+}
+
+/** @brief count a request for a static resource */
+void hot_set_hit(char *path)
+{
+        count(path, 1);
+        hot_dirty = 1;
+}
+
+/* read the head of a resource into the page cache */
+static int prefetch(char *path)
+{
+        struct stat statbuf;
+        int fd;
+
+        if((fd = docroot_open(path)) < 0){
+                return -1;
+        }
+        if(fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode)){
+                close(fd);
+                return -1;
+        }
+        readahead(fd, 0, statbuf.st_size < HOT_PREFETCH_LEN ?
+                  statbuf.st_size : HOT_PREFETCH_LEN);
+        close(fd);
+        return 0;
+}
+
+/**
+ * @brief load the snapshot, and prefetch the hottest resources in it
+ *
+ * Meant to run before connections are accepted; paths are opened
+ * through the docroot, so a tampered snapshot can't read elsewhere.
+ *
+ * @return 0 on success, or if there is no snapshot yet
+ */
+int hot_set_init(void)
+{
+        char line[FILENAME_MAX_LEN + 32];
+        unsigned long ctr;
+        int prefetched = 0;
+        char *path;
+        FILE *fp;
+        int i;
+
+        for(i = 0; i < HOT_SET_HASH_SIZE; i++){
+                INIT_LIST_HEAD(&hot_hash[i]);
+        }
+        hot_saved = time(NULL);
+        if(!(fp = fopen(HOT_SET_FILENAME, "r"))){
+                return errno == ENOENT ? 0 : ERR_HOT_SET;
+        }
+        while(fgets(line, sizeof(line), fp)){
+                line[strcspn(line, "\n")] = 0;
+                ctr = strtoul(line, &path, 10);
+                if(*path != ' ' || !*(++path)){
+                        continue;
+                }
+                count(path, ctr / 2 + 1);
+                if(prefetched < HOT_PREFETCH_MAX && !prefetch(path)){
+                        prefetched++;
+                }
+        }
+        fclose(fp);
+        dbg_printf("hot set loaded, %d prefetched", prefetched);
+        return 0;
+}
+
+static int cmp_ctr(const void *a, const void *b)
+{
+        const hot_entry_t *x = *(const hot_entry_t **)a;
+        const hot_entry_t *y = *(const hot_entry_t **)b;
+        return x->ctr < y->ctr ? 1 : x->ctr > y->ctr ? -1 : 0;
+}
+
+/**
+ * @brief write the snapshot
+ * @return 0 on success, negative error code on failure
+ */
+int hot_set_save(void)
+{
+        hot_entry_t *sorted[HOT_SET_SIZE];
+        FILE *fp;
+        int i;
+
+        for(i = 0; i < hot_used; i++){
+                sorted[i] = &hot_pool[i];
+        }
+        qsort(sorted, hot_used, sizeof(sorted[0]), cmp_ctr);
+        /* don't retry a failing write on every tick */
+        hot_saved = time(NULL);
+
+        if(!(fp = fopen(HOT_SET_FILENAME ".tmp", "w"))){
+                err_printf("open %s failed", HOT_SET_FILENAME ".tmp");
+                return ERR_HOT_SET;
+        }
+        for(i = 0; i < hot_used && i < HOT_SET_SAVE_MAX; i++){
+                fprintf(fp, "%lu %s\n", sorted[i]->ctr, sorted[i]->path);
+        }
+        if(fclose(fp) || rename(HOT_SET_FILENAME ".tmp", HOT_SET_FILENAME)){
+                err_printf("write %s failed", HOT_SET_FILENAME);
+                unlink(HOT_SET_FILENAME ".tmp");
+                return ERR_HOT_SET;
+        }
+        hot_dirty = 0;
+        return 0;
+}
+
+/** @brief called from the main loop, writes the snapshot when due */
+void hot_set_tick(void)
+{
+        if(hot_dirty && time(NULL) - hot_saved >= HOT_SET_SAVE_SECS){
+                hot_set_save();
+        }
+}
@@ -0,0 +1,577 @@
+/** @file hpack.c
+ *  @brief HPACK, the header compression of http/2 (RFC 7541)
+ *
+ *  The Huffman code of HPACK is canonical, so only the length of each
+ *  code is tabled; hpack_init derives the codes from them for encoding,
+ *  and the counts per length and the symbols in code order for decoding,
+ *  which then walks one bit at a time. Header blocks are a few hundred
+ *  bytes, that is fast enough.
+ *
+ *  A name or value is decoded into a buffer on the stack and handed to
+ *  the field callback from there, so the dynamic table may evict the
+ *  entry it was named by while it is being added.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+#define HUFF_SYMS     257                /* every octet, and EOS */
+#define HUFF_EOS      256
+#define HUFF_LEN_MAX  30
+
+
+struct hpack_static{
+        const char *name;
+        const char *value;
+};
+
+/* RFC 7541, appendix A */
+static const struct hpack_static hpack_static[] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+};
+
+#define HPACK_STATIC_CTR  ((int)(sizeof(hpack_static) / sizeof(hpack_static[0])))
+
+/* RFC 7541, appendix B: the code length of each symbol */
+static const unsigned char huff_len[HUFF_SYMS] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30,
+};
+
+static uint32_t huff_code[HUFF_SYMS];
+/* # of codes of each length, and the symbols by length then value */
+static int huff_count[HUFF_LEN_MAX + 1];
+static short huff_sym[HUFF_SYMS];
+
+
+/** @brief derive the Huffman codes from their lengths */
+void hpack_init(void)
+{
+        int offs[HUFF_LEN_MAX + 1];
+        uint32_t code = 0;
+        int len, i;
+
+        memset(huff_count, 0, sizeof(huff_count));
+        for(i = 0; i < HUFF_SYMS; i++){
+                huff_count[huff_len[i]]++;
+        }
+        offs[1] = 0;
+        for(len = 1; len < HUFF_LEN_MAX; len++){
+                offs[len + 1] = offs[len] + huff_count[len];
+        }
+        for(i = 0; i < HUFF_SYMS; i++){
+                huff_sym[offs[huff_len[i]]++] = i;
+        }
+        /* canonical: consecutive codes within a length, in symbol order */
+        for(len = 1, i = 0; len <= HUFF_LEN_MAX; len++){
+                for(; i < offs[len]; i++){
+                        huff_code[huff_sym[i]] = code++;
+                }
+                code <<= 1;
+        }
+}
+
+/**
+ * @brief decode a Huffman coded string
+ * @return the length decoded into out, -1 if it is malformed or longer
+ *         than room
+ */
+static int huff_decode(const unsigned char *in, int len, char *out, int room)
+{
+        int code = 0, first = 0, idx = 0, bits = 0;
+        int is_ones = 1;                 /* the pending bits are all 1 */
+        int ctr = 0;
+        int bit, sym;
+        int i, j;
+
+        for(i = 0; i < len; i++){
+                for(j = 7; j >= 0; j--){
+                        bit = (in[i] >> j) & 1;
+                        code |= bit;
+                        is_ones &= bit;
+                        bits++;
+                        if(code - huff_count[bits] < first){
+                                sym = huff_sym[idx + (code - first)];
+                                if(sym == HUFF_EOS || ctr == room){
+                                        return -1;
+                                }
+                                out[ctr++] = sym;
+                                code = first = idx = bits = 0;
+                                is_ones = 1;
+                                continue;
+                        }
+                        if(bits == HUFF_LEN_MAX){
+                                return -1;
+                        }
+                        idx += huff_count[bits];
+                        first = (first + huff_count[bits]) << 1;
+                        code <<= 1;
+                }
+        }
+        /* padded to the octet with the leading bits of EOS */
+        if(bits > 7 || !is_ones){
+                return -1;
+        }
+        return ctr;
+}
+
+/* octets the Huffman code of a string takes */
+static int huff_encoded_len(const unsigned char *in, int len)
+{
+        long long bits = 0;
+        int i;
+
+        for(i = 0; i < len; i++){
+                bits += huff_len[in[i]];
+        }
+        return (bits + 7) / 8;
+}
+
+/* Huffman code a string into out, which huff_encoded_len has room for */
+static void huff_encode(const unsigned char *in, int len, char *out)
+{
+        uint64_t acc = 0;
+        int bits = 0;
+        int i;
+
+        for(i = 0; i < len; i++){
+                acc = (acc << huff_len[in[i]]) | huff_code[in[i]];
+                bits += huff_len[in[i]];
+                while(bits >= 8){
+                        bits -= 8;
+                        *(out++) = acc >> bits;
+                }
+        }
+        if(bits){
+                *out = (acc << (8 - bits)) | (0xff >> bits);
+        }
+}
+
+/**
+ * @brief decode an integer with an n bit prefix, advancing *pos
+ * @return 0 on success, -1 if it is cut short or overflows
+ */
+static int get_int(const unsigned char **pos, const unsigned char *end,
+                   int n, uint32_t *val)
+{
+        uint32_t mask = (1 << n) - 1;
+        int shift = 0;
+        uint32_t b;
+
+        if(*pos == end){
+                return -1;
+        }
+        *val = *((*pos)++) & mask;
+        if(*val < mask){
+                return 0;
+        }
+        do{
+                if(*pos == end || shift > 21){
+                        /* no field here needs more than 28 bits */
+                        return -1;
+                }
+                b = *((*pos)++);
+                *val += (b & 0x7f) << shift;
+                shift += 7;
+        }while(b & 0x80);
+        return 0;
+}
+
+/* encode an integer with an n bit prefix after flags, -1 if no room */
+static int put_int(char *out, int room, int n, int flags, uint32_t val)
+{
+        uint32_t mask = (1 << n) - 1;
+        int ctr = 0;
+
+        if(room < 1){
+                return -1;
+        }
+        if(val < mask){
+                out[ctr++] = flags | val;
+                return ctr;
+        }
+        out[ctr++] = flags | mask;
+        val -= mask;
+        while(val >= 0x80){
+                if(ctr == room){
+                        return -1;
+                }
+                out[ctr++] = (val & 0x7f) | 0x80;
+                val >>= 7;
+        }
+        if(ctr == room){
+                return -1;
+        }
+        out[ctr++] = val;
+        return ctr;
+}
+
+/**
+ * @brief decode a string literal, advancing *pos
+ * @return its length, terminated in out, or -1 if it is malformed
+ */
+static int get_str(const unsigned char **pos, const unsigned char *end,
+                   char *out)
+{
+        int is_huff;
+        uint32_t len;
+        int ctr;
+
+        if(*pos == end){
+                return -1;
+        }
+        is_huff = **pos & 0x80;
+        if(get_int(pos, end, 7, &len) < 0 || len > end - *pos){
+                return -1;
+        }
+        if(is_huff){
+                ctr = huff_decode(*pos, len, out, HPACK_STR_MAX);
+        }else if(len <= HPACK_STR_MAX){
+                memcpy(out, *pos, len);
+                ctr = len;
+        }else{
+                ctr = -1;
+        }
+        *pos += len;
+        if(ctr >= 0){
+                out[ctr] = 0;
+        }
+        return ctr;
+}
+
+/* encode a string literal, Huffman coded if that is shorter */
+static int put_str(char *out, int room, const char *str, int len)
+{
+        int huff_len = huff_encoded_len((const unsigned char *)str, len);
+        int ctr;
+
+        if(huff_len < len){
+                if((ctr = put_int(out, room, 7, 0x80, huff_len)) < 0 ||
+                   room - ctr < huff_len){
+                        return -1;
+                }
+                huff_encode((const unsigned char *)str, len, out + ctr);
+                return ctr + huff_len;
+        }
+        if((ctr = put_int(out, room, 7, 0, len)) < 0 || room - ctr < len){
+                return -1;
+        }
+        memcpy(out + ctr, str, len);
+        return ctr + len;
+}
+
+
+void hpack_dec_init(hpack_dec_t *dec)
+{
+        dec->first = 0;
+        dec->ctr = 0;
+        dec->size = 0;
+        dec->max_size = HPACK_TABLE_SIZE;
+}
+
+/* drop the oldest entry of the dynamic table */
+static void evict(hpack_dec_t *dec)
+{
+        hpack_entry_t *entry;
+
+        entry = &dec->entries[(dec->first + dec->ctr - 1) % HPACK_ENTRIES_MAX];
+        dec->size -= entry->name_len + entry->value_len +
+                HPACK_ENTRY_OVERHEAD;
+        free(entry->name);
+        dec->ctr--;
+}
+
+void hpack_dec_clear(hpack_dec_t *dec)
+{
+        while(dec->ctr){
+                evict(dec);
+        }
+}
+
+/* make room for an entry of size, then add it as the newest */
+static int insert(hpack_dec_t *dec, char *name, int name_len, char *value,
+                  int value_len)
+{
+        int size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+        hpack_entry_t *entry;
+        char *buf;
+
+        while(dec->ctr && dec->size + size > dec->max_size){
+                evict(dec);
+        }
+        if(size > dec->max_size){
+                /* too large for the table, which is left empty */
+                return 0;
+        }
+        if(!(buf = (char *)malloc(name_len + value_len + 2))){
+                return ERR_NO_MEM;
+        }
+        dec->first = (dec->first + HPACK_ENTRIES_MAX - 1) % HPACK_ENTRIES_MAX;
+        entry = &dec->entries[dec->first];
+        entry->name = buf;
+        entry->name_len = name_len;
+        memcpy(buf, name, name_len + 1);
+        entry->value = buf + name_len + 1;
+        entry->value_len = value_len;
+        memcpy(entry->value, value, value_len + 1);
+        dec->ctr++;
+        dec->size += size;
+        return 0;
+}
+
+/**
+ * @brief copy the name, and value if wanted, of the field at index
+ * @return 0 on success, -1 if there is no such index
+ */
+static int lookup(hpack_dec_t *dec, uint32_t idx, char *name, int *name_len,
+                  char *value, int *value_len)
+{
+        hpack_entry_t *entry;
+
+        if(!idx || idx > HPACK_STATIC_CTR + dec->ctr){
+                return -1;
+        }
+        if(idx <= HPACK_STATIC_CTR){
+                *name_len = strlen(hpack_static[idx - 1].name);
+                memcpy(name, hpack_static[idx - 1].name, *name_len + 1);
+                if(value){
+                        *value_len = strlen(hpack_static[idx - 1].value);
+                        memcpy(value, hpack_static[idx - 1].value,
+                               *value_len + 1);
+                }
+                return 0;
+        }
+        entry = &dec->entries[(dec->first + idx - HPACK_STATIC_CTR - 1) %
+                              HPACK_ENTRIES_MAX];
+        *name_len = entry->name_len;
+        memcpy(name, entry->name, *name_len + 1);
+        if(value){
+                *value_len = entry->value_len;
+                memcpy(value, entry->value, *value_len + 1);
+        }
+        return 0;
+}
+
+/**
+ * @brief decode a header block, calling field for each of its fields
+ *
+ * Every block of a connection must be decoded, in order, even those of
+ * streams that are refused, or the dynamic table goes out of step.
+ *
+ * @param dec the decoder of the connection
+ * @param block the header block, the fragments of its frames joined
+ * @param len its length
+ * @param field called for each field
+ * @param arg passed to field
+ * @return 0 on success, ERR_HPACK if the block is malformed, or what
+ *         field returned if negative
+ */
+int hpack_decode(hpack_dec_t *dec, const unsigned char *block, int len,
+                 hpack_field_fn field, void *arg)
+{
+        char name[HPACK_STR_MAX + 1];
+        char value[HPACK_STR_MAX + 1];
+        const unsigned char *pos = block;
+        const unsigned char *end = block + len;
+        int name_len, value_len;
+        int is_first = 1;
+        uint32_t idx;
+        int b, ret;
+
+        while(pos < end){
+                b = *pos;
+                if(b & 0x80){
+                        /* indexed field */
+                        if(get_int(&pos, end, 7, &idx) < 0 ||
+                           lookup(dec, idx, name, &name_len, value,
+                                  &value_len) < 0){
+                                return ERR_HPACK;
+                        }
+                }else if((b & 0xe0) == 0x20){
+                        /* dynamic table size update, only ahead of the
+                         * fields and within what we allowed */
+                        if(!is_first || get_int(&pos, end, 5, &idx) < 0 ||
+                           idx > HPACK_TABLE_SIZE){
+                                return ERR_HPACK;
+                        }
+                        dec->max_size = idx;
+                        while(dec->ctr && dec->size > dec->max_size){
+                                evict(dec);
+                        }
+                        continue;
+                }else{
+                        /* literal, with incremental indexing if 01 */
+                        if(get_int(&pos, end, (b & 0xc0) == 0x40 ? 6 : 4,
+                                   &idx) < 0){
+                                return ERR_HPACK;
+                        }
+                        if(idx){
+                                if(lookup(dec, idx, name, &name_len, NULL,
+                                          NULL) < 0){
+                                        return ERR_HPACK;
+                                }
+                        }else if((name_len = get_str(&pos, end, name)) < 0){
+                                return ERR_HPACK;
+                        }
+                        if((value_len = get_str(&pos, end, value)) < 0){
+                                return ERR_HPACK;
+                        }
+                        if((b & 0xc0) == 0x40 &&
+                           (ret = insert(dec, name, name_len, value,
+                                         value_len)) < 0){
+                                return ret;
+                        }
+                }
+                is_first = 0;
+                if((ret = field(arg, name, name_len, value, value_len)) < 0){
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+/**
+ * @brief encode :status
+ * @return the # of bytes written to out, -1 if room is short
+ */
+int hpack_encode_status(char *out, int room, int status)
+{
+        char value[8];
+        int ctr;
+        int ret;
+        int i;
+
+        snprintf(value, sizeof(value), "%03d", status % 1000);
+        for(i = 0; i < HPACK_STATIC_CTR; i++){
+                if(!strcmp(hpack_static[i].name, ":status") &&
+                   !strcmp(hpack_static[i].value, value)){
+                        return put_int(out, room, 7, 0x80, i + 1);
+                }
+        }
+        /* a literal named by the first :status entry */
+        for(i = 0; strcmp(hpack_static[i].name, ":status"); i++);
+        if((ctr = put_int(out, room, 4, 0, i + 1)) < 0 ||
+           (ret = put_str(out + ctr, room - ctr, value, 3)) < 0){
+                return -1;
+        }
+        return ctr + ret;
+}
+
+/**
+ * @brief encode a field as a literal that isn't indexed
+ * @param out where to write it
+ * @param room bytes left at out
+ * @param name the name, in lower case
+ * @param value the value
+ * @param value_len its length
+ * @return the # of bytes written to out, -1 if room is short
+ */
+int hpack_encode_field(char *out, int room, const char *name,
+                       const char *value, int value_len)
+{
+        int ctr;
+        int ret;
+        int i;
+
+        for(i = 0; i < HPACK_STATIC_CTR &&
+                    strcmp(hpack_static[i].name, name); i++);
+        if(i < HPACK_STATIC_CTR){
+                ctr = put_int(out, room, 4, 0, i + 1);
+        }else if((ctr = put_int(out, room, 4, 0, 0)) >= 0 &&
+                 (ret = put_str(out + ctr, room - ctr, name,
+                                strlen(name))) >= 0){
+                ctr += ret;
+        }else{
+                return -1;
+        }
+        if(ctr < 0 ||
+           (ret = put_str(out + ctr, room - ctr, value, value_len)) < 0){
+                return -1;
+        }
+        return ctr + ret;
+}
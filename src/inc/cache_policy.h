@@ -0,0 +1,37 @@
+/** @file cache_policy.h
+ *  @brief Cache-Control and Expires of static responses, by url
+ *
+ *  A table of rules maps url prefixes ("/images/") and suffixes
+ *  ("*.css") to a caching directive. The table is read from
+ *  CACHE_POLICY_FILENAME at startup, or is the built-in one if there is
+ *  no such file, and is compiled into a trie looked up per request.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __CACHE_POLICY_H_
+#define __CACHE_POLICY_H_
+
+
+#define CACHE_POLICY_FILENAME "liso_cache"  /* next to SRV_LOG_FILENAME */
+#define CACHE_RULE_MAX       64             /* max # of rules */
+#define CACHE_PATTERN_MAX    64             /* max length of a pattern */
+#define CACHE_TRIE_MAX       2048           /* max # of trie nodes */
+#define CACHE_CTRL_MAX       64             /* max length of Cache-Control */
+#define CACHE_IMMUTABLE_AGE  31536000       /* max-age of immutable, 1 year */
+
+
+struct cache_rule{
+        char cache_ctrl[CACHE_CTRL_MAX]; /* the Cache-Control value */
+        long max_age;                    /* for Expires, -1 for none */
+};
+
+typedef struct cache_rule cache_rule_t;
+
+
+int cache_policy_init(void);
+const cache_rule_t *cache_policy_lookup(char *url);
+
+
+#endif /* end of __CACHE_POLICY_H_ */
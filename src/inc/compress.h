@@ -0,0 +1,92 @@
+/** @file compress.h
+ *  @brief on-the-fly gzip/deflate of responses, and the cache of
+ *         compressed static resources
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __COMPRESS_H_
+#define __COMPRESS_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "list.h"
+#include "http.h"
+#include "srv_def.h"
+
+
+#define COMP_LEVEL            6
+#define COMP_MIN_SIZE         256          /* don't compress below this */
+#define COMP_CACHE_MAX_FILE   (1 << 20)    /* max compressed size cached */
+#define COMP_CACHE_MAX_BYTES  (16 << 20)   /* max bytes in the cache */
+#define COMP_CACHE_HASH_SIZE  0xff
+
+/* room a chunk needs on top of its data: "xxxx\r\n" ... "\r\n" */
+#define COMP_CHUNK_HDR_LEN    6
+#define COMP_CHUNK_OVERHEAD   (COMP_CHUNK_HDR_LEN + 2)
+#define COMP_LAST_CHUNK       "0\r\n\r\n"
+/* don't start a chunk with less room than this */
+#define COMP_CHUNK_MIN_ROOM   64
+
+/* what a comp stream is doing with its input */
+enum comp_mode{
+        COMP_STATIC,          /* deflate a static resource */
+        COMP_CGI_HDR,         /* collecting the header of cgi output */
+        COMP_CGI_DEFLATE,     /* deflate the body of cgi output */
+        COMP_CGI_RAW,         /* cgi output is not compressed, copy it */
+};
+
+/* compressed body of a static resource */
+struct comp_entry{
+        char path[FILENAME_MAX_LEN];
+        time_t mtime;
+        off_t size;
+        ino_t ino;
+        int enc;
+
+        char *data;
+        int len;
+        int cap;
+
+        int ref;                         /* # of senders using it */
+        int is_cached;                   /* linked into the cache */
+        struct list_head hash_link;
+        struct list_head lru_link;
+};
+
+struct comp_stream{
+        z_stream strm;
+        int enc;
+        enum comp_mode mode;
+        int is_flush_pending;            /* zlib still holds output */
+        int is_done;                     /* last chunk has been produced */
+
+        /* compressed output collected for the cache, or NULL */
+        comp_entry_t *entry;
+
+        /* input read from cgi, pending in [in_pos, in_ctr) */
+        char in_buf[BUF_OUT_SIZE];
+        int in_pos;
+        int in_ctr;
+        int in_eof;
+};
+
+
+int comp_choose_enc(req_msg_t *req_msg);
+char *comp_enc_name(int enc);
+int comp_is_compressible(char *mime_type);
+
+comp_entry_t *comp_cache_get(char *path, struct stat *statbuf, int enc);
+void comp_entry_put(comp_entry_t *entry);
+
+comp_stream_t *comp_stream_new(int enc, enum comp_mode mode,
+                               char *path, struct stat *statbuf);
+void comp_stream_free(comp_stream_t *cs);
+int comp_deflate_chunk(comp_stream_t *cs, char *in, int in_len,
+                       int *consumed, int finish, char *out, int room);
+
+
+#endif /* end of __COMPRESS_H_ */
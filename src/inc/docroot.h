@@ -0,0 +1,23 @@
+/** @file docroot.h
+ *  @brief opening resources beneath the docroot
+ *
+ *  The docroot is opened once as a directory fd; resources are opened
+ *  relative to it, and never resolve to anything outside of it.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __DOCROOT_H_
+#define __DOCROOT_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+
+int docroot_init(char *docroot);
+int docroot_open(char *path);
+int docroot_stat(char *path, struct stat *statbuf);
+
+
+#endif /* end of __DOCROOT_H_ */
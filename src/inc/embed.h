@@ -0,0 +1,78 @@
+/** @file embed.h
+ *  @brief static site compiled into the server binary
+ *
+ *  `make embed` runs embed_gen over the docroot, which writes
+ *  embed_site.c: the bytes of every resource, a gzip variant of those
+ *  that compress well, the .br sidecars found next to them, a fully
+ *  rendered 200 header for each variant, and a perfect hash from url
+ *  path to resource. Linked in, these are served from read only memory
+ *  without touching the file system. Without it, embed_lookup() always
+ *  misses.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __EMBED_H_
+#define __EMBED_H_
+
+#include <stdint.h>
+#include <time.h>
+
+
+#define EMBED_VAR_MAX   3        /* identity, gzip, br */
+
+/* where the date goes in a rendered header: after the status line */
+#define EMBED_DATE_OFF  (sizeof("HTTP/1.1 200 OK\r\nDate: ") - 1)
+/* the minor version digit of the status line */
+#define EMBED_VER_OFF   (sizeof("HTTP/1.") - 1)
+
+
+/* one representation of a resource */
+struct embed_var{
+        int enc;                         /* ENC_*, 0 for identity */
+        const char *hdr;                 /* HTTP/1.1 200 header */
+        int hdr_len;
+        const char *body;
+        long long len;
+};
+
+struct embed_rsrc{
+        const char *path;                /* url path, e.g. "/style.css" */
+        const char *mime_type;
+        const char *etag;                /* opaque tag, before encoding */
+        time_t mtime;
+        int var_ctr;
+        struct embed_var vars[EMBED_VAR_MAX];
+};
+
+struct embed_site{
+        const struct embed_rsrc *rsrcs;
+        int rsrc_ctr;
+        const int16_t *slots;            /* rsrc index by hash, -1 if none */
+        uint32_t slot_ctr;
+        uint32_t seed;
+};
+
+typedef struct embed_var embed_var_t;
+typedef struct embed_rsrc embed_rsrc_t;
+typedef struct embed_site embed_site_t;
+
+
+/* FNV-1a, seeded; embed_gen searches for a seed without collisions */
+static inline uint32_t embed_hash(const char *path, uint32_t seed)
+{
+        uint32_t h = 2166136261U ^ seed;
+        while(*path){
+                h ^= (unsigned char)*(path++);
+                h *= 16777619U;
+        }
+        return h;
+}
+
+
+const embed_rsrc_t *embed_lookup(char *path);
+const embed_var_t *embed_select(const embed_rsrc_t *rsrc, int accepted);
+
+
+#endif /* end of __EMBED_H_ */
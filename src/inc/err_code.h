@@ -35,6 +35,15 @@
 #define ERR_INIT_CLI         -0x116
 #define ERR_HDR_TOO_LONG     -0x117
 #define ERR_CLOSE_FD         -0x118
+#define ERR_INOTIFY          -0x119
+#define ERR_COMPRESS         -0x11a
+#define ERR_RANGE_NOT_SATISFIABLE -0x11b
+#define ERR_IO_POOL          -0x11c
+#define ERR_DOCROOT          -0x11d
+#define ERR_HOT_SET          -0x11e
+#define ERR_CACHE_POLICY     -0x11f
+#define ERR_SSL_CACHE        -0x120
+#define ERR_HPACK            -0x121
 
 
 
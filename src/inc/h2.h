@@ -0,0 +1,180 @@
+/** @file h2.h
+ *  @brief http/2 (RFC 9113) on top of a tcp or tls connection
+ *
+ *  A connection speaks http/2 once ALPN picked h2 on the ssl port, or
+ *  on the tcp port once the client sent the preface right away or was
+ *  upgraded to h2c. Each stream gets a control block of its own, an
+ *  H2_STREAM, that the request handlers take for a connection carrying
+ *  a single HTTP/1.1 request; what they write into its buf_out is taken
+ *  apart again into HEADERS and DATA frames. Streams are sent by their
+ *  priority (RFC 9218) within the flow control windows of the peer.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __H2_H_
+#define __H2_H_
+
+#include <stdint.h>
+
+#include <openssl/ssl.h>
+
+#include "list.h"
+#include "srv_def.h"
+#include "hpack.h"
+
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN      (sizeof(H2_PREFACE) - 1)
+#define H2_FRAME_HDR_LEN    9
+/* SETTINGS_MAX_FRAME_SIZE, left at its default */
+#define H2_FRAME_MAX        16384
+#define H2_WINDOW_INIT      65535
+#define H2_WINDOW_MAX       0x7fffffff
+/* SETTINGS_MAX_CONCURRENT_STREAMS, more are refused */
+#define H2_STREAMS_MAX      32
+/* SETTINGS_MAX_HEADER_LIST_SIZE, as much as an HTTP/1 request may have */
+#define H2_HDR_LIST_MAX     BUF_PROC_SIZE
+/* a header block, CONTINUATIONs included, before it is decoded */
+#define H2_HDR_BLOCK_MAX    (2 * H2_FRAME_MAX)
+/* a request body, as much as an HTTP/1 request may have */
+#define H2_BODY_MAX         BUF_PROC_SIZE
+/* the HTTP/1 header of a response, before it is turned into HEADERS */
+#define H2_RSP_HDR_MAX      4096
+/* control frames waiting for room in buf_out */
+#define H2_CTL_SIZE         1024
+#define H2_URGENCY_LEVELS   8
+#define H2_URGENCY_DEFAULT  3
+
+enum h2_frame_type{
+        H2_DATA = 0x0,
+        H2_HEADERS = 0x1,
+        H2_PRIORITY = 0x2,
+        H2_RST_STREAM = 0x3,
+        H2_SETTINGS = 0x4,
+        H2_PUSH_PROMISE = 0x5,
+        H2_PING = 0x6,
+        H2_GOAWAY = 0x7,
+        H2_WINDOW_UPDATE = 0x8,
+        H2_CONTINUATION = 0x9,
+        H2_PRIORITY_UPDATE = 0x10,       /* RFC 9218 */
+};
+
+#define H2_FLAG_END_STREAM  0x1
+#define H2_FLAG_ACK         0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED      0x8
+#define H2_FLAG_PRIORITY    0x20
+
+enum h2_settings_id{
+        H2_SET_HEADER_TABLE_SIZE = 0x1,
+        H2_SET_ENABLE_PUSH = 0x2,
+        H2_SET_MAX_CONCURRENT_STREAMS = 0x3,
+        H2_SET_INITIAL_WINDOW_SIZE = 0x4,
+        H2_SET_MAX_FRAME_SIZE = 0x5,
+        H2_SET_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+enum h2_error{
+        H2_NO_ERROR = 0x0,
+        H2_PROTOCOL_ERROR = 0x1,
+        H2_INTERNAL_ERROR = 0x2,
+        H2_FLOW_CONTROL_ERROR = 0x3,
+        H2_STREAM_CLOSED = 0x5,
+        H2_FRAME_SIZE_ERROR = 0x6,
+        H2_REFUSED_STREAM = 0x7,
+        H2_CANCEL = 0x8,
+        H2_COMPRESSION_ERROR = 0x9,
+        H2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum h2_stream_state{
+        H2_STREAM_OPEN = 0,              /* the request is coming in */
+        H2_STREAM_HALF_CLOSED,           /* it is in, the response goes out */
+        H2_STREAM_DONE,                  /* done or reset, to be freed */
+};
+
+/* where the HTTP/1 response of a stream is taken apart */
+enum h2_rsp_state{
+        H2_RSP_HDR = 0,                  /* status line and fields */
+        H2_RSP_BODY,                     /* body as is */
+        H2_RSP_CHUNK_SIZE,               /* chunked body, size digits */
+        H2_RSP_CHUNK_EXT,                /* rest of the size line */
+        H2_RSP_CHUNK_DATA,
+        H2_RSP_CHUNK_END,                /* CRLF after the chunk data */
+        H2_RSP_TRAILER,                  /* trailer, dropped */
+        H2_RSP_DONE,                     /* anything more is dropped */
+};
+
+struct h2_stream{
+        cli_cb_tcp_t tcp_base;           /* what the handlers see */
+        h2_conn_t *conn;
+        uint32_t id;
+        enum h2_stream_state state;
+        long long send_window;
+        int recv_window;
+        int urgency;                     /* 0 is the most urgent */
+        int is_incremental;              /* shares its urgency round robin */
+        req_msg_t *req_msg;              /* while the request comes in */
+        int hdr_list_len;                /* of req_msg, as the peer counts */
+
+        enum h2_rsp_state rsp_state;
+        char rsp_hdr[H2_RSP_HDR_MAX + 1];  /* header of the response so far */
+        int rsp_hdr_ctr;
+        int is_hdr_done;                 /* rsp_hdr is whole, not sent yet */
+        int is_final_sent;               /* a non-1xx HEADERS went out */
+        long long chunk_left;            /* or length of a trailer line */
+        int last_off;                    /* last frame in buf_out, or -1 */
+
+        struct list_head link;
+};
+
+typedef struct h2_stream h2_stream_t;
+
+struct h2_conn{
+        cli_cb_tcp_t *tcp_cb;
+        int preface_ctr;                 /* bytes of the preface seen */
+
+        unsigned char frame[H2_FRAME_HDR_LEN + H2_FRAME_MAX];
+        int frame_ctr;                   /* frame being reassembled */
+        unsigned char hdr_block[H2_HDR_BLOCK_MAX];
+        int hdr_block_ctr;
+        uint32_t hdr_stream_id;          /* expecting CONTINUATION, or 0 */
+        int hdr_flags;
+
+        char ctl[H2_CTL_SIZE];           /* control frames to go out */
+        int ctl_ctr;
+
+        hpack_dec_t dec;
+        struct list_head stream_list;    /* by id */
+        int stream_ctr;
+        uint32_t last_stream_id;         /* highest the peer opened */
+        uint32_t rr_id;                  /* incremental stream sent last */
+
+        long long send_window;
+        int recv_window;
+        long long peer_window_init;      /* SETTINGS_INITIAL_WINDOW_SIZE */
+        int peer_frame_max;              /* SETTINGS_MAX_FRAME_SIZE */
+        int is_goaway;                   /* sent, closing once it is out */
+        int is_peer_goaway;              /* closing once streams are done */
+};
+
+
+void h2_init(void);
+
+int h2_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg);
+int h2_is_alpn(SSL *ssl);
+int h2_is_preface(char *buf, int len);
+int h2_is_upgrade(cli_cb_tcp_t *tcp_cb, req_msg_t *req_msg);
+
+int h2_start(cli_cb_tcp_t *tcp_cb, req_msg_t *upgrade);
+int h2_parse(cli_cb_base_t *cb);
+int h2_handle(cli_cb_base_t *cb);
+void h2_close(cli_cb_tcp_t *tcp_cb);
+
+int h2_stream_send(cli_cb_base_t *cb);
+
+
+#endif /* end of __H2_H_ */
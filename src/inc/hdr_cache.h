@@ -0,0 +1,43 @@
+/** @file hdr_cache.h
+ *  @brief pre-serialized response headers of static resources, and the
+ *         table of mime types by extension
+ *
+ *  The header fields of a 200 response only change with the resource
+ *  and the representation sent, so they are rendered once and copied
+ *  from then on. Only the Date is patched in per request.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __HDR_CACHE_H_
+#define __HDR_CACHE_H_
+
+#include "list.h"
+#include "srv_def.h"
+#include "http.h"
+
+
+#define HDR_CACHE_SIZE       256       /* max # of cached header blocks */
+#define HDR_CACHE_HASH_SIZE  0xff      /* # of hash buckets */
+#define HDR_TMPL_MAX         512       /* max length of a header block */
+#define HDR_ENC_MAX_LEN      16        /* max length of a content coding */
+#define HDR_CTRL_MAX_LEN     64        /* max length of a Cache-Control */
+
+/* every header block starts with the Date field, the date goes here */
+#define HDR_DATE_OFF         (sizeof("Date: ") - 1)
+/* and the Expires field follows if there is one */
+#define HDR_EXPIRES_OFF      (HDR_DATE_OFF + HTTP_DATE_LEN + \
+                              sizeof("\r\nExpires: ") - 1)
+
+
+void hdr_cache_init(void);
+char *hdr_cache_get(char *path, char *enc, char *etag, long long len,
+                    char *cache_ctrl, int *hdr_len);
+void hdr_cache_put(char *path, char *enc, char *etag, long long len,
+                   char *cache_ctrl, char *hdr, int hdr_len);
+
+char *hdr_mime_type(char *path);
+
+
+#endif /* end of __HDR_CACHE_H_ */
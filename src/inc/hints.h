@@ -0,0 +1,27 @@
+/** @file hints.h
+ *  @brief preload hints for the subresources of html documents
+ *
+ *  An html document is scanned once per version for the stylesheets,
+ *  scripts and images it pulls in; they are announced in a Link header
+ *  with rel=preload, and in a 103 Early Hints response while the
+ *  document itself is still being opened.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __HINTS_H_
+#define __HINTS_H_
+
+
+#define HINTS_CACHE_SIZE     64             /* # of documents remembered */
+#define HINTS_SCAN_LEN       (16 << 10)     /* bytes of a document scanned */
+#define HINTS_VALUE_MAX      256            /* max length of the Link value */
+#define HINTS_URL_MAX        128            /* longer urls are not hinted */
+
+
+char *hints_get(char *path, char *etag, int fd);
+char *hints_peek(char *path);
+
+
+#endif /* end of __HINTS_H_ */
@@ -0,0 +1,32 @@
+/** @file hot_set.h
+ *  @brief the most requested static resources, kept across restarts
+ *
+ *  The static path counts what it serves; the hottest resources are
+ *  written to a snapshot next to the server log now and then, and read
+ *  ahead into the page cache at startup, before connections are
+ *  accepted.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __HOT_SET_H_
+#define __HOT_SET_H_
+
+
+#define HOT_SET_FILENAME     "liso_hot"     /* next to SRV_LOG_FILENAME */
+#define HOT_SET_SIZE         256            /* max # of resources counted */
+#define HOT_SET_HASH_SIZE    0xff
+#define HOT_SET_SAVE_MAX     64             /* # of resources in a snapshot */
+#define HOT_SET_SAVE_SECS    60             /* min time between snapshots */
+#define HOT_PREFETCH_MAX     32             /* # of resources read ahead */
+#define HOT_PREFETCH_LEN     (1 << 20)      /* bytes read ahead per resource */
+
+
+int hot_set_init(void);
+void hot_set_hit(char *path);
+void hot_set_tick(void);
+int hot_set_save(void);
+
+
+#endif /* end of __HOT_SET_H_ */
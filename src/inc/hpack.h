@@ -0,0 +1,64 @@
+/** @file hpack.h
+ *  @brief HPACK, the header compression of http/2 (RFC 7541)
+ *
+ *  The decoder keeps the dynamic table that the client's encoder fills.
+ *  The encoder writes each response field as a literal that isn't
+ *  indexed, naming it by its static table index where it has one, so
+ *  it keeps no table of its own and the client's table stays empty.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __HPACK_H_
+#define __HPACK_H_
+
+
+/* SETTINGS_HEADER_TABLE_SIZE, left at its default */
+#define HPACK_TABLE_SIZE      4096
+/* what an entry costs on top of its name and value */
+#define HPACK_ENTRY_OVERHEAD  32
+#define HPACK_ENTRIES_MAX     (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+/* longer names and values fail the header block */
+#define HPACK_STR_MAX         8192
+
+
+struct hpack_entry{
+        char *name;                      /* value follows in the same block */
+        char *value;
+        int name_len;
+        int value_len;
+};
+
+typedef struct hpack_entry hpack_entry_t;
+
+/* the dynamic table, a ring with the newest entry at first */
+struct hpack_dec{
+        hpack_entry_t entries[HPACK_ENTRIES_MAX];
+        int first;
+        int ctr;
+        int size;                        /* sum of the entry sizes */
+        int max_size;                    /* as last updated by the peer */
+};
+
+typedef struct hpack_dec hpack_dec_t;
+
+/* called for every field of a block, with name and value terminated;
+ * a negative return stops the decoding */
+typedef int (*hpack_field_fn)(void *arg, char *name, int name_len,
+                              char *value, int value_len);
+
+
+void hpack_init(void);
+
+void hpack_dec_init(hpack_dec_t *dec);
+void hpack_dec_clear(hpack_dec_t *dec);
+int hpack_decode(hpack_dec_t *dec, const unsigned char *block, int len,
+                 hpack_field_fn field, void *arg);
+
+int hpack_encode_status(char *out, int room, int status);
+int hpack_encode_field(char *out, int room, const char *name,
+                       const char *value, int value_len);
+
+
+#endif /* end of __HPACK_H_ */
@@ -9,6 +9,8 @@
 #ifndef __HTTP_H_
 #define __HTTP_H_
 
+#include <time.h>
+
 #include "list.h"
 
 
@@ -16,6 +18,20 @@
 #define LINE_END_STR  "\r\n"
 #define FS_ROOT       "/"
 
+/* content codings, as bits of the Accept-Encoding mask */
+#define ENC_GZIP      0x1
+#define ENC_DEFLATE   0x2
+#define ENC_BR        0x4
+#define ENC_ALL       (ENC_GZIP | ENC_DEFLATE | ENC_BR)
+
+/* length of an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define HTTP_DATE_LEN 29
+
+/* max # of byte ranges served in one response, more are ignored */
+#define RANGE_MAX     8
+/* delimits the parts of a multipart/byteranges body */
+#define RANGE_BOUNDARY "LISO_BYTERANGES_7d3f9a1c"
+
 enum req_mthd{
     OPTIONS = 0,
     GET,
@@ -64,6 +80,14 @@ struct req_msg{
 };
 
 
+/* an inclusive byte range of the representation */
+struct byte_range{
+        long long start;
+        long long end;
+};
+
+
+typedef struct byte_range byte_range_t;
 typedef struct req_line req_line_t;
 typedef struct msg_hdr msg_hdr_t;
 typedef struct req_msg req_msg_t;
@@ -77,6 +101,13 @@ void insert_msg_hdr(msg_hdr_t *hdr, req_msg_t *msg);
 
 void clear_req_msg(req_msg_t *msg);
 
+enum req_mthd parse_req_mthd(char *str);
+char *get_field_value(req_msg_t *req_msg, char *field_name);
+int parse_accept_encoding(char *field_value);
+int parse_range(char *field_value, long long len, byte_range_t *ranges);
+time_t parse_http_date(char *field_value);
+int fmt_http_date(time_t t, char *buf);
+
 int init_cgi_url(cgi_url_t *url);
 void clear_cgi_url(cgi_url_t *url);
 
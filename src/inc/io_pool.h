@@ -0,0 +1,76 @@
+/** @file io_pool.h
+ *  @brief a pool of worker threads for file io that may block, and
+ *         for tls handshakes
+ *
+ *  Opening a resource and faulting its pages in from a cold disk would
+ *  stall every connection of the select loop, and so would the public
+ *  key crypto of a burst of full handshakes. Such work is handed to the
+ *  pool as a job instead; the connection is parked until the job comes
+ *  back through an eventfd watched by the loop. Handshakes have workers
+ *  of their own, so file io doesn't queue up behind them.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __IO_POOL_H_
+#define __IO_POOL_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "srv_def.h"
+
+
+#define IO_POOL_WORKERS      4
+#define IO_READAHEAD_LEN     (128 << 10)  /* bytes read ahead per job */
+#define IO_PROBE_PAGES       16           /* pages probed ahead of a send */
+#define IO_CRYPTO_WORKERS_MAX 8           /* one per cpu, up to this */
+
+enum io_op{
+        IO_OPEN,                 /* open and stat path, read its head */
+        IO_READAHEAD,            /* read [off, off + len) of fd */
+        IO_HANDSHAKE,            /* one SSL_accept or early data read */
+};
+
+struct io_job{
+        enum io_op op;
+        /* the connection to resume, NULL once it is gone */
+        void *owner;
+        /* called in the loop when the job is done, unless cancelled */
+        int (*done)(io_job_t *job);
+
+        char path[FILENAME_MAX_LEN];     /* IO_OPEN: in */
+        /* IO_OPEN: out or -1, IO_READAHEAD: in, a dup the pool closes,
+         * IO_HANDSHAKE: the socket, closed with the ssl if the job is
+         * dropped */
+        int fd;
+        struct stat statbuf;             /* IO_OPEN: out */
+        int err;                         /* IO_OPEN: errno on failure */
+
+        long long off;                   /* IO_READAHEAD: in */
+        long long len;                   /* IO_READAHEAD: in */
+
+        SSL *ssl;                        /* IO_HANDSHAKE: in */
+        char *buf;              /* IO_HANDSHAKE: early data, or NULL */
+        size_t buf_len;         /* IO_HANDSHAKE: size in, bytes read out */
+        int ret;                         /* IO_HANDSHAKE: what ssl returned */
+        int ssl_err;                     /* IO_HANDSHAKE: its SSL_get_error */
+
+        struct list_head link;
+};
+
+
+int io_pool_init(void);
+int io_pool_watch_fd(void);
+int io_pool_start(void);
+int io_pool_handle_events(int fd);
+int io_pool_is_enabled(void);
+
+io_job_t *io_job_new(enum io_op op, void *owner, int (*done)(io_job_t *job));
+void io_job_submit(io_job_t *job);
+void io_job_cancel(io_job_t *job);
+
+
+#endif /* end of __IO_POOL_H_ */
@@ -0,0 +1,41 @@
+/** @file map_cache.h
+ *  @brief mappings of static resources shared by all their senders
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __MAP_CACHE_H_
+#define __MAP_CACHE_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "srv_def.h"
+
+
+#define MAP_CACHE_HASH_SIZE  0xff
+#define MAP_CACHE_IDLE_MAX   32        /* max # of unused windows kept */
+
+/* one MAP_WINDOW_LEN aligned window of a resource */
+struct map_entry{
+        dev_t dev;
+        ino_t ino;
+        time_t mtime;
+        off_t size;
+        long long off;                   /* offset of addr in the file */
+        long long len;                   /* # of bytes mapped at addr */
+        char *addr;
+
+        int ref;                         /* # of senders using it */
+        struct list_head hash_link;
+        struct list_head idle_link;      /* on the idle lru if !ref */
+};
+
+
+map_entry_t *map_cache_get(int fd, struct stat *statbuf, long long pos);
+void map_entry_put(map_entry_t *entry);
+
+
+#endif /* end of __MAP_CACHE_H_ */
@@ -0,0 +1,33 @@
+/** @file neg_cache.h
+ *  @brief negative lookup cache for paths missing from the docroot
+ *
+ *  Requests for paths known to be missing are answered without touching
+ *  the file system. Entries are dropped when inotify reports that the
+ *  path has been created.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __NEG_CACHE_H_
+#define __NEG_CACHE_H_
+
+
+#define NEG_CACHE_SIZE       512       /* max # of cached missing paths */
+#define NEG_CACHE_HASH_SIZE  0xff      /* # of hash buckets */
+#define NEG_BLOOM_BITS       (1 << 16) /* size of the bloom filter in bits */
+#define NEG_BLOOM_HASHES     3         /* # of bits set per key */
+#define NEG_WATCH_MAX        64        /* max # of watched directories */
+
+
+int neg_cache_init(char *docroot);
+int neg_cache_watch_fd(void);
+int neg_cache_handle_events(int fd);
+
+int neg_cache_lookup(char *path);
+void neg_cache_insert(char *path);
+void neg_cache_invalidate(char *path);
+void neg_cache_flush(void);
+
+
+#endif /* end of __NEG_CACHE_H_ */
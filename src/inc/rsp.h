@@ -0,0 +1,63 @@
+/** @file rsp.h
+ *  @brief building response headers in place
+ *
+ *  A rsp builder appends to a caller's buffer, typically the buf_out of
+ *  the connection, without allocating or going through printf. Status
+ *  lines come pre-serialized for HTTP/1.0 and HTTP/1.1 and the Date is
+ *  formatted at most once per second. Running out of room is sticky and
+ *  reported once, by rsp_done().
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __RSP_H_
+#define __RSP_H_
+
+#include <time.h>
+
+
+enum rsp_status{
+        RSP_103 = 0,
+        RSP_200,
+        RSP_206,
+        RSP_304,
+        RSP_400,
+        RSP_404,
+        RSP_416,
+        RSP_500,
+        RSP_STATUS_CTR,
+};
+
+struct rsp_builder{
+        char *buf;
+        int size;
+        int ctr;
+        int is_overflow;
+};
+
+typedef struct rsp_builder rsp_t;
+
+
+/* append a string literal */
+#define rsp_lit(rsp, lit)  rsp_bytes((rsp), (lit), sizeof(lit) - 1)
+
+
+void rsp_init(rsp_t *rsp, char *buf, int size);
+int rsp_done(rsp_t *rsp);
+
+void rsp_status(rsp_t *rsp, char *ver, enum rsp_status status);
+void rsp_bytes(rsp_t *rsp, const char *str, int len);
+void rsp_str(rsp_t *rsp, const char *str);
+void rsp_num(rsp_t *rsp, long long val);
+void rsp_field(rsp_t *rsp, const char *name, const char *value);
+void rsp_field_num(rsp_t *rsp, const char *name, long long val);
+void rsp_field_date(rsp_t *rsp, const char *name, time_t t);
+void rsp_date(rsp_t *rsp);
+void rsp_end(rsp_t *rsp);
+
+char *rsp_curr_date(void);
+int rsp_itoa(unsigned long long val, char *buf);
+
+
+#endif /* end of __RSP_H_ */
@@ -0,0 +1,30 @@
+/** @file sni.h
+ *  @brief a certificate per host name, picked by SNI
+ *
+ *  Certificates are looked up by the server name a client asks for,
+ *  in SNI_CERT_DIR as <host>.crt and <host>.key. Each is loaded the
+ *  first time its name is asked for and kept from then on, so startup
+ *  doesn't depend on how many there are. A name without one gets the
+ *  default certificate.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __SNI_H_
+#define __SNI_H_
+
+#include <openssl/ssl.h>
+
+
+#define SNI_CERT_DIR     "pki_jungle/sni/"   /* next to the default cert */
+#define SNI_HASH_SIZE    1024                /* # of buckets */
+#define SNI_HOST_MAX     256                 /* longer names aren't looked up */
+#define SNI_ENTRIES_MAX  16384               /* max # of hosts with a cert kept */
+#define SNI_MISSES_MAX   1024                /* max # of names without one */
+
+
+void sni_init(SSL_CTX *ctx, int (*setup)(SSL_CTX *ctx));
+
+
+#endif /* end of __SNI_H_ */
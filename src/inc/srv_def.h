@@ -24,16 +24,47 @@
 /* define various macro */
 #define TCP_PORT 9999
 #define SSL_PORT 9998
+/* TLS 1.3 0-RTT: bytes of early data taken on resumption, 0 turns it off */
+#define SSL_EARLY_DATA_MAX (16 << 10)
+/* TLS 1.2 ciphers and TLS 1.3 suites, by whether aes is in hardware */
+#define SSL_CIPHERS_AES_FIRST                                          \
+        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"   \
+        "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"   \
+        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define SSL_CIPHERS_CHACHA_FIRST                                       \
+        "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"   \
+        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"   \
+        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define SSL_SUITES_AES_FIRST                                           \
+        "TLS_AES_128_GCM_SHA256:TLS_CHACHA20_POLY1305_SHA256:"         \
+        "TLS_AES_256_GCM_SHA384"
+#define SSL_SUITES_CHACHA_FIRST                                        \
+        "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256:"         \
+        "TLS_AES_256_GCM_SHA384"
 #define BUF_IN_SIZE 4096
 #define BUF_PROC_SIZE 2*BUF_IN_SIZE
-#define BUF_OUT_SIZE 4096
+/* as large as a tls record, so a warm ssl conn sends full records */
+#define BUF_OUT_SIZE 16384
+/* tls record sizing: records of a new or idle conn fit one tcp segment,
+ * once SSL_REC_RAMP_BYTES went out they are as large as buf_out */
+#define SSL_REC_SMALL      1400
+#define SSL_REC_RAMP_BYTES (1 << 20)
+#define SSL_REC_IDLE_SECS  1
+/* pipelined requests answered per wakeup of a conn, their responses
+ * going out in one write; the rest wait their turn behind other conns */
+#define PIPE_BATCH_REQS    16
+/* responses set aside ahead of buf_out while a pipeline is answered */
+#define PIPE_BATCH_SIZE    BUF_OUT_SIZE
 
 #define BUF_HDR_SIZE 2048
+/* at most this much of a resource is mapped at a time */
+#define MAP_WINDOW_LEN (4 << 20)
 #define TIMEOUT_TIME 10    /* in sec */
 #define HASH_SIZE    0xff     /* size of hash size of client list */
 
 #define DEFAULT_FD "../static_site/"
 #define FILENAME_MAX_LEN 256
+#define ETAG_MAX_LEN     64
 
 #define CGI_PREFIX                "/cgi/"
 #define CGI_FD                    "../CGI/"
@@ -56,6 +87,17 @@ struct cli_cb_cgi;
 typedef struct cli_cb_cgi cli_cb_cgi_t;
 struct cli_cb_listen_ssl;
 typedef struct cli_cb_listen_ssl cli_cb_listen_ssl_t;
+struct cli_cb_notify;
+typedef struct cli_cb_notify cli_cb_notify_t;
+struct comp_entry;
+typedef struct comp_entry comp_entry_t;
+struct comp_stream;
+typedef struct comp_stream comp_stream_t;
+typedef struct embed_var embed_var_t;
+typedef struct io_job io_job_t;
+typedef struct map_entry map_entry_t;
+typedef struct cache_rule cache_rule_t;
+typedef struct h2_conn h2_conn_t;
 
 struct cli_cb_mthd{
         //  int (*new_connection)(cli_cb_base_t *cb);
@@ -80,6 +122,8 @@ enum cli_cb_type{
     LISTEN_SSL,
     CONN_SSL,
     CGI,
+    NOTIFY,
+    H2_STREAM,                           /* a stream of an http/2 conn */
 };
 
 
@@ -116,13 +160,35 @@ struct cli_cb_tcp{
         /* buf for output */
         char buf_out[BUF_OUT_SIZE + 1];
         int buf_out_ctr;
+        /* responses of a pipeline answered ahead of buf_out */
+        char *buf_batch;                 /* PIPE_BATCH_SIZE, or NULL */
+        int buf_batch_ctr;
 
         req_msg_t *curr_req_msg;
         
         int rsrc_fd;                     /* fd for the resource file */
         struct stat statbuf;             /* statbuf for file */
         char *faddr;                     /* starting addr for mmap file */
-        int fd_pos;                      /* pos in fd */
+        map_entry_t *map_entry;          /* mapped window of the file */
+        long long map_off;               /* offset of faddr in the body */
+        long long map_len;               /* # of bytes mapped at faddr */
+        long long fd_pos;                /* pos in fd */
+        long long fd_end;                /* end of the body in fd */
+        char *mime_type;                 /* Content-Type of the resource */
+        char *content_enc;               /* Content-Encoding, or NULL */
+        comp_entry_t *comp_entry;        /* cached compressed body, or NULL */
+        comp_stream_t *comp_stream;      /* on-the-fly compressor, or NULL */
+        const embed_var_t *embed_var;    /* embedded body, or NULL */
+        byte_range_t ranges[RANGE_MAX];  /* ranges requested, if range_ctr */
+        int range_ctr;
+        int range_idx;                   /* next multipart part to start */
+        char etag[ETAG_MAX_LEN];         /* opaque tag, before encoding */
+        time_t mtime;                    /* Last-Modified of the resource */
+        char *hints;                     /* Link preload value, or NULL */
+        const cache_rule_t *cache_rule;  /* caching policy, or NULL */
+        io_job_t *io_job;                /* file io in flight, or NULL */
+        long long ra_start;              /* window of the body read ahead */
+        long long ra_end;
 
         cli_cb_base_t *cgi_parent;            /* the parent of cgi */
         int is_handle_cgi_pending;
@@ -136,11 +202,26 @@ struct cli_cb_tcp{
         struct list_head req_msg_list;      /* curr req msg to process */       
         int is_send_pending;
         int is_cgi_pending;
+        int is_early;                       /* reqs may be 0-RTT replays */
+        int is_fresh;                       /* nothing parsed yet */
+        h2_conn_t *h2;                      /* http/2 state, or NULL */
+};
+
+/* where a tls connection is, its socket is non-blocking throughout */
+enum ssl_conn_state{
+        SSL_CONN_EARLY = 0,              /* reading 0-RTT early data */
+        SSL_CONN_HANDSHAKE,              /* SSL_accept not done yet */
+        SSL_CONN_OPEN,                   /* application data flows */
+        SSL_CONN_CLOSED,                 /* ssl is freed */
 };
 
 struct cli_cb_ssl{
         cli_cb_tcp_t tcp_base;        
         SSL *ssl;        
+        enum ssl_conn_state state;
+        long long rec_sent;              /* bytes sent since it was idle */
+        time_t rec_last;                 /* when a record was last sent */
+        int rec_retry;                   /* len of a write to retry, or 0 */
 };
 
 struct cli_cb_cgi{
@@ -155,6 +236,14 @@ struct cli_cb_listen_ssl{
         int cli_fd;        
 };
 
+/* a fd owned by another module (e.g. inotify), handler is called
+ * whenever it becomes readable */
+struct cli_cb_notify{
+        cli_cb_base_t base;
+        int cli_fd;
+        int (*handler)(int fd);
+};
+
 
 int is_buf_empty(char *buf, int ctr);
 void make_buf_empty(char *buf, int *ctr);
@@ -162,6 +251,7 @@ void make_buf_empty(char *buf, int *ctr);
 int parse_generic(cli_cb_base_t *cb);
 void insert_req_msg(req_msg_t *msg, cli_cb_tcp_t *cb);
 int parse_cgi_url(req_msg_t *msg);
+void normalize_path(char *path);
 void *strncpy_alloc(char *str, int len);
 
 
@@ -172,6 +262,7 @@ int init_cli_cb(cli_cb_base_t *cli_cb, cli_cb_base_t *parent_cb,
                 int cli_fd_write,
                 cli_cb_type_t type);
 void free_cli_cb(cli_cb_base_t *cli_cb);
+int register_notify_fd(int fd, int (*handler)(int fd));
 
 
 /* for srv function */
@@ -192,5 +283,6 @@ int daemonize(char* lock_file);
 
 /* cgi related functions */
 int handle_cgi(req_msg_t *req_msg, cli_cb_base_t *cb);
+int cgi_comp_drain(cli_cb_tcp_t *tcp_cb);
 
 #endif /* end of __SRV_DEF_H_ */
@@ -0,0 +1,36 @@
+/** @file ssl_cache.h
+ *  @brief tls session resumption: a shared session cache, session
+ *         tickets with rotating keys, and the resumption rate
+ *
+ *  Sessions and ticket keys live in one anonymous shared mapping made
+ *  at startup, so processes forked after ssl_cache_init resume each
+ *  other's sessions and take each other's tickets. So does the record
+ *  of which psks already carried early data, which is what keeps 0-RTT
+ *  from being replayed.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#ifndef __SSL_CACHE_H_
+#define __SSL_CACHE_H_
+
+#include <stdint.h>
+#include <openssl/ssl.h>
+
+
+#define SSL_CACHE_SLOTS      1024           /* # of sessions cached */
+#define SSL_CACHE_DER_MAX    1024           /* larger sessions aren't cached */
+#define SSL_CACHE_TIMEOUT    300            /* secs a session is resumable */
+#define SSL_TICKET_ROTATE_SECS 3600         /* lifetime of a ticket key */
+#define SSL_STATS_SECS       60             /* min time between stats logs */
+#define SSL_REPLAY_SLOTS     4096           /* # of 0-RTT psks remembered */
+
+
+int ssl_cache_init(SSL_CTX *ctx);
+int ssl_cache_early_data(SSL_CTX *ctx, uint32_t max);
+void ssl_cache_count(SSL *ssl);
+void ssl_cache_tick(void);
+
+
+#endif /* end of __SSL_CACHE_H_ */
@@ -0,0 +1,318 @@
+/** @file io_pool.c
+ *  @brief a pool of worker threads for file io that may block, and
+ *         for tls handshakes
+ *
+ *  Jobs are queued on a todo list under a mutex, taken by whichever
+ *  worker of the queue wakes up first, and moved to a done list once
+ *  run. File io and handshakes have a queue each. Every job done bumps
+ *  an eventfd; the loop watches it and, when it turns readable, runs
+ *  the done callback of each finished job in the loop thread. Workers
+ *  only ever touch the job itself, never a connection.
+ *
+ *  A handshake job carries the SSL of its connection, which the loop
+ *  leaves alone until the job is back. Errors are read off the thread
+ *  that made them, so the worker records SSL_get_error for the loop.
+ *
+ *  A connection may go away while its job is in flight, so cancelling
+ *  a job only forgets its owner; the job still runs and is then thrown
+ *  away, closing whatever it opened, or the ssl and the socket it was
+ *  handed. A readahead job is handed a dup of the resource fd for the
+ *  same reason: the connection may close its own fd meanwhile, and the
+ *  number be reused before the worker gets to it. The pool closes the
+ *  dup once the job is back.
+ *
+ *  If the eventfd or the threads can't be set up the pool stays off and
+ *  the server does its file io in the loop, as before.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "srv_def.h"
+#include "io_pool.h"
+#include "docroot.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+static int io_enabled = 0;
+static int io_event_fd = -1;
+
+struct io_queue{
+        struct list_head todo;           /* guarded by io_lock */
+        pthread_cond_t cond;
+};
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct io_queue file_queue = { .cond = PTHREAD_COND_INITIALIZER };
+static struct io_queue crypto_queue = { .cond = PTHREAD_COND_INITIALIZER };
+static struct list_head io_done;         /* guarded by io_lock */
+
+
+/** @brief open and stat the path, and start reading its head */
+static void run_open(io_job_t *job)
+{
+        long long len;
+
+        if((job->fd = docroot_open(job->path)) < 0){
+                job->err = errno;
+                return;
+        }
+        if(fstat(job->fd, &job->statbuf) < 0){
+                job->err = errno;
+                close(job->fd);
+                job->fd = -1;
+                return;
+        }
+        if(S_ISREG(job->statbuf.st_mode)){
+                len = job->statbuf.st_size;
+                readahead(job->fd, 0, len < IO_READAHEAD_LEN ?
+                          len : IO_READAHEAD_LEN);
+        }
+}
+
+/** @brief take a handshake as far as the socket allows */
+static void run_handshake(io_job_t *job)
+{
+        ERR_clear_error();
+        if(job->buf){
+                job->ret = SSL_read_early_data(job->ssl, job->buf,
+                                               job->buf_len, &job->buf_len);
+                job->ssl_err = job->ret == SSL_READ_EARLY_DATA_ERROR ?
+                               SSL_get_error(job->ssl, 0) : SSL_ERROR_NONE;
+        }else{
+                job->ret = SSL_accept(job->ssl);
+                job->ssl_err = job->ret == 1 ?
+                               SSL_ERROR_NONE : SSL_get_error(job->ssl,
+                                                              job->ret);
+        }
+        if(job->ssl_err == SSL_ERROR_SSL){
+                ERR_print_errors_fp(stderr);
+        }
+}
+
+static void *io_worker(void *arg)
+{
+        struct io_queue *queue = (struct io_queue *)arg;
+        uint64_t one = 1;
+        io_job_t *job;
+        sigset_t set;
+
+        /* signals are for the loop */
+        sigfillset(&set);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+        while(1){
+                pthread_mutex_lock(&io_lock);
+                while(list_empty(&queue->todo)){
+                        pthread_cond_wait(&queue->cond, &io_lock);
+                }
+                job = list_first_entry(&queue->todo, io_job_t, link);
+                list_del(&job->link);
+                pthread_mutex_unlock(&io_lock);
+
+                switch(job->op){
+                case IO_OPEN:
+                        run_open(job);
+                        break;
+                case IO_READAHEAD:
+                        readahead(job->fd, job->off, job->len);
+                        break;
+                case IO_HANDSHAKE:
+                        run_handshake(job);
+                        break;
+                }
+
+                pthread_mutex_lock(&io_lock);
+                list_add_tail(&job->link, &io_done);
+                pthread_mutex_unlock(&io_lock);
+                if(write(io_event_fd, &one, sizeof(one)) < 0){
+                        err_printf("eventfd write failed");
+                }
+        }
+        return NULL;
+}
+
+
+/**
+ * @brief set up the queues and the eventfd, the workers are started
+ *        by io_pool_start once the eventfd is watched
+ * @return 0 on success, negative error code on failure
+ */
+int io_pool_init(void)
+{
+        INIT_LIST_HEAD(&file_queue.todo);
+        INIT_LIST_HEAD(&crypto_queue.todo);
+        INIT_LIST_HEAD(&io_done);
+        if((io_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+                err_printf("eventfd failed");
+                return ERR_IO_POOL;
+        }
+        return 0;
+}
+
+int io_pool_watch_fd(void)
+{
+        return io_event_fd;
+}
+
+int io_pool_is_enabled(void)
+{
+        return io_enabled;
+}
+
+/* start up to nr workers on a queue, return how many did */
+static int start_workers(struct io_queue *queue, int nr)
+{
+        pthread_t tid;
+        int ctr = 0;
+        int i;
+
+        for(i = 0; i < nr; i++){
+                if(pthread_create(&tid, NULL, io_worker, queue)){
+                        err_printf("pthread_create failed");
+                        continue;
+                }
+                pthread_detach(tid);
+                ctr++;
+        }
+        return ctr;
+}
+
+/**
+ * @brief start the workers, IO_POOL_WORKERS for file io and one per
+ *        cpu for handshakes
+ * @return 0 on success, negative error code if a queue has no worker
+ */
+int io_pool_start(void)
+{
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int file_ctr, crypto_ctr;
+
+        if(cpus < 1){
+                cpus = 1;
+        }else if(cpus > IO_CRYPTO_WORKERS_MAX){
+                cpus = IO_CRYPTO_WORKERS_MAX;
+        }
+        file_ctr = start_workers(&file_queue, IO_POOL_WORKERS);
+        crypto_ctr = start_workers(&crypto_queue, cpus);
+        if(!file_ctr || !crypto_ctr){
+                /* what started only ever waits */
+                return ERR_IO_POOL;
+        }
+        io_enabled = 1;
+        dbg_printf("io pool up, %d io workers, %d crypto workers",
+                   file_ctr, crypto_ctr);
+        return 0;
+}
+
+
+/**
+ * @brief hand the finished jobs back to their owners
+ *
+ * Called from the main loop whenever the eventfd is readable.
+ *
+ * @param fd the eventfd
+ * @return 0 on success, the first error a done callback returned
+ */
+int io_pool_handle_events(int fd)
+{
+        LIST_HEAD(done);
+        io_job_t *job, *job_next;
+        uint64_t ctr;
+        int ret = 0;
+        int err;
+
+        if(read(fd, &ctr, sizeof(ctr)) < 0 && errno != EAGAIN){
+                err_printf("eventfd read failed");
+                return ERR_IO_POOL;
+        }
+        pthread_mutex_lock(&io_lock);
+        list_splice_init(&io_done, &done);
+        pthread_mutex_unlock(&io_lock);
+
+        list_for_each_entry_safe(job, job_next, &done, link){
+                list_del(&job->link);
+                if(!job->owner){
+                        /* the connection is gone */
+                        if(job->op == IO_OPEN && job->fd >= 0){
+                                close(job->fd);
+                        }else if(job->op == IO_HANDSHAKE){
+                                SSL_free(job->ssl);
+                                close(job->fd);
+                        }
+                }else if((err = job->done(job)) < 0 && !ret){
+                        ret = err;
+                }
+                if(job->op == IO_READAHEAD){
+                        /* its own dup, done with or dropped */
+                        close(job->fd);
+                }
+                free(job->buf);
+                free(job);
+        }
+        return ret;
+}
+
+
+/**
+ * @brief allocate a job
+ * @param op what the job does
+ * @param owner the connection to resume
+ * @param done called in the loop with the finished job, which is freed
+ *        once it returns
+ * @return the job, or NULL if out of memory
+ */
+io_job_t *io_job_new(enum io_op op, void *owner, int (*done)(io_job_t *job))
+{
+        io_job_t *job;
+
+        if(!(job = (io_job_t *)malloc(sizeof(io_job_t)))){
+                return NULL;
+        }
+        job->op = op;
+        job->owner = owner;
+        job->done = done;
+        job->path[0] = 0;
+        job->fd = -1;
+        job->err = 0;
+        job->off = 0;
+        job->len = 0;
+        job->ssl = NULL;
+        job->buf = NULL;
+        job->buf_len = 0;
+        job->ret = 0;
+        job->ssl_err = SSL_ERROR_NONE;
+        return job;
+}
+
+void io_job_submit(io_job_t *job)
+{
+        struct io_queue *queue = job->op == IO_HANDSHAKE ?
+                                 &crypto_queue : &file_queue;
+
+        pthread_mutex_lock(&io_lock);
+        list_add_tail(&job->link, &queue->todo);
+        pthread_cond_signal(&queue->cond);
+        pthread_mutex_unlock(&io_lock);
+}
+
+/** @brief forget the owner of a job in flight, it is dropped once done */
+void io_job_cancel(io_job_t *job)
+{
+        job->owner = NULL;
+}
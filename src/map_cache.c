@@ -0,0 +1,157 @@
+/** @file map_cache.c
+ *  @brief mappings of static resources shared by all their senders
+ *
+ *  A resource is mapped in windows of MAP_WINDOW_LEN bytes, aligned to
+ *  MAP_WINDOW_LEN, so every connection sending the same part of the
+ *  same file asks for the same window. Windows are keyed by device,
+ *  inode, mtime, size and offset, and refcounted: however many clients
+ *  download a popular file, each window of it is mapped once.
+ *
+ *  A window nobody uses any more is not unmapped right away but put on
+ *  an idle lru, since the next download of the file is likely to come
+ *  soon; only MAP_CACHE_IDLE_MAX of them are kept. Idle windows of a
+ *  file modified in place are dropped when it is next looked up; those
+ *  of a replaced file simply age out.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "list.h"
+#include "srv_def.h"
+#include "map_cache.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+static struct list_head map_hash[MAP_CACHE_HASH_SIZE];
+static struct list_head map_idle;        /* most recently used first */
+static int map_idle_ctr = 0;
+static int map_cache_inited = 0;
+
+
+static unsigned int hash_window(struct stat *statbuf, long long off)
+{
+        uint64_t h = (uint64_t)statbuf->st_ino * 0x9e3779b97f4a7c15ULL;
+        h ^= (uint64_t)statbuf->st_dev + (uint64_t)(off / MAP_WINDOW_LEN);
+        h *= 0x100000001b3ULL;
+        return (h >> 32) % MAP_CACHE_HASH_SIZE;
+}
+
+static void init_cache(void)
+{
+        int i;
+        for(i = 0; i < MAP_CACHE_HASH_SIZE; i++){
+                INIT_LIST_HEAD(&map_hash[i]);
+        }
+        INIT_LIST_HEAD(&map_idle);
+        map_cache_inited = 1;
+}
+
+static void evict_entry(map_entry_t *entry)
+{
+        dbg_printf("map cache evict ino(%llu) off(%lld)",
+                   (unsigned long long)entry->ino, entry->off);
+        list_del(&entry->hash_link);
+        list_del(&entry->idle_link);
+        map_idle_ctr--;
+        munmap(entry->addr, entry->len);
+        free(entry);
+}
+
+static map_entry_t *new_entry(int fd, struct stat *statbuf, long long off)
+{
+        map_entry_t *entry;
+        long long len;
+        char *addr;
+
+        len = statbuf->st_size - off < MAP_WINDOW_LEN ?
+                statbuf->st_size - off : MAP_WINDOW_LEN;
+        if((addr = mmap(0, len, PROT_READ, MAP_SHARED, fd, off))
+           == MAP_FAILED){
+                dbg_printf("mmap failed");
+                return NULL;
+        }
+        if(!(entry = (map_entry_t *)malloc(sizeof(map_entry_t)))){
+                munmap(addr, len);
+                return NULL;
+        }
+        /* start reading it in; not MADV_SEQUENTIAL, as senders at
+         * different positions share the pages */
+        madvise(addr, len, MADV_WILLNEED);
+        entry->dev = statbuf->st_dev;
+        entry->ino = statbuf->st_ino;
+        entry->mtime = statbuf->st_mtime;
+        entry->size = statbuf->st_size;
+        entry->off = off;
+        entry->len = len;
+        entry->addr = addr;
+        entry->ref = 0;
+        INIT_LIST_HEAD(&entry->idle_link);
+        return entry;
+}
+
+
+/**
+ * @brief get the window of a resource holding pos, mapping it if no
+ *        one has yet
+ * @param fd the opened resource, used only to map a new window
+ * @param statbuf the stat of the opened resource
+ * @param pos the offset in the resource, below its size
+ * @return the window with a reference taken, or NULL on failure
+ */
+map_entry_t *map_cache_get(int fd, struct stat *statbuf, long long pos)
+{
+        long long off = pos - pos % MAP_WINDOW_LEN;
+        struct list_head *bucket;
+        map_entry_t *entry, *entry_next;
+
+        if(!map_cache_inited){
+                init_cache();
+        }
+        bucket = &map_hash[hash_window(statbuf, off)];
+        list_for_each_entry_safe(entry, entry_next, bucket, hash_link){
+                if(entry->ino != statbuf->st_ino ||
+                   entry->dev != statbuf->st_dev || entry->off != off){
+                        continue;
+                }
+                if(entry->mtime != statbuf->st_mtime ||
+                   entry->size != statbuf->st_size){
+                        /* the file changed under the window */
+                        if(!entry->ref){
+                                evict_entry(entry);
+                        }
+                        continue;
+                }
+                if(!entry->ref++){
+                        list_del(&entry->idle_link);
+                        map_idle_ctr--;
+                }
+                return entry;
+        }
+        if(!(entry = new_entry(fd, statbuf, off))){
+                return NULL;
+        }
+        list_add(&entry->hash_link, bucket);
+        entry->ref = 1;
+        return entry;
+}
+
+void map_entry_put(map_entry_t *entry)
+{
+        if(--entry->ref){
+                return;
+        }
+        list_add(&entry->idle_link, &map_idle);
+        if(++map_idle_ctr > MAP_CACHE_IDLE_MAX){
+                evict_entry(list_entry(map_idle.prev, map_entry_t,
+                                       idle_link));
+        }
+}
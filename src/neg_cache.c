@@ -0,0 +1,370 @@
+/** @file neg_cache.c
+ *  @brief negative lookup cache for paths missing from the docroot
+ *
+ *  Missing paths live in a fixed pool of entries, hashed into buckets and
+ *  kept on an lru list so the cache never grows beyond NEG_CACHE_SIZE.
+ *  A bloom filter sits in front of the buckets so that lookups of files
+ *  that do exist (the common case) are rejected without walking a bucket.
+ *  The bloom filter is only a pre-filter: a hit is always confirmed
+ *  against the buckets, since a false positive would turn an existing
+ *  file into a 404. Keys cannot be removed from the filter, so it is
+ *  rebuilt from the buckets once enough keys went stale.
+ *
+ *  The docroot and its sub directories are watched with inotify; creating
+ *  (or moving in) a file drops its entry, creating a directory flushes
+ *  the whole cache. If the watch can't be set up the cache stays off.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "list.h"
+#include "srv_def.h"
+#include "neg_cache.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+#define NEG_WATCH_MASK (IN_CREATE | IN_MOVED_TO)
+
+struct neg_entry{
+        char path[FILENAME_MAX_LEN];
+        uint64_t hash;
+        struct list_head hash_link;
+        struct list_head lru_link;
+};
+
+struct neg_watch{
+        int wd;
+        char dir[FILENAME_MAX_LEN];      /* with trailing '/' */
+};
+
+typedef struct neg_entry neg_entry_t;
+typedef struct neg_watch neg_watch_t;
+
+
+static int neg_enabled = 0;
+
+static neg_entry_t neg_pool[NEG_CACHE_SIZE];
+static struct list_head neg_hash[NEG_CACHE_HASH_SIZE];
+static struct list_head neg_lru;         /* most recently used first */
+static struct list_head neg_free;
+
+static unsigned char neg_bloom[NEG_BLOOM_BITS / 8];
+static int neg_bloom_stale = 0;          /* # of keys removed since rebuild */
+
+static int neg_watch_fd = -1;
+static neg_watch_t neg_watch[NEG_WATCH_MAX];
+static int neg_watch_ctr = 0;
+
+
+/** @brief 64 bit FNV-1a hash of the path */
+static uint64_t hash_path(char *path)
+{
+        uint64_t h = 0xcbf29ce484222325ULL;
+        while(*path){
+                h ^= (unsigned char)*(path++);
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+/* derive the k bloom indices from one hash (double hashing) */
+static unsigned int bloom_idx(uint64_t hash, int k)
+{
+        uint32_t h1 = (uint32_t)hash;
+        uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+        return (h1 + k * h2) % NEG_BLOOM_BITS;
+}
+
+static void bloom_set(uint64_t hash)
+{
+        int k;
+        unsigned int i;
+        for(k = 0; k < NEG_BLOOM_HASHES; k++){
+                i = bloom_idx(hash, k);
+                neg_bloom[i >> 3] |= 1 << (i & 7);
+        }
+}
+
+static int bloom_test(uint64_t hash)
+{
+        int k;
+        unsigned int i;
+        for(k = 0; k < NEG_BLOOM_HASHES; k++){
+                i = bloom_idx(hash, k);
+                if(!(neg_bloom[i >> 3] & (1 << (i & 7)))){
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static void bloom_rebuild(void)
+{
+        neg_entry_t *entry;
+        memset(neg_bloom, 0, sizeof(neg_bloom));
+        list_for_each_entry(entry, &neg_lru, lru_link){
+                bloom_set(entry->hash);
+        }
+        neg_bloom_stale = 0;
+}
+
+static neg_entry_t *find_entry(char *path, uint64_t hash)
+{
+        neg_entry_t *entry;
+        list_for_each_entry(entry, &neg_hash[hash % NEG_CACHE_HASH_SIZE],
+                            hash_link){
+                if(entry->hash == hash && !strcmp(entry->path, path)){
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+static void remove_entry(neg_entry_t *entry)
+{
+        list_del(&entry->hash_link);
+        list_del(&entry->lru_link);
+        list_add(&entry->lru_link, &neg_free);
+        if(++neg_bloom_stale >= NEG_CACHE_SIZE){
+                bloom_rebuild();
+        }
+}
+
+
+/**
+ * @brief check whether path is known to be missing
+ * @param path the normalized path under the docroot
+ * @return 1 if path is cached as missing, 0 otherwise
+ */
+int neg_cache_lookup(char *path)
+{
+        uint64_t hash;
+        neg_entry_t *entry;
+
+        if(!neg_enabled){
+                return 0;
+        }
+        hash = hash_path(path);
+        if(!bloom_test(hash)){
+                return 0;
+        }
+        if(!(entry = find_entry(path, hash))){
+                return 0;
+        }
+        /* keep it hot */
+        list_del(&entry->lru_link);
+        list_add(&entry->lru_link, &neg_lru);
+        return 1;
+}
+
+/**
+ * @brief record path as missing, evicting the lru entry if full
+ * @param path the normalized path under the docroot
+ * @return Void
+ */
+void neg_cache_insert(char *path)
+{
+        uint64_t hash;
+        neg_entry_t *entry;
+
+        if(!neg_enabled || strlen(path) >= FILENAME_MAX_LEN){
+                return;
+        }
+        hash = hash_path(path);
+        if(find_entry(path, hash)){
+                return;
+        }
+        if(list_empty(&neg_free)){
+                entry = list_entry(neg_lru.prev, neg_entry_t, lru_link);
+                remove_entry(entry);
+        }
+        entry = list_first_entry(&neg_free, neg_entry_t, lru_link);
+        list_del(&entry->lru_link);
+
+        strcpy(entry->path, path);
+        entry->hash = hash;
+        list_add(&entry->hash_link, &neg_hash[hash % NEG_CACHE_HASH_SIZE]);
+        list_add(&entry->lru_link, &neg_lru);
+        bloom_set(hash);
+        dbg_printf("neg cache insert (%s)", path);
+}
+
+void neg_cache_invalidate(char *path)
+{
+        neg_entry_t *entry;
+        if((entry = find_entry(path, hash_path(path)))){
+                dbg_printf("neg cache invalidate (%s)", path);
+                remove_entry(entry);
+        }
+}
+
+void neg_cache_flush(void)
+{
+        neg_entry_t *entry, *entry_next;
+        list_for_each_entry_safe(entry, entry_next, &neg_lru, lru_link){
+                list_del(&entry->hash_link);
+                list_del(&entry->lru_link);
+                list_add(&entry->lru_link, &neg_free);
+        }
+        memset(neg_bloom, 0, sizeof(neg_bloom));
+        neg_bloom_stale = 0;
+}
+
+
+static char *find_watch_dir(int wd)
+{
+        int i;
+        for(i = 0; i < neg_watch_ctr; i++){
+                if(neg_watch[i].wd == wd){
+                        return neg_watch[i].dir;
+                }
+        }
+        return NULL;
+}
+
+/* watch dir and every dir below it, dir must end with '/' */
+static int watch_dir(char *dir)
+{
+        DIR *dp;
+        struct dirent *de;
+        struct stat statbuf;
+        char sub[FILENAME_MAX_LEN];
+        int wd;
+        int ret = 0;
+
+        if((wd = inotify_add_watch(neg_watch_fd, dir, NEG_WATCH_MASK)) < 0){
+                err_printf("inotify_add_watch(%s) failed", dir);
+                return ERR_INOTIFY;
+        }
+        if(!find_watch_dir(wd)){
+                if(neg_watch_ctr == NEG_WATCH_MAX){
+                        err_printf("too many dirs to watch");
+                        return ERR_INOTIFY;
+                }
+                neg_watch[neg_watch_ctr].wd = wd;
+                snprintf(neg_watch[neg_watch_ctr].dir, FILENAME_MAX_LEN,
+                         "%s", dir);
+                neg_watch_ctr++;
+        }
+
+        if(!(dp = opendir(dir))){
+                return ERR_INOTIFY;
+        }
+        while((de = readdir(dp))){
+                if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")){
+                        continue;
+                }
+                if(snprintf(sub, FILENAME_MAX_LEN, "%s%s/", dir, de->d_name)
+                   >= FILENAME_MAX_LEN){
+                        continue;
+                }
+                if(stat(sub, &statbuf) < 0 || !S_ISDIR(statbuf.st_mode)){
+                        continue;
+                }
+                if((ret = watch_dir(sub)) < 0){
+                        break;
+                }
+        }
+        closedir(dp);
+        return ret;
+}
+
+
+/**
+ * @brief set up the cache and the inotify watch on docroot
+ * @param docroot the docroot, with trailing '/'
+ * @return 0 on success, negative error code if the cache stays disabled
+ */
+int neg_cache_init(char *docroot)
+{
+        int i;
+        int ret;
+
+        INIT_LIST_HEAD(&neg_lru);
+        INIT_LIST_HEAD(&neg_free);
+        for(i = 0; i < NEG_CACHE_HASH_SIZE; i++){
+                INIT_LIST_HEAD(&neg_hash[i]);
+        }
+        for(i = 0; i < NEG_CACHE_SIZE; i++){
+                list_add_tail(&neg_pool[i].lru_link, &neg_free);
+        }
+        memset(neg_bloom, 0, sizeof(neg_bloom));
+
+        if((neg_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0){
+                err_printf("inotify_init1 failed");
+                return ERR_INOTIFY;
+        }
+        if((ret = watch_dir(docroot)) < 0){
+                close(neg_watch_fd);
+                neg_watch_fd = -1;
+                return ret;
+        }
+        neg_enabled = 1;
+        return 0;
+}
+
+int neg_cache_watch_fd(void)
+{
+        return neg_watch_fd;
+}
+
+/**
+ * @brief drain pending inotify events and drop the affected entries
+ * @param fd the inotify fd
+ * @return 0 on success, negative error code on failure
+ */
+int neg_cache_handle_events(int fd)
+{
+        char buf[4096]
+                __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        char path[FILENAME_MAX_LEN];
+        struct inotify_event *ev;
+        char *pos;
+        char *dir;
+        ssize_t len;
+
+        while((len = read(fd, buf, sizeof(buf))) > 0){
+                for(pos = buf; pos < buf + len;
+                    pos += sizeof(struct inotify_event) + ev->len){
+                        ev = (struct inotify_event *)pos;
+
+                        if(ev->mask & IN_Q_OVERFLOW){
+                                neg_cache_flush();
+                                continue;
+                        }
+                        if(!ev->len || !(dir = find_watch_dir(ev->wd))){
+                                continue;
+                        }
+                        if(ev->mask & IN_ISDIR){
+                                /* anything below it may exist now */
+                                snprintf(path, FILENAME_MAX_LEN, "%s%s/",
+                                         dir, ev->name);
+                                if(watch_dir(path) < 0){
+                                        err_printf("neg cache disabled");
+                                        neg_enabled = 0;
+                                }
+                                neg_cache_flush();
+                        }else{
+                                snprintf(path, FILENAME_MAX_LEN, "%s%s",
+                                         dir, ev->name);
+                                neg_cache_invalidate(path);
+                        }
+                }
+        }
+        if(len < 0 && errno != EAGAIN){
+                return ERR_INOTIFY;
+        }
+        return 0;
+}
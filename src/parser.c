@@ -5,8 +5,11 @@
  *  @bug no known bugs
  */
 
+#define _GNU_SOURCE              /* strptime, timegm */
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #include "list.h"
@@ -40,6 +43,29 @@ static void shift_req_msg(cli_cb_tcp_t *cb)
         return;
 }
 
+/** @brief map a request method name to enum req_mthd, EXT if unknown */
+enum req_mthd parse_req_mthd(char *str)
+{
+    if(!strcmp(str, "GET")){
+        return GET;
+    }else if(!strcmp(str, "OPTIONS")){
+        return OPTIONS;
+    }else if(!strcmp(str, "HEAD")){
+        return HEAD;
+    }else if(!strcmp(str, "POST")){
+        return POST;
+    }else if(!strcmp(str, "PUT")){
+        return PUT;
+    }else if(!strcmp(str, "DELETE")){
+        return DELETE;
+    }else if(!strcmp(str, "TRACE")){
+        return TRACE;
+    }else if(!strcmp(str, "CONNECT")){
+        return CONNECT;
+    }
+    return EXT;
+}
+
 static int parse_req_line(cli_cb_tcp_t *cb, req_msg_t *req_msg)
 {
     int ret;
@@ -58,25 +84,7 @@ static int parse_req_line(cli_cb_tcp_t *cb, req_msg_t *req_msg)
             goto out1;
         }
         dbg_printf("mthd(%s)",tmp_str);
-        if(!strcmp(tmp_str, "GET")){
-            req_msg->req_line.req = GET;            
-        }else if(!strcmp(tmp_str, "OPTIONS")){
-            req_msg->req_line.req = OPTIONS;
-        }else if(!strcmp(tmp_str, "HEAD")){
-            req_msg->req_line.req = HEAD;
-        }else if(!strcmp(tmp_str, "POST")){
-            req_msg->req_line.req = POST;
-        }else if(!strcmp(tmp_str, "PUT")){
-            req_msg->req_line.req = PUT;
-        }else if(!strcmp(tmp_str, "DELETE")){
-            req_msg->req_line.req = DELETE;
-        }else if(!strcmp(tmp_str, "TRACE")){
-            req_msg->req_line.req = TRACE;
-        }else if(!strcmp(tmp_str, "CONNECT")){
-            req_msg->req_line.req = CONNECT;
-        }else{
-            req_msg->req_line.req = EXT;
-        }
+        req_msg->req_line.req = parse_req_mthd(tmp_str);
     }
     cb->par_pos = cb->par_next + 1;
 
@@ -387,6 +395,250 @@ int parse_cgi_url(req_msg_t *msg)
 }
 
 
+/** @brief normalize an url path in place
+ *
+ *  Collapse repeated '/', drop "." segments and resolve ".." segments
+ *  lexically, never climbing above the root. The result is used both as
+ *  the path to open and as the key of the negative lookup cache.
+ *
+ *  @param path the url path, null terminated
+ *  @return Void
+ */
+void normalize_path(char *path)
+{
+        char *src = path;
+        char *dst = path;
+
+        while(*src){
+                if(*src == '/'){
+                        while(src[1] == '/'){
+                                src++;
+                        }
+                        if(src[1] == '.' && (src[2] == '/' || !src[2])){
+                                src += 2;
+                                continue;
+                        }
+                        if(src[1] == '.' && src[2] == '.' &&
+                           (src[3] == '/' || !src[3])){
+                                src += 3;
+                                /* pop the last segment */
+                                while(dst > path && *(--dst) != '/'){}
+                                continue;
+                        }
+                }
+                *(dst++) = *(src++);
+        }
+        if(dst == path){
+                *(dst++) = '/';
+        }
+        *dst = 0;
+}
+
+
+/** @brief look up the value of a header field, names are case-insensitive
+ *  @return the field value, or NULL if the field is absent
+ */
+char *get_field_value(req_msg_t *req_msg, char *field_name)
+{
+        msg_hdr_t *msg_hdr;
+        list_for_each_entry(msg_hdr, &req_msg->msg_hdr_list,
+                            msg_hdr_link){
+
+                if(!strcasecmp(msg_hdr->field_name, field_name)){
+                        return msg_hdr->field_value;
+                }
+        }
+        return NULL;
+}
+
+
+/** @brief parse an Accept-Encoding field value
+ *
+ *  Codings with q=0 are refused, "*" stands for every coding not
+ *  listed explicitly.
+ *
+ *  @param field_value e.g. "gzip, deflate;q=0.5, br"
+ *  @return the mask of ENC_* the client accepts
+ */
+int parse_accept_encoding(char *field_value)
+{
+        int accepted = 0;
+        int refused = 0;
+        int any = 0;
+        int enc;
+        int len;
+        char *pos = field_value;
+        char *param;
+        double q;
+
+        while(*pos){
+                pos += strspn(pos, " \t,");
+                len = strcspn(pos, " \t,;");
+                if(!len){
+                        break;
+                }
+                if(len == 4 && !strncasecmp(pos, "gzip", 4)){
+                        enc = ENC_GZIP;
+                }else if(len == 6 && !strncasecmp(pos, "x-gzip", 6)){
+                        enc = ENC_GZIP;
+                }else if(len == 7 && !strncasecmp(pos, "deflate", 7)){
+                        enc = ENC_DEFLATE;
+                }else if(len == 2 && !strncasecmp(pos, "br", 2)){
+                        enc = ENC_BR;
+                }else if(len == 1 && *pos == '*'){
+                        enc = -1;
+                }else{
+                        enc = 0;
+                }
+                pos += len;
+
+                /* only the q parameter matters */
+                q = 1;
+                len = strcspn(pos, ",");
+                if((param = strchr(pos, ';')) && param < pos + len){
+                        param += strspn(param, "; \t");
+                        if((*param == 'q' || *param == 'Q') &&
+                           param[1] == '='){
+                                q = strtod(param + 2, NULL);
+                        }
+                }
+                pos += len;
+
+                if(enc == -1){
+                        any = q > 0;
+                }else if(q > 0){
+                        accepted |= enc;
+                }else{
+                        refused |= enc;
+                }
+        }
+        if(any){
+                accepted |= ENC_ALL & ~refused;
+        }
+        return accepted & ~refused;
+}
+
+
+/* parse a run of digits, -1 if there is none or it overflows */
+static long long parse_pos(char **pos)
+{
+        long long val = 0;
+        char *start = *pos;
+
+        while(**pos >= '0' && **pos <= '9'){
+                if(val > (0x7fffffffffffffffLL - 9) / 10){
+                        return -1;
+                }
+                val = val * 10 + *((*pos)++) - '0';
+        }
+        return *pos == start ? -1 : val;
+}
+
+/** @brief parse a Range field value against a representation of len bytes
+ *
+ *  Ranges are clamped to the representation, unsatisfiable ones are
+ *  dropped. A malformed value, a unit other than bytes, or more than
+ *  RANGE_MAX ranges make the field ignored.
+ *
+ *  @param field_value e.g. "bytes=0-499, -500"
+ *  @param len length of the representation
+ *  @param ranges RANGE_MAX entries to fill in
+ *  @return # of ranges, 0 if the field is to be ignored,
+ *          ERR_RANGE_NOT_SATISFIABLE if no range is satisfiable
+ */
+int parse_range(char *field_value, long long len, byte_range_t *ranges)
+{
+        char *pos = field_value;
+        long long start, end;
+        int ctr = 0;
+        int total = 0;
+
+        pos += strspn(pos, " \t");
+        if(strncasecmp(pos, "bytes=", 6)){
+                return 0;
+        }
+        pos += 6;
+        while(*pos){
+                pos += strspn(pos, " \t,");
+                if(!*pos){
+                        break;
+                }
+                if(*pos == '-'){
+                        /* suffix range, the last n bytes */
+                        pos++;
+                        if((end = parse_pos(&pos)) < 0){
+                                return 0;
+                        }
+                        if(!end){
+                                start = len;
+                        }else{
+                                start = end < len ? len - end : 0;
+                        }
+                        end = len - 1;
+                }else{
+                        if((start = parse_pos(&pos)) < 0 || *(pos++) != '-'){
+                                return 0;
+                        }
+                        if(*pos >= '0' && *pos <= '9'){
+                                if((end = parse_pos(&pos)) < start){
+                                        return 0;
+                                }
+                        }else{
+                                end = len - 1;
+                        }
+                        if(end >= len){
+                                end = len - 1;
+                        }
+                }
+                pos += strspn(pos, " \t");
+                if(*pos && *pos != ','){
+                        return 0;
+                }
+                if(++total > RANGE_MAX){
+                        return 0;
+                }
+                if(start < len){
+                        ranges[ctr].start = start;
+                        ranges[ctr].end = end;
+                        ctr++;
+                }
+        }
+        if(!total){
+                return 0;
+        }
+        return ctr ? ctr : ERR_RANGE_NOT_SATISFIABLE;
+}
+
+/** @brief parse an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+ *  @return the time, or -1 if it is not a date we understand
+ */
+time_t parse_http_date(char *field_value)
+{
+        struct tm tm;
+        char *end;
+
+        memset(&tm, 0, sizeof(tm));
+        field_value += strspn(field_value, " \t");
+        if(!(end = strptime(field_value, "%a, %d %b %Y %H:%M:%S GMT", &tm))){
+                return -1;
+        }
+        return timegm(&tm);
+}
+
+/** @brief print t as an IMF-fixdate
+ *  @param buf at least HTTP_DATE_LEN + 1 bytes
+ *  @return # of bytes printed
+ */
+int fmt_http_date(time_t t, char *buf)
+{
+        struct tm tm;
+
+        gmtime_r(&t, &tm);
+        return strftime(buf, HTTP_DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT",
+                        &tm);
+}
+
+
 void init_req_msg(req_msg_t *msg)
 {
 
@@ -0,0 +1,217 @@
+/** @file rsp.c
+ *  @brief building response headers in place
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "http.h"
+#include "rsp.h"
+#include "err_code.h"
+
+
+#define STATUS(code, reason) \
+        {"HTTP/1.1 " #code " " reason "\r\n", \
+         sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1, \
+         "HTTP/1.0 " #code " " reason "\r\n", #code " " reason "\r\n"}
+
+/* status lines by enum rsp_status */
+static const struct{
+        const char *line_http11;
+        int len;                         /* same for both versions */
+        const char *line_http10;
+        const char *code_reason;         /* for any other version */
+} rsp_status_lines[RSP_STATUS_CTR] = {
+        STATUS(103, "Early Hints"),
+        STATUS(200, "OK"),
+        STATUS(206, "Partial Content"),
+        STATUS(304, "Not Modified"),
+        STATUS(400, "Bad Request"),
+        STATUS(404, "Not Found"),
+        STATUS(416, "Range Not Satisfiable"),
+        STATUS(500, "Internal Server Error"),
+};
+
+static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+static const unsigned long long pow10_tbl[] = {
+        10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL,
+};
+
+static time_t date_time = -1;
+static char date_str[HTTP_DATE_LEN + 1];
+
+
+/**
+ * @brief print val in decimal, not NUL terminated
+ *
+ * The # of digits is counted with compares rather than divisions, then
+ * the digits are written two at a time from the end.
+ *
+ * @param buf at least 20 bytes
+ * @return # of digits
+ */
+int rsp_itoa(unsigned long long val, char *buf)
+{
+        int len = 1;
+        int pos;
+        unsigned int i;
+
+        for(i = 0; i < sizeof(pow10_tbl) / sizeof(pow10_tbl[0]); i++){
+                len += val >= pow10_tbl[i];
+        }
+        pos = len;
+        while(val >= 100){
+                i = (val % 100) * 2;
+                val /= 100;
+                buf[--pos] = digit_pairs[i + 1];
+                buf[--pos] = digit_pairs[i];
+        }
+        if(val >= 10){
+                buf[1] = digit_pairs[val * 2 + 1];
+                buf[0] = digit_pairs[val * 2];
+        }else{
+                buf[0] = '0' + val;
+        }
+        return len;
+}
+
+/** @brief the current time as an IMF-fixdate, formatted once a second */
+char *rsp_curr_date(void)
+{
+        time_t t = time(NULL);
+
+        if(t != date_time){
+                fmt_http_date(t, date_str);
+                date_time = t;
+        }
+        return date_str;
+}
+
+
+void rsp_init(rsp_t *rsp, char *buf, int size)
+{
+        rsp->buf = buf;
+        rsp->size = size;
+        rsp->ctr = 0;
+        rsp->is_overflow = 0;
+}
+
+/**
+ * @brief finish building, buf is NUL terminated if there is room
+ * @return the length of the response header, ERR_HDR_TOO_LONG if it
+ *         did not fit
+ */
+int rsp_done(rsp_t *rsp)
+{
+        if(rsp->is_overflow){
+                return ERR_HDR_TOO_LONG;
+        }
+        if(rsp->ctr < rsp->size){
+                rsp->buf[rsp->ctr] = 0;
+        }
+        return rsp->ctr;
+}
+
+void rsp_bytes(rsp_t *rsp, const char *str, int len)
+{
+        if(rsp->is_overflow || len > rsp->size - rsp->ctr){
+                rsp->is_overflow = 1;
+                return;
+        }
+        memcpy(rsp->buf + rsp->ctr, str, len);
+        rsp->ctr += len;
+}
+
+void rsp_str(rsp_t *rsp, const char *str)
+{
+        rsp_bytes(rsp, str, strlen(str));
+}
+
+void rsp_num(rsp_t *rsp, long long val)
+{
+        char buf[24];
+        int len = 0;
+
+        if(val < 0){
+                buf[len++] = '-';
+                val = -val;
+        }
+        len += rsp_itoa(val, buf + len);
+        rsp_bytes(rsp, buf, len);
+}
+
+void rsp_status(rsp_t *rsp, char *ver, enum rsp_status status)
+{
+        if(!strcmp(ver, "HTTP/1.1")){
+                rsp_bytes(rsp, rsp_status_lines[status].line_http11,
+                          rsp_status_lines[status].len);
+        }else if(!strcmp(ver, "HTTP/1.0")){
+                rsp_bytes(rsp, rsp_status_lines[status].line_http10,
+                          rsp_status_lines[status].len);
+        }else{
+                rsp_str(rsp, ver);
+                rsp_lit(rsp, " ");
+                rsp_str(rsp, rsp_status_lines[status].code_reason);
+        }
+}
+
+/** @brief append "name: value\r\n", name without the colon */
+void rsp_field(rsp_t *rsp, const char *name, const char *value)
+{
+        rsp_str(rsp, name);
+        rsp_lit(rsp, ": ");
+        rsp_str(rsp, value);
+        rsp_lit(rsp, LINE_END_STR);
+}
+
+void rsp_field_num(rsp_t *rsp, const char *name, long long val)
+{
+        rsp_str(rsp, name);
+        rsp_lit(rsp, ": ");
+        rsp_num(rsp, val);
+        rsp_lit(rsp, LINE_END_STR);
+}
+
+void rsp_field_date(rsp_t *rsp, const char *name, time_t t)
+{
+        char date[HTTP_DATE_LEN + 1];
+
+        fmt_http_date(t, date);
+        rsp_str(rsp, name);
+        rsp_lit(rsp, ": ");
+        rsp_bytes(rsp, date, HTTP_DATE_LEN);
+        rsp_lit(rsp, LINE_END_STR);
+}
+
+/* the Date field, as of now */
+void rsp_date(rsp_t *rsp)
+{
+        rsp_lit(rsp, "Date: ");
+        rsp_bytes(rsp, rsp_curr_date(), HTTP_DATE_LEN);
+        rsp_lit(rsp, LINE_END_STR);
+}
+
+/* the empty line ending the header */
+void rsp_end(rsp_t *rsp)
+{
+        rsp_lit(rsp, LINE_END_STR);
+}
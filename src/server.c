@@ -22,9 +22,11 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
@@ -36,6 +38,20 @@
 #include  "err_code.h"
 #include "debug_define.h"
 #include "http.h"
+#include "neg_cache.h"
+#include "compress.h"
+#include "hdr_cache.h"
+#include "rsp.h"
+#include "embed.h"
+#include "io_pool.h"
+#include "map_cache.h"
+#include "docroot.h"
+#include "hot_set.h"
+#include "hints.h"
+#include "cache_policy.h"
+#include "ssl_cache.h"
+#include "sni.h"
+#include "h2.h"
 
 
 
@@ -90,6 +106,9 @@ static int tcp_recv_wrapper(cli_cb_base_t *cb);
 static int tcp_send_wrapper(cli_cb_base_t *cb);
 static int tcp_close_socket(cli_cb_base_t *cb);
 static void tcp_destroy(cli_cb_base_t *cb);
+static int tcp_parse(cli_cb_base_t *cb);
+
+static int h2_stream_close(cli_cb_base_t *cb);
 
 
 static int ssl_new_connection(cli_cb_base_t *cb);
@@ -99,8 +118,13 @@ static void listen_ssl_destroy(cli_cb_base_t *cb);
 
 static int ssl_recv_wrapper(cli_cb_base_t *cb);
 static int ssl_send_wrapper(cli_cb_base_t *cb);
+static int ssl_process(cli_cb_base_t *cb, int read_ready, int write_ready);
 static int ssl_close_socket(cli_cb_base_t *cb);
 static void ssl_destroy(cli_cb_base_t *cb);
+static int ssl_handshake(cli_cb_ssl_t *ssl_cb);
+static int ssl_is_offloaded(cli_cb_ssl_t *ssl_cb);
+static int ssl_send_body(cli_cb_ssl_t *ssl_cb);
+static int body_is_direct(cli_cb_tcp_t *tcp_cb);
 
 
 static int cgi_recv_wrapper(cli_cb_base_t *cb);
@@ -111,10 +135,21 @@ static int cgi_close_read(cli_cb_base_t *cb);
 static void cgi_destroy(cli_cb_base_t *cb);
 
 
+static int notify_recv(cli_cb_base_t *cb);
+static int notify_close(cli_cb_base_t *cb);
+static void notify_destroy(cli_cb_base_t *cb);
+
+
 static int process_generic(cli_cb_base_t *cb, int read_ready, int write_ready);
 static int handle_req_msg(cli_cb_base_t *cb);
 
 static void clear_req_msg_list(struct list_head *list);
+static void clear_comp(cli_cb_tcp_t *tcp_cb);
+static int release_body(cli_cb_tcp_t *tcp_cb);
+static void drop_rsp(cli_cb_tcp_t *tcp_cb);
+static int batch_rsp(cli_cb_tcp_t *tcp_cb);
+
+static int fill_part_hdr(cli_cb_tcp_t *tcp_cb, char *buf, int size, int idx);
 
 
 
@@ -129,6 +164,28 @@ void make_buf_empty(char *buf, int *ctr)
         *ctr = 0;
 }
 
+/**
+ * @brief parse of a connection, http/2 from here on if it opens with the
+ *        client preface (prior knowledge)
+ */
+static int tcp_parse(cli_cb_base_t *cb)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+        int ret;
+
+        if(tcp_cb->is_fresh &&
+           !is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr)){
+                tcp_cb->is_fresh = 0;
+                if(h2_is_preface(tcp_cb->buf_in, tcp_cb->buf_in_ctr)){
+                        if((ret = h2_start(tcp_cb, NULL)) < 0){
+                                return ret;
+                        }
+                        return cb->mthd.parse(cb);
+                }
+        }
+        return parse_generic(cb);
+}
+
 static int process_generic(cli_cb_base_t *cb, int read_ready, int write_ready)
 {
         int ret;
@@ -162,13 +219,56 @@ static void reelect_max_fd(void)
     return;
 }
 
+/* whether aes is cheap here, so that AES-GCM beats ChaCha20 */
+static int ssl_has_aes_hw(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes");
+#else
+    return 1;
+#endif
+}
+
+/* versions, ciphers and options of a server context, the default one
+ * as well as those of the hosts in sni */
+static int setup_ssl_ctx(SSL_CTX *ctx)
+{
+    /* TLS 1.2 and 1.3 only, ECDHE and AEAD only, X25519 first */
+    if(!SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+       !SSL_CTX_set_max_proto_version(ctx, TLS1_3_VERSION) ||
+       !SSL_CTX_set_cipher_list(ctx, ssl_has_aes_hw() ?
+                                SSL_CIPHERS_AES_FIRST :
+                                SSL_CIPHERS_CHACHA_FIRST) ||
+       !SSL_CTX_set_ciphersuites(ctx, ssl_has_aes_hw() ?
+                                 SSL_SUITES_AES_FIRST :
+                                 SSL_SUITES_CHACHA_FIRST) ||
+       !SSL_CTX_set1_groups_list(ctx, "X25519:P-256")){
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    /* our order, except that a client putting ChaCha20 first (no aes
+     * in hardware) gets it; http frames its own messages, so a peer
+     * closing without close_notify doesn't spoil its session */
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE |
+                        SSL_OP_PRIORITIZE_CHACHA | SSL_OP_NO_COMPRESSION |
+                        SSL_OP_NO_RENEGOTIATION |
+                        SSL_OP_IGNORE_UNEXPECTED_EOF);
+    /* a write cut short by WANT_WRITE is retried from buf_out as is */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    /* h2 for clients that have it */
+    SSL_CTX_set_alpn_select_cb(ctx, h2_alpn_select, NULL);
+    return 0;
+}
+
 static void init_ssl_var(void)
 {
+    int ret;
+
     SSL_library_init();
     SSL_load_error_strings();
-    ssl_mthd = SSLv3_method();
+    ssl_mthd = TLS_server_method();
     ssl_ctx = SSL_CTX_new(ssl_mthd);
-    if(!ssl_ctx){
+    if(!ssl_ctx || setup_ssl_ctx(ssl_ctx) < 0){
         ERR_print_errors_fp(stderr);
         exit(1);
     }
@@ -190,6 +290,19 @@ static void init_ssl_var(void)
         err_printf("cert and priv key don't match");
         exit(1);
     }
+
+    /* and a certificate of its own for each host that has one */
+    sni_init(ssl_ctx, setup_ssl_ctx);
+
+    /* resume sessions from a shared cache or a ticket */
+    if((ret = ssl_cache_init(ssl_ctx)) < 0){
+        err_printf("tls resumption disabled, ret = 0x%x", -ret);
+    }
+    /* and let resumed clients send a GET or HEAD in the first flight */
+    if(SSL_EARLY_DATA_MAX &&
+       (ret = ssl_cache_early_data(ssl_ctx, SSL_EARLY_DATA_MAX)) < 0){
+        err_printf("0-RTT disabled, ret = 0x%x", -ret);
+    }
 }
 
 static void init_global_var(void)
@@ -211,6 +324,40 @@ static void init_global_var(void)
 
     /* init ssl related var */
     init_ssl_var();
+
+    hdr_cache_init();
+
+    h2_init();
+
+    /* compile the Cache-Control rules, bad ones are left out */
+    if((ret = cache_policy_init()) < 0){
+        err_printf("cache policy incomplete, ret = 0x%x", -ret);
+    }
+
+    /* resources are opened beneath the docroot fd */
+    if((ret = docroot_init(DEFAULT_FD)) < 0){
+        err_printf("no docroot fd, ret = 0x%x", -ret);
+    }
+
+    /* warm the page cache with what was hot before the restart */
+    if((ret = hot_set_init()) < 0){
+        err_printf("hot set not loaded, ret = 0x%x", -ret);
+    }
+
+    /* init the negative lookup cache, it stays off without inotify */
+    if((ret = neg_cache_init(DEFAULT_FD)) < 0 ||
+       (ret = register_notify_fd(neg_cache_watch_fd(),
+                                 neg_cache_handle_events)) < 0){
+        err_printf("neg cache disabled, ret = 0x%x", -ret);
+    }
+
+    /* hand blocking file io to the pool, it stays in the loop without */
+    if((ret = io_pool_init()) < 0 ||
+       (ret = register_notify_fd(io_pool_watch_fd(),
+                                 io_pool_handle_events)) < 0 ||
+       (ret = io_pool_start()) < 0){
+        err_printf("io pool disabled, ret = 0x%x", -ret);
+    }
     return;
 }
 
@@ -250,6 +397,39 @@ static int init_cli_cb_listen_tcp(cli_cb_base_t *cli_cb,
         return 0;
 }
 
+/* buffers and response state, of a connection or an h2 stream */
+static void init_tcp_state(cli_cb_tcp_t *cli_cb_tcp)
+{
+        /* init various buffers */
+        memset(cli_cb_tcp->buf_in, 0, BUF_IN_SIZE + 1);
+        cli_cb_tcp->buf_in_ctr = 0;
+        memset(cli_cb_tcp->buf_proc, 0, BUF_PROC_SIZE + 1);
+        cli_cb_tcp->buf_proc_ctr = 0;
+        memset(cli_cb_tcp->buf_out, 0, BUF_OUT_SIZE + 1);
+        cli_cb_tcp->buf_out_ctr = 0;
+        cli_cb_tcp->buf_batch = NULL;
+        cli_cb_tcp->buf_batch_ctr = 0;
+
+        INIT_LIST_HEAD(&cli_cb_tcp->req_msg_list);
+
+        cli_cb_tcp->is_send_pending = 0;
+        cli_cb_tcp->is_cgi_pending = 0;
+        cli_cb_tcp->is_early = 0;
+        cli_cb_tcp->content_enc = NULL;
+        cli_cb_tcp->comp_entry = NULL;
+        cli_cb_tcp->comp_stream = NULL;
+        cli_cb_tcp->embed_var = NULL;
+        cli_cb_tcp->hints = NULL;
+        cli_cb_tcp->cache_rule = NULL;
+        cli_cb_tcp->map_entry = NULL;
+        cli_cb_tcp->range_ctr = 0;
+        cli_cb_tcp->io_job = NULL;
+        cli_cb_tcp->ra_start = 0;
+        cli_cb_tcp->ra_end = 0;
+        cli_cb_tcp->is_fresh = 1;
+        cli_cb_tcp->h2 = NULL;
+}
+
 static int init_cli_cb_tcp(cli_cb_base_t *cli_cb,
                            struct sockaddr_in *addr,
                            int fd)
@@ -261,22 +441,11 @@ static int init_cli_cb_tcp(cli_cb_base_t *cli_cb,
         dbg_printf("cli_addr:%s", inet_ntoa(cli_cb_tcp->cli_addr.sin_addr));
         dbg_printf("addr: %s", inet_ntoa(addr->sin_addr));
         cli_cb_tcp->cli_fd = fd;
-        /* init various buffers */
-        memset(cli_cb_tcp->buf_in, 0, BUF_IN_SIZE + 1);
-        cli_cb_tcp->buf_in_ctr = 0;
-        memset(cli_cb_tcp->buf_proc, 0, BUF_PROC_SIZE + 1);
-        cli_cb_tcp->buf_proc_ctr = 0;
-        memset(cli_cb_tcp->buf_out, 0, BUF_OUT_SIZE + 1);
-        cli_cb_tcp->buf_out_ctr = 0;
-
-        INIT_LIST_HEAD(&cli_cb_tcp->req_msg_list);
+        init_tcp_state(cli_cb_tcp);
     
         /* register cli cb */
         register_cli_cb(cli_cb, fd, 0);
         register_cli_cb(cli_cb, fd, 1);
-
-        cli_cb_tcp->is_send_pending = 0;
-        cli_cb_tcp->is_cgi_pending = 0;
         
         /* init tcp method */        
         cli_cb->mthd.recv = tcp_recv_wrapper;
@@ -284,7 +453,7 @@ static int init_cli_cb_tcp(cli_cb_base_t *cli_cb,
         cli_cb->mthd.close = tcp_close_socket;
         cli_cb->mthd.destroy = tcp_destroy;
 
-        cli_cb->mthd.parse = parse_generic;
+        cli_cb->mthd.parse = tcp_parse;
         cli_cb->mthd.handle_req_msg = handle_req_msg;
         cli_cb->mthd.process = process_generic;
         
@@ -305,8 +474,14 @@ static int init_cli_cb_ssl(cli_cb_base_t *cli_cb,
         /* re-init the ssl mthd */
         cli_cb->mthd.recv = ssl_recv_wrapper;
         cli_cb->mthd.send = ssl_send_wrapper;
+        cli_cb->mthd.process = ssl_process;
         cli_cb->mthd.close = ssl_close_socket;
         cli_cb->mthd.destroy = ssl_destroy;
+        ((cli_cb_ssl_t *)cli_cb)->ssl = NULL;
+        ((cli_cb_ssl_t *)cli_cb)->state = SSL_CONN_HANDSHAKE;
+        ((cli_cb_ssl_t *)cli_cb)->rec_sent = 0;
+        ((cli_cb_ssl_t *)cli_cb)->rec_last = 0;
+        ((cli_cb_ssl_t *)cli_cb)->rec_retry = 0;
         
         return 0;
 }
@@ -359,6 +534,52 @@ static int init_cli_cb_cgi(cli_cb_base_t *cli_cb,
 }
 
 
+static int init_cli_cb_notify(cli_cb_base_t *cli_cb, int fd)
+{
+        cli_cb_notify_t *notify_cb = (cli_cb_notify_t *)cli_cb;
+        notify_cb->cli_fd = fd;
+        register_cli_cb(cli_cb, fd, 0);
+
+        cli_cb->mthd.recv = notify_recv;
+        cli_cb->mthd.close = notify_close;
+        cli_cb->mthd.destroy = notify_destroy;
+
+        cli_cb->mthd.send = NULL;
+        cli_cb->mthd.close_read = NULL;
+        cli_cb->mthd.close_write = NULL;
+        cli_cb->mthd.parse = NULL;
+        cli_cb->mthd.handle_req_msg = NULL;
+        cli_cb->mthd.process = NULL;
+
+        return 0;
+}
+
+
+/* a stream has no fd of its own, it is driven by its connection */
+static int init_cli_cb_h2_stream(cli_cb_base_t *cli_cb,
+                                 cli_cb_base_t *parent_cb)
+{
+        cli_cb_tcp_t *stream_cb = (cli_cb_tcp_t *)cli_cb;
+        cli_cb_tcp_t *tcp_par = (cli_cb_tcp_t *)parent_cb;
+
+        stream_cb->cli_addr = tcp_par->cli_addr;
+        stream_cb->cli_fd = tcp_par->cli_fd;
+        init_tcp_state(stream_cb);
+
+        cli_cb->mthd.send = h2_stream_send;
+        cli_cb->mthd.close = h2_stream_close;
+        cli_cb->mthd.destroy = tcp_destroy;
+        cli_cb->mthd.handle_req_msg = handle_req_msg;
+
+        cli_cb->mthd.recv = NULL;
+        cli_cb->mthd.parse = NULL;
+        cli_cb->mthd.process = NULL;
+        cli_cb->mthd.close_read = NULL;
+        cli_cb->mthd.close_write = NULL;
+        return 0;
+}
+
+
 int init_cli_cb(cli_cb_base_t *cli_cb, cli_cb_base_t *parent_cb,
                 struct sockaddr_in *addr, 
                 int cli_fd_read,
@@ -384,6 +605,12 @@ int init_cli_cb(cli_cb_base_t *cli_cb, cli_cb_base_t *parent_cb,
                 ret = init_cli_cb_cgi(cli_cb, parent_cb,
                                       cli_fd_read, cli_fd_write);
                 break;
+        case NOTIFY:
+                ret = init_cli_cb_notify(cli_cb, cli_fd_read);
+                break;
+        case H2_STREAM:
+                ret = init_cli_cb_h2_stream(cli_cb, parent_cb);
+                break;
         default:
                 ret = ERR_INIT_CLI;
                 err_printf("unknown cli cb type");
@@ -400,6 +627,8 @@ static void tcp_destroy(cli_cb_base_t *cb)
         cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
         
         clear_req_msg_list(&tcp_cb->req_msg_list);
+        clear_comp(tcp_cb);
+        free(tcp_cb->buf_batch);
         free(cb);
 }
 
@@ -407,6 +636,8 @@ static void ssl_destroy(cli_cb_base_t *cb)
 {
         cli_cb_ssl_t *ssl_cb = (cli_cb_ssl_t *)cb;
         clear_req_msg_list(&ssl_cb->tcp_base.req_msg_list);
+        clear_comp(&ssl_cb->tcp_base);
+        free(ssl_cb->tcp_base.buf_batch);
 
         free(cb);
 }
@@ -416,6 +647,24 @@ static void cgi_destroy(cli_cb_base_t *cb)
         free(cb);
 }
 
+static void notify_destroy(cli_cb_base_t *cb)
+{
+        free(cb);
+}
+
+
+/* drop compression state left by a connection closed mid-response */
+static void clear_comp(cli_cb_tcp_t *tcp_cb)
+{
+        if(tcp_cb->comp_stream){
+                comp_stream_free(tcp_cb->comp_stream);
+                tcp_cb->comp_stream = NULL;
+        }
+        if(tcp_cb->comp_entry){
+                comp_entry_put(tcp_cb->comp_entry);
+                tcp_cb->comp_entry = NULL;
+        }
+}
 
 static void clear_req_msg_list(struct list_head *list)
 {
@@ -436,6 +685,7 @@ static int get_fd(cli_cb_base_t *cb, int rw)
         cli_cb_tcp_t *tcp_cb;
         cli_cb_listen_tcp_t *tcp_listen_cb;
         cli_cb_cgi_t *cgi_cb;
+        cli_cb_notify_t *notify_cb;
         switch(cb->type){
         case LISTEN_TCP:
         case LISTEN_SSL:
@@ -458,6 +708,15 @@ static int get_fd(cli_cb_base_t *cb, int rw)
                 }else{
                         return cgi_cb->cli_fd_write;
                 }
+        case NOTIFY:
+                if(!rw){
+                        notify_cb = (cli_cb_notify_t *)cb;
+                        return notify_cb->cli_fd;
+                }
+                break;
+        case H2_STREAM:
+                /* never selected on */
+                break;
         }
         return -1;
 }
@@ -488,6 +747,16 @@ cli_cb_base_t *get_cli_cb(int cli_fd, int rw)
 
 
 
+/* stop selecting on a socket that is gone */
+static void unwatch_socket(int sock)
+{
+        FD_CLR(sock, &read_fds);
+        FD_CLR(sock, &write_fds);
+        FD_CLR(sock, &read_wait_fds);
+        FD_CLR(sock, &write_wait_fds);
+        reelect_max_fd();        
+}
+
 static int close_socket(int sock)
 {
         dbg_printf("close conn(%d)", sock);
@@ -496,11 +765,7 @@ static int close_socket(int sock)
                 err_printf("Failed closing socket.\n");
                 return ERR_CLOSE_SOCKET;
         }
-        FD_CLR(sock, &read_fds);
-        FD_CLR(sock, &write_fds);
-        FD_CLR(sock, &read_wait_fds);
-        FD_CLR(sock, &write_wait_fds);
-        reelect_max_fd();        
+        unwatch_socket(sock);
         return 0;
 }
 
@@ -510,7 +775,12 @@ static int tcp_close_socket(cli_cb_base_t *cb)
         int ret;
         
         dbg_printf("close socket(%d)", tcp_cb->cli_fd);
-        if((ret = close_socket(tcp_cb->cli_fd)) < 0){
+        if(tcp_cb->io_job && tcp_cb->io_job->op == IO_HANDSHAKE){
+                /* a worker still reads it; the pool closes it once the
+                 * job is back, so that its number isn't reused before */
+                shutdown(tcp_cb->cli_fd, SHUT_RDWR);
+                unwatch_socket(tcp_cb->cli_fd);
+        }else if((ret = close_socket(tcp_cb->cli_fd)) < 0){
                 ret = ERR_CLOSE_SOCKET;
                 return ret;
         }
@@ -518,10 +788,23 @@ static int tcp_close_socket(cli_cb_base_t *cb)
          * its socket fd */
         list_del(&cb->cli_rlink);
         list_del(&cb->cli_wlink);
+        drop_rsp(tcp_cb);
+        free(tcp_cb->buf_batch);
+        tcp_cb->buf_batch = NULL;
+        tcp_cb->buf_batch_ctr = 0;
+        /* and so are its streams, if it speaks h2 */
+        h2_close(tcp_cb);
 
         return 0;
 }
 
+/* a stream closes when its response is done or it is reset */
+static int h2_stream_close(cli_cb_base_t *cb)
+{
+        drop_rsp((cli_cb_tcp_t *)cb);
+        return 0;
+}
+
 static int listen_tcp_close(cli_cb_base_t *cb)
 {
         cli_cb_listen_tcp_t *listen_cb = (cli_cb_listen_tcp_t *)cb;
@@ -561,16 +844,22 @@ static void listen_ssl_destroy(cli_cb_base_t *cb)
 
 static int ssl_close_socket(cli_cb_base_t *cb)
 {
-    int ret;
-    
     cli_cb_ssl_t *ssl_cb = (cli_cb_ssl_t *)cb;   
 
-    if((ret = SSL_shutdown(ssl_cb->ssl)) < 0){
-            ret = ERR_CLOSE_SSL_SOCKET;
-            return ret;
+    if(ssl_is_offloaded(ssl_cb)){
+            /* the job frees it, tcp_close_socket drops the job */
+            ssl_cb->ssl = NULL;
     }
-    
-    SSL_free(ssl_cb->ssl);
+    if(ssl_cb->ssl){
+            /* best effort: the socket doesn't block, and the peer
+             * may be gone or mid handshake */
+            if(ssl_cb->state == SSL_CONN_OPEN){
+                    SSL_shutdown(ssl_cb->ssl);
+            }
+            SSL_free(ssl_cb->ssl);
+            ssl_cb->ssl = NULL;
+    }
+    ssl_cb->state = SSL_CONN_CLOSED;
 
     return tcp_close_socket(cb);
 }
@@ -592,6 +881,24 @@ static int cgi_close(cli_cb_base_t *cb)
         return 0;
 }
 
+static int notify_close(cli_cb_base_t *cb)
+{
+        cli_cb_notify_t *notify_cb = (cli_cb_notify_t *)cb;
+
+        dbg_printf("close notify fd(%d)", notify_cb->cli_fd);
+
+        FD_CLR(notify_cb->cli_fd, &read_fds);
+        FD_CLR(notify_cb->cli_fd, &read_wait_fds);
+        reelect_max_fd();
+        list_del(&cb->cli_rlink);
+
+        if (close(notify_cb->cli_fd)){
+                err_printf("Failed closing fd.\n");
+                return ERR_CLOSE_FD;
+        }
+        return 0;
+}
+
 static int cgi_close_read(cli_cb_base_t *cb)
 {
 
@@ -791,6 +1098,215 @@ static int tcp_new_connection(cli_cb_base_t *cb)
 }
 
 
+/**
+ * @brief see whether a failed SSL call is only waiting on the socket
+ *
+ * Until the handshake is done, the socket is kept in write_fds only
+ * while the tls layer or a 0-RTT response wants to write, so that a
+ * connection waiting on its peer doesn't spin the loop; once it is
+ * done the socket is always there, as for tcp.
+ *
+ * @param ssl_cb the connection
+ * @param err SSL_get_error of the call
+ * @return 1 if the call is to be retried once the socket is ready,
+ *         0 if the connection is done for
+ */
+static int ssl_want_err(cli_cb_ssl_t *ssl_cb, int err)
+{
+        int fd = ssl_cb->tcp_base.cli_fd;
+
+        switch(err){
+        case SSL_ERROR_WANT_READ:
+                if(ssl_cb->state != SSL_CONN_OPEN &&
+                   is_buf_empty(ssl_cb->tcp_base.buf_out,
+                                ssl_cb->tcp_base.buf_out_ctr) &&
+                   !ssl_cb->tcp_base.buf_batch_ctr &&
+                   !ssl_cb->tcp_base.is_send_pending){
+                        FD_CLR(fd, &write_fds);
+                }
+                return 1;
+        case SSL_ERROR_WANT_WRITE:
+                FD_SET(fd, &write_fds);
+                return 1;
+        case SSL_ERROR_ZERO_RETURN:
+                return 0;
+        default:
+                ERR_print_errors_fp(stderr);
+                return 0;
+        }
+}
+
+static int ssl_want(cli_cb_ssl_t *ssl_cb, int ret)
+{
+        return ssl_want_err(ssl_cb, SSL_get_error(ssl_cb->ssl, ret));
+}
+
+/* whether a crypto worker has the ssl of the connection */
+static int ssl_is_offloaded(cli_cb_ssl_t *ssl_cb)
+{
+        return ssl_cb->tcp_base.io_job &&
+               ssl_cb->tcp_base.io_job->op == IO_HANDSHAKE;
+}
+
+/* the handshake is done, application data flows from now on */
+static void ssl_opened(cli_cb_ssl_t *ssl_cb)
+{
+        int ret;
+
+        ssl_cb->state = SSL_CONN_OPEN;
+        ssl_cb->tcp_base.is_early = 0;
+        FD_SET(ssl_cb->tcp_base.cli_fd, &write_fds);
+        ssl_cache_count(ssl_cb->ssl);
+        dbg_printf("SSL connection using %s", SSL_get_cipher(ssl_cb->ssl));
+        if(h2_is_alpn(ssl_cb->ssl) &&
+           (ret = h2_start(&ssl_cb->tcp_base, NULL)) < 0){
+                err_printf("h2 not started, ret = 0x%x", -ret);
+                ssl_cb->tcp_base.base.mthd.close((cli_cb_base_t *)ssl_cb);
+        }
+}
+
+/**
+ * @brief a crypto worker is back with a handshake step
+ *
+ * Picks up where ssl_read_early or ssl_handshake would have, had they
+ * run the step in the loop; the socket is selected on again as the
+ * step wants.
+ *
+ * @param job the IO_HANDSHAKE job
+ * @return 0 on success, negative error code on failure
+ */
+static int ssl_handshake_done(io_job_t *job)
+{
+        cli_cb_ssl_t *ssl_cb = (cli_cb_ssl_t *)job->owner;
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)ssl_cb;
+        cli_cb_base_t *cb = (cli_cb_base_t *)ssl_cb;
+
+        tcp_cb->io_job = NULL;
+        /* max_fd may have been reelected below it meanwhile */
+        insert_fd(tcp_cb->cli_fd, &read_fds);
+        if(job->buf && job->ret == SSL_READ_EARLY_DATA_SUCCESS){
+                memcpy(tcp_cb->buf_in, job->buf, job->buf_len);
+                tcp_cb->buf_in_ctr = job->buf_len;
+                tcp_cb->buf_in[job->buf_len] = 0;
+                /* as if recv had read it */
+                return cb->mthd.process(cb, 1, 0);
+        }
+        if(job->buf && job->ret == SSL_READ_EARLY_DATA_FINISH){
+                ssl_cb->state = SSL_CONN_HANDSHAKE;
+                return ssl_handshake(ssl_cb);
+        }
+        if(!job->buf && job->ret == 1){
+                ssl_opened(ssl_cb);
+                return 0;
+        }
+        if(!ssl_want_err(ssl_cb, job->ssl_err)){
+                dbg_printf("handshake failed, conn(%d)", tcp_cb->cli_fd);
+                cb->mthd.close(cb);
+        }
+        return 0;
+}
+
+/**
+ * @brief hand the next handshake step to a crypto worker
+ *
+ * The socket is out of the select sets until the job is back, and the
+ * loop doesn't touch the ssl in between. With the pool off, or the
+ * connection parked on file io, the step is run in the loop instead.
+ *
+ * @param ssl_cb the connection, in SSL_CONN_EARLY or SSL_CONN_HANDSHAKE
+ * @return 1 if the step was handed off, 0 if it is to be run here
+ */
+static int ssl_offload(cli_cb_ssl_t *ssl_cb)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)ssl_cb;
+        io_job_t *job;
+
+        if(!io_pool_is_enabled() || tcp_cb->io_job ||
+           !(job = io_job_new(IO_HANDSHAKE, ssl_cb, ssl_handshake_done))){
+                return 0;
+        }
+        if(ssl_cb->state == SSL_CONN_EARLY){
+                if(!(job->buf = (char *)malloc(BUF_IN_SIZE))){
+                        free(job);
+                        return 0;
+                }
+                job->buf_len = BUF_IN_SIZE;
+        }
+        job->ssl = ssl_cb->ssl;
+        job->fd = tcp_cb->cli_fd;
+        /* out of the sets, so a close elsewhere may take max_fd below
+         * it; ssl_handshake_done puts it back with insert_fd */
+        FD_CLR(tcp_cb->cli_fd, &read_fds);
+        FD_CLR(tcp_cb->cli_fd, &write_fds);
+        io_job_submit(job);
+        tcp_cb->io_job = job;
+        return 1;
+}
+
+/**
+ * @brief take the handshake of a connection as far as the socket allows
+ * @param ssl_cb the connection, in SSL_CONN_HANDSHAKE
+ * @return 0, a failed handshake only closes the connection
+ */
+static int ssl_handshake(cli_cb_ssl_t *ssl_cb)
+{
+        cli_cb_base_t *cb = (cli_cb_base_t *)ssl_cb;
+        int ret;
+
+        if(ssl_offload(ssl_cb)){
+                return 0;
+        }
+        if((ret = SSL_accept(ssl_cb->ssl)) == 1){
+                ssl_opened(ssl_cb);
+                return 0;
+        }
+        if(!ssl_want(ssl_cb, ret)){
+                dbg_printf("handshake failed, conn(%d)",
+                           ssl_cb->tcp_base.cli_fd);
+                cb->mthd.close(cb);
+        }
+        return 0;
+}
+
+/**
+ * @brief read 0-RTT early data into buf_in, then go on with the handshake
+ *
+ * Requests in early data are parsed and, for GET and HEAD, answered
+ * right away with SSL_write_early_data; anything else waits for the
+ * handshake, as the client isn't proven live until then.
+ *
+ * @param ssl_cb the connection, in SSL_CONN_EARLY with buf_in empty
+ * @return 0, a failed handshake only closes the connection
+ */
+static int ssl_read_early(cli_cb_ssl_t *ssl_cb)
+{
+        cli_cb_base_t *cb = (cli_cb_base_t *)ssl_cb;
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)ssl_cb;
+        size_t readctr = 0;
+
+        if(ssl_offload(ssl_cb)){
+                return 0;
+        }
+        switch(SSL_read_early_data(ssl_cb->ssl, tcp_cb->buf_in, BUF_IN_SIZE,
+                                   &readctr)){
+        case SSL_READ_EARLY_DATA_SUCCESS:
+                tcp_cb->buf_in_ctr = readctr;
+                tcp_cb->buf_in[readctr] = 0;
+                return 0;
+        case SSL_READ_EARLY_DATA_FINISH:
+                /* no more early data, or none was taken */
+                ssl_cb->state = SSL_CONN_HANDSHAKE;
+                return ssl_handshake(ssl_cb);
+        default:
+                if(!ssl_want(ssl_cb, 0)){
+                        dbg_printf("handshake failed, conn(%d)",
+                                   tcp_cb->cli_fd);
+                        cb->mthd.close(cb);
+                }
+                return 0;
+        }
+}
+
 static int ssl_new_connection(cli_cb_base_t *cb)
 {
         socklen_t cli_size;
@@ -814,8 +1330,14 @@ static int ssl_new_connection(cli_cb_base_t *cb)
                 cb->mthd.destroy(cb);
                 return ERR_ACCEPT_FAILURE;
     }
+    /* the handshake and all i/o after it never block the loop */
+    if(fcntl(cli_sock, F_SETFL, fcntl(cli_sock, F_GETFL) | O_NONBLOCK) < 0){
+        close(cli_sock);
+        return 0;
+    }
     ssl_cb_new = (cli_cb_ssl_t *) malloc(sizeof(cli_cb_ssl_t));
     if(ssl_cb_new == NULL){
+        close(cli_sock);
         return ERR_NO_MEM;
     }
     tcp_cb_new = (cli_cb_tcp_t *)ssl_cb_new;
@@ -839,19 +1361,19 @@ static int ssl_new_connection(cli_cb_base_t *cb)
     }
     dbg_printf("SSL_new succeed");
     SSL_set_fd(ssl_cb_new->ssl, tcp_cb_new->cli_fd);
+    SSL_set_accept_state(ssl_cb_new->ssl);
     dbg_printf("set fd(%d) succeed", tcp_cb_new->cli_fd);
 
-    if((ret = SSL_accept(ssl_cb_new->ssl)) < 0){
-        ERR_print_errors_fp(stderr);
-        return ERR_SSL_ACCEPT;
+    if(SSL_get_max_early_data(ssl_cb_new->ssl) > 0){
+        ssl_cb_new->state = SSL_CONN_EARLY;
+        tcp_cb_new->is_early = 1;
     }
 
-    dbg_printf("SSL connection using %s\n", SSL_get_cipher(ssl_cb_new->ssl));
-
-
     dbg_printf("conn(%d) create conn(%d)", listen_cb->cli_fd, 
                tcp_cb_new->cli_fd);
-    return 0;
+    /* the ClientHello is often in already */
+    return ssl_cb_new->state == SSL_CONN_EARLY ?
+           ssl_read_early(ssl_cb_new) : ssl_handshake(ssl_cb_new);
 }
 
 
@@ -888,7 +1410,18 @@ int ssl_recv_wrapper(cli_cb_base_t *cb)
         cli_cb_ssl_t *ssl_cb = (cli_cb_ssl_t *)cb;
         cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
 
-        if(is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_out_ctr)){
+        if(ssl_is_offloaded(ssl_cb)){
+                /* selected before it was handed off */
+                return 0;
+        }
+        if(ssl_cb->state == SSL_CONN_EARLY){
+                return is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr) ?
+                       ssl_read_early(ssl_cb) : 0;
+        }
+        if(ssl_cb->state == SSL_CONN_HANDSHAKE){
+                return ssl_handshake(ssl_cb);
+        }
+        if(is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr)){
                 if((readctr = SSL_read(ssl_cb->ssl, tcp_cb->buf_in, 
                                        BUF_IN_SIZE)) 
                    > 0){
@@ -898,7 +1431,7 @@ int ssl_recv_wrapper(cli_cb_base_t *cb)
                         tcp_cb->buf_in_ctr = readctr;
                         tcp_cb->buf_in[readctr] = 0;
                         /* then do nothing */
-                }else{
+                }else if(!ssl_want(ssl_cb, readctr)){
                         /* if no reading is availale, return NULL */
                         cb->mthd.close(cb);
                         dbg_printf("conn (%i) is closed", tcp_cb->cli_fd);
@@ -909,28 +1442,126 @@ int ssl_recv_wrapper(cli_cb_base_t *cb)
         return 0;
 }
 
-int cgi_recv_wrapper(cli_cb_base_t *cb)
+/**
+ * @brief process a tls connection, then what SSL_read already decrypted
+ *
+ * Records are read off the socket whole, so a request may sit in the
+ * ssl buffers while the socket has nothing more to read; it is drained
+ * here on every wakeup rather than waiting for select.
+ */
+static int ssl_process(cli_cb_base_t *cb, int read_ready, int write_ready)
 {
-        int readctr;
+        cli_cb_ssl_t *ssl_cb = (cli_cb_ssl_t *)cb;
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
         int ret;
 
-        cli_cb_cgi_t *cgi_cb = (cli_cb_cgi_t *)cb;
-        cli_cb_tcp_t *tcp_par = (cli_cb_tcp_t *)(cgi_cb->cgi_parent);
-        if(is_buf_empty(tcp_par->buf_out, tcp_par->buf_out_ctr)){
-                if((readctr = read(cgi_cb->cli_fd_read, 
-                                   tcp_par->buf_out,
-                                   BUF_OUT_SIZE)) > 0){
-                        dbg_printf("read from cgi executable, readctr(%d)",
-                                   readctr);
-                        tcp_par->buf_out_ctr = readctr;
-                        tcp_par->buf_out[readctr] = 0;
-                        
-                }else{
-                        dbg_printf("close cgi cli cb(%d), readctr(%d)",
-                                   cgi_cb->cli_fd_read,
-                                   readctr);
-                        if((ret = cb->mthd.close(cb)) < 0){
-                                err_printf("close cgi cb failed, ret = 0x%x",
+        if(ssl_is_offloaded(ssl_cb)){
+                return 0;
+        }
+        /* requests in early data don't wait for the socket to be
+         * writable, the handshake keeps it out of write_fds */
+        if(ssl_cb->state == SSL_CONN_EARLY){
+                write_ready = 1;
+        }
+        if((ret = process_generic(cb, read_ready, write_ready)) < 0){
+                return ret;
+        }
+        if(ssl_cb->state == SSL_CONN_EARLY &&
+           (!is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr) ||
+            tcp_cb->buf_batch_ctr || tcp_cb->is_send_pending)){
+                FD_SET(tcp_cb->cli_fd, &write_fds);
+        }
+        while(ssl_cb->state == SSL_CONN_OPEN &&
+              is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr) &&
+              SSL_pending(ssl_cb->ssl) > 0){
+                if((ret = ssl_recv_wrapper(cb)) < 0 ||
+                   ssl_cb->state != SSL_CONN_OPEN ||
+                   is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr)){
+                        return ret;
+                }
+                if((ret = cb->mthd.parse(cb)) < 0){
+                        return ret;
+                }
+        }
+        return 0;
+}
+
+static int notify_recv(cli_cb_base_t *cb)
+{
+        cli_cb_notify_t *notify_cb = (cli_cb_notify_t *)cb;
+        return notify_cb->handler(notify_cb->cli_fd);
+}
+
+
+/**
+ * @brief watch fd in the main loop on behalf of another module
+ * @param fd the fd to watch for reading
+ * @param handler called with fd whenever fd is readable
+ * @return 0 on success, negative error code on failure
+ */
+int register_notify_fd(int fd, int (*handler)(int fd))
+{
+        cli_cb_notify_t *notify_cb;
+        int ret;
+
+        notify_cb = (cli_cb_notify_t *)malloc(sizeof(cli_cb_notify_t));
+        if(!notify_cb){
+                return ERR_NO_MEM;
+        }
+        notify_cb->handler = handler;
+        if((ret = init_cli_cb(&notify_cb->base, NULL, NULL, fd, fd,
+                              NOTIFY)) < 0){
+                free(notify_cb);
+                return ret;
+        }
+        return 0;
+}
+
+int cgi_recv_wrapper(cli_cb_base_t *cb)
+{
+        int readctr;
+        int ret;
+
+        cli_cb_cgi_t *cgi_cb = (cli_cb_cgi_t *)cb;
+        cli_cb_tcp_t *tcp_par = (cli_cb_tcp_t *)(cgi_cb->cgi_parent);
+        comp_stream_t *cs = tcp_par->comp_stream;
+
+        if(cs){
+                /* the output is filtered through the comp stream */
+                if(cs->in_ctr < BUF_OUT_SIZE){
+                        if((readctr = read(cgi_cb->cli_fd_read,
+                                           cs->in_buf + cs->in_ctr,
+                                           BUF_OUT_SIZE - cs->in_ctr)) > 0){
+                                cs->in_ctr += readctr;
+                        }else{
+                                if((ret = cb->mthd.close(cb)) < 0){
+                                        err_printf("close cgi cb failed, "
+                                                   "ret = 0x%x", -ret);
+                                        return ret;
+                                }
+                                /* parent stays cgi pending until the
+                                 * stream is finished */
+                                cs->in_eof = 1;
+                        }
+                }
+                return cgi_comp_drain(tcp_par);
+        }
+
+        if(is_buf_empty(tcp_par->buf_out, tcp_par->buf_out_ctr)){
+                if((readctr = read(cgi_cb->cli_fd_read, 
+                                   tcp_par->buf_out,
+                                   BUF_OUT_SIZE)) > 0){
+                        dbg_printf("read from cgi executable, readctr(%d)",
+                                   readctr);
+                        tcp_par->buf_out_ctr = readctr;
+                        tcp_par->buf_out[readctr] = 0;
+                        
+                }else{
+                        dbg_printf("close cgi cli cb(%d), readctr(%d)",
+                                   cgi_cb->cli_fd_read,
+                                   readctr);
+                        if((ret = cb->mthd.close(cb)) < 0){
+                                err_printf("close cgi cb failed, ret = 0x%x",
                                            -ret);
                                 return ret;
                         }
@@ -952,13 +1583,20 @@ int cgi_recv_wrapper(cli_cb_base_t *cb)
 
 static int tcp_send_wrapper(cli_cb_base_t *cb)
 {            
-        int sendctr;
+        struct iovec iov[2];
+        int sendctr, len;
         cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
-        if(!is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){   
+
+        /* the responses a pipeline set aside go with buf_out, in one
+         * write */
+        len = tcp_cb->buf_batch_ctr + tcp_cb->buf_out_ctr;
+        if(len){   
                 dbg_printf("%s",tcp_cb->buf_out);
-                if((sendctr = send(tcp_cb->cli_fd, tcp_cb->buf_out, 
-                                   tcp_cb->buf_out_ctr, 0))
-                   != tcp_cb->buf_out_ctr){
+                iov[0].iov_base = tcp_cb->buf_batch;
+                iov[0].iov_len = tcp_cb->buf_batch_ctr;
+                iov[1].iov_base = tcp_cb->buf_out;
+                iov[1].iov_len = tcp_cb->buf_out_ctr;
+                if((sendctr = writev(tcp_cb->cli_fd, iov, 2)) != len){
                         cb->mthd.close(cb);
 
                         err_printf("Error sending to client.\n");
@@ -966,8 +1604,8 @@ static int tcp_send_wrapper(cli_cb_base_t *cb)
                         return ERR_SEND;
                 }else{
                         dbg_printf("buf sent, conn (%d), ctr(%d)", 
-                                   tcp_cb->cli_fd,
-                                   tcp_cb->buf_out_ctr);
+                                   tcp_cb->cli_fd, len);
+                        tcp_cb->buf_batch_ctr = 0;
                         make_buf_empty(tcp_cb->buf_out, &tcp_cb->buf_out_ctr);
                 }
         }
@@ -975,27 +1613,128 @@ static int tcp_send_wrapper(cli_cb_base_t *cb)
 }
 
 
+/**
+ * @brief the length of the next record of a conn
+ *
+ * A new or idle conn sends records that fit one tcp segment, so the
+ * first bytes of a response can be decrypted as soon as they arrive;
+ * past SSL_REC_RAMP_BYTES the window is open and full records cost the
+ * least framing. A write being retried keeps its length.
+ */
+static int ssl_rec_len(cli_cb_ssl_t *ssl_cb, int left)
+{
+        time_t now;
+
+        if(ssl_cb->rec_retry){
+                return ssl_cb->rec_retry;
+        }
+        now = time(NULL);
+        if(now - ssl_cb->rec_last >= SSL_REC_IDLE_SECS){
+                /* cwnd is likely back to its start, so is the sizing */
+                ssl_cb->rec_sent = 0;
+        }
+        ssl_cb->rec_last = now;
+        if(ssl_cb->rec_sent < SSL_REC_RAMP_BYTES && left > SSL_REC_SMALL){
+                return SSL_REC_SMALL;
+        }
+        return left;
+}
+
+/**
+ * @brief write one record, of ssl_rec_len bytes out of what is left
+ * @return the bytes written, 0 if the socket would block (the retry
+ *         is to pass the same bytes), ERR_SEND if the conn was closed
+ */
+static int ssl_write_rec(cli_cb_ssl_t *ssl_cb, const char *buf, int left)
+{
+        cli_cb_base_t *cb = (cli_cb_base_t *)ssl_cb;
+        int len = ssl_rec_len(ssl_cb, left);
+        size_t written;
+        int sendctr;
+
+        if(ssl_cb->state == SSL_CONN_EARLY){
+                /* a 0-RTT response, in the server's first flight */
+                sendctr = SSL_write_early_data(ssl_cb->ssl, buf, len,
+                                               &written) == 1 ?
+                          (int)written : 0;
+        }else{
+                sendctr = SSL_write(ssl_cb->ssl, buf, len);
+        }
+        if(sendctr <= 0 && ssl_want(ssl_cb, sendctr)){
+                ssl_cb->rec_retry = len;
+                return 0;
+        }
+        ssl_cb->rec_retry = 0;
+        if(sendctr != len){
+                cb->mthd.close(cb);
+                err_printf("send_ctr (%d), rec len(%d).\n", sendctr, len);
+                return ERR_SEND;
+        }
+        ssl_cb->rec_sent += len;
+        return len;
+}
+
+/**
+ * @brief write out a buffer of a conn as records
+ * @return 1 once all of it is written, 0 if the socket would block (the
+ *         rest is moved to the head of buf, where the retry starts),
+ *         ERR_SEND if the conn was closed
+ */
+static int ssl_send_buf(cli_cb_ssl_t *ssl_cb, char *buf, int *ctr)
+{
+        int sent = 0;
+        int ret;
+
+        while(sent < *ctr){
+                if((ret = ssl_write_rec(ssl_cb, buf + sent,
+                                        *ctr - sent)) <= 0){
+                        if(!ret && sent){
+                                memmove(buf, buf + sent, *ctr - sent);
+                                *ctr -= sent;
+                        }
+                        return ret;
+                }
+                sent += ret;
+        }
+        *ctr = 0;
+        return 1;
+}
+
 static int ssl_send_wrapper(cli_cb_base_t *cb)
 {            
-        int sendctr;
+        int ret;
         cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
         cli_cb_ssl_t *ssl_cb = (cli_cb_ssl_t *)cb;
-        if(!is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){   
-                if((sendctr = SSL_write(ssl_cb->ssl, tcp_cb->buf_out, 
-                                        tcp_cb->buf_out_ctr))
-                   != tcp_cb->buf_out_ctr){
-                        cb->mthd.close(cb);
-                        err_printf("send_ctr (%d), buf_out_ctr(%d).\n", 
-                                   sendctr, 
-                                   tcp_cb->buf_out_ctr);
-                        return ERR_SEND;
-                }else{
-                        dbg_printf("buf sent, conn (%d), ctr(%d)", 
-                                   tcp_cb->cli_fd,
-                                   tcp_cb->buf_out_ctr);
-                        make_buf_empty(tcp_cb->buf_out, &tcp_cb->buf_out_ctr);
+
+        if(ssl_is_offloaded(ssl_cb)){
+                return 0;
+        }
+        if(ssl_cb->state == SSL_CONN_HANDSHAKE){
+                ssl_handshake(ssl_cb);
+                if(ssl_cb->state != SSL_CONN_OPEN){
+                        return 0;
                 }
         }
+        /* the responses a pipeline set aside go first; buf_out joins
+         * them where it fits, so records run across responses */
+        if(tcp_cb->buf_batch_ctr &&
+           tcp_cb->buf_batch_ctr + tcp_cb->buf_out_ctr <= PIPE_BATCH_SIZE){
+                memcpy(tcp_cb->buf_batch + tcp_cb->buf_batch_ctr,
+                       tcp_cb->buf_out, tcp_cb->buf_out_ctr);
+                tcp_cb->buf_batch_ctr += tcp_cb->buf_out_ctr;
+                make_buf_empty(tcp_cb->buf_out, &tcp_cb->buf_out_ctr);
+        }
+        if((ret = ssl_send_buf(ssl_cb, tcp_cb->buf_batch,
+                               &tcp_cb->buf_batch_ctr)) <= 0 ||
+           (ret = ssl_send_buf(ssl_cb, tcp_cb->buf_out,
+                               &tcp_cb->buf_out_ctr)) <= 0){
+                tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
+                return ret;
+        }
+        tcp_cb->buf_out[0] = 0;
+        if(body_is_direct(tcp_cb) && !tcp_cb->io_job){
+                return ssl_send_body(ssl_cb);
+        }
         return 0;
 }
 
@@ -1065,6 +1804,7 @@ void liso_shutdown(void)
     dbg_printf("prepare to shutdown lisod");
     /* free ssl related vars */
     SSL_CTX_free(ssl_ctx);
+    hot_set_save();
     
     if((ret = kill_connections()) < 0){
         err_printf("close socket failed");
@@ -1075,315 +1815,1329 @@ void liso_shutdown(void)
 }
 
 
-static int handle_pending_send(cli_cb_base_t *cb)
+/* a response cut short: the pool's work for it is thrown away, and
+ * what its body is read from is given back */
+static void drop_rsp(cli_cb_tcp_t *tcp_cb)
 {
-        int ctr;
-        int ret;
-        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
-
-        if(!tcp_cb->is_send_pending){
-                /* don't touch anything, just forward 
-                 * the output from cgi executatble to client */
-                //dbg_printf("cgi pending, return");
-                return 0;
-        }else{
-                if(is_buf_empty(tcp_cb->buf_out,
-                                 tcp_cb->buf_out_ctr)){ 
-                        /* only when the buf_out is sent */
-                        if(tcp_cb->fd_pos + BUF_OUT_SIZE < 
-                           tcp_cb->statbuf.st_size){
-                                memcpy(tcp_cb->buf_out, 
-                                       tcp_cb->faddr + tcp_cb->fd_pos,
-                                       BUF_OUT_SIZE);
-                                tcp_cb->buf_out_ctr = BUF_OUT_SIZE;
-                                tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
-                                tcp_cb->fd_pos += BUF_OUT_SIZE;
-                        }else{
-                                ctr = tcp_cb->statbuf.st_size - 
-                                        tcp_cb->fd_pos;
-                                memcpy(tcp_cb->buf_out, 
-                                       tcp_cb->faddr + tcp_cb->fd_pos,
-                                       ctr);
-                                tcp_cb->buf_out_ctr = ctr;
-                                tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
-                                if(munmap(tcp_cb->faddr, 
-                                          tcp_cb->statbuf.st_size) < 0){
-                                        err_printf("munmap failed");
-                                        ret = ERR_MMAP;
-                                        goto out1;
-                                }
-                                close(tcp_cb->rsrc_fd);
-                                clear_req_msg(tcp_cb->curr_req_msg);
-                                free(tcp_cb->curr_req_msg);
-                                tcp_cb->is_send_pending = 0;
-                        }
-                }
+        if(tcp_cb->io_job){
+                io_job_cancel(tcp_cb->io_job);
+                tcp_cb->io_job = NULL;
+        }
+        if(tcp_cb->is_send_pending){
+                release_body(tcp_cb);
+                tcp_cb->is_send_pending = 0;
         }
-        return 0;
- out1:
-        close(tcp_cb->rsrc_fd);
-        free(tcp_cb->curr_req_msg);
-        tcp_cb->is_send_pending = 0;
-        return ret;
 }
 
-
-static int handle_pending_cgi_send(cli_cb_base_t *cb)
+/** @brief give back whatever the body of the response was read from */
+static int release_body(cli_cb_tcp_t *tcp_cb)
 {
+        if(tcp_cb->comp_stream){
+                comp_stream_free(tcp_cb->comp_stream);
+                tcp_cb->comp_stream = NULL;
+        }
+        if(tcp_cb->embed_var){
+                /* read only memory, nothing to give back */
+                tcp_cb->embed_var = NULL;
+                return 0;
+        }
+        if(tcp_cb->comp_entry){
+                /* the resource fd was closed on the cache hit */
+                comp_entry_put(tcp_cb->comp_entry);
+                tcp_cb->comp_entry = NULL;
+                return 0;
+        }
+        if(tcp_cb->map_entry){
+                map_entry_put(tcp_cb->map_entry);
+                tcp_cb->map_entry = NULL;
+        }
+        close(tcp_cb->rsrc_fd);
         return 0;
 }
 
-static int handle_head_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
+/**
+ * @brief slide the mapping of the resource over fd_pos
+ *
+ * A resource is mapped MAP_WINDOW_LEN bytes at a time, so large files
+ * and many concurrent downloads don't eat up the address space, and
+ * the windows come from the map cache, so concurrent downloads of the
+ * same file share them. Bodies already in memory are mapped whole.
+ *
+ * @param tcp_cb the connection, with the body mapped
+ * @return 0 on success, negative error code on failure
+ */
+static int map_window(cli_cb_tcp_t *tcp_cb)
 {
-        int ret;
-        /* fill in the header to return to */
-        
-        char filename[FILENAME_MAX_LEN];
-        char buf_hdr[BUF_HDR_SIZE];
-        int ctr = 0; 
-        
-        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+        map_entry_t *entry;
 
-        /* copy the default folder */
-        strncpy(filename, DEFAULT_FD, FILENAME_MAX_LEN);
-        /* try to check whether the req url is / */
-        if(strstr(req_msg->req_line.url, CGI_PREFIX) 
-           == req_msg->req_line.url){
-                /* try to handle cgi */
-                if((ret = handle_cgi(req_msg, cb)) < 0){
-                        err_printf("handle cgi failed,"
-                                   "ret = 0x%x", -ret);
-                        return ret;                    
-                        }
+        if(tcp_cb->embed_var || tcp_cb->comp_entry ||
+           (tcp_cb->fd_pos >= tcp_cb->map_off &&
+            tcp_cb->fd_pos < tcp_cb->map_off + tcp_cb->map_len) ||
+           tcp_cb->fd_pos >= tcp_cb->statbuf.st_size){
                 return 0;
-        }else if(!strcmp(req_msg->req_line.url, FS_ROOT)){        
-                strncat(filename, "index.html", FILENAME_MAX_LEN);
-        }else{
-                strncat(filename, req_msg->req_line.url, 
-                        FILENAME_MAX_LEN);
         }
-        
-        dbg_printf("filename %s", filename);
-        if((tcp_cb->rsrc_fd = open(filename, O_RDONLY)) < 0){
-                dbg_printf("file not exist");
-                /* return 404 not found */
-                snprintf(buf_hdr, BUF_HDR_SIZE, 
-                         "%s 404 Not Found\r\n\r\n", 
-                         req_msg->req_line.ver);        
-                
-                strncpy(tcp_cb->buf_out, buf_hdr, BUF_OUT_SIZE);
-                tcp_cb->buf_out_ctr = strlen(buf_hdr) + 1;
-                dbg_printf("(buf_out)%s",tcp_cb->buf_out);
-                        
-        }else{       
-                /* resource exist */
-                if(fstat(tcp_cb->rsrc_fd, &tcp_cb->statbuf) < 0){
-                        ret = ERR_FSTAT;
-                        goto out2;
-                }
-                
-                if((tcp_cb->faddr = mmap(0, tcp_cb->statbuf.st_size, 
-                                         PROT_READ, MAP_SHARED, 
-                                         tcp_cb->rsrc_fd, 0)) 
-                   == MAP_FAILED){
-                        dbg_printf("mmap failed");
-                        ret = ERR_MMAP;
-                        goto out2;
-                }
-                /* print out response line */
-                ctr += snprintf(buf_hdr, BUF_HDR_SIZE, "%s 200 OK\r\n", 
-                                req_msg->req_line.ver);
-                /* print out header field */
-                if(strstr(req_msg->req_line.url, "css")){
-                        ctr += snprintf(buf_hdr + ctr, 
-                                        BUF_HDR_SIZE - ctr,
-                                        "Content-Type: text/css\r\n");
-                }else if(strstr(req_msg->req_line.url, "png")){
-                        ctr += snprintf(buf_hdr + ctr, 
-                                        BUF_HDR_SIZE - ctr,
-                                        "Content-Type: image/png\r\n");
-                }else{
-                        ctr += snprintf(buf_hdr + ctr, 
-                                        BUF_HDR_SIZE - ctr,
-                                        "Content-Type: text/html\r\n");
-                }
-                ctr += snprintf(buf_hdr + ctr, BUF_HDR_SIZE - ctr,
-                                "Content-Length: %d\r\n", 
-                                (int)tcp_cb->statbuf.st_size);
-                ctr += snprintf(buf_hdr + ctr, BUF_HDR_SIZE - ctr,
-                                "\r\n");
-                
-                int buf_hdr_len = strlen(buf_hdr);
-                        
-                if(buf_hdr_len > BUF_OUT_SIZE){
-                        ret = ERR_HDR_TOO_LONG;
-                        goto out2;                        
-                }
-                        
-                memcpy(tcp_cb->buf_out, buf_hdr, buf_hdr_len);
-                tcp_cb->buf_out[buf_hdr_len] = 0;
-                dbg_printf("(but_out): %s", tcp_cb->buf_out);
-                if(munmap(tcp_cb->faddr, tcp_cb->statbuf.st_size) < 0){
-                        err_printf("munmap failed");
-                        ret = ERR_MMAP;
-                        goto out2;
-                }
-                if(close(tcp_cb->rsrc_fd) < 0){
-                        ret = ERR_CLOSE_FD;
-                        return ret;
-                }
-                tcp_cb->is_send_pending = 0;                        
+        if(!(entry = map_cache_get(tcp_cb->rsrc_fd, &tcp_cb->statbuf,
+                                   tcp_cb->fd_pos))){
+                return ERR_MMAP;
         }
-        
+        if(tcp_cb->map_entry){
+                map_entry_put(tcp_cb->map_entry);
+        }
+        tcp_cb->map_entry = entry;
+        tcp_cb->faddr = entry->addr;
+        tcp_cb->map_off = entry->off;
+        tcp_cb->map_len = entry->len;
         return 0;
- out2:
-        if(!tcp_cb->rsrc_fd)
-                close(tcp_cb->rsrc_fd);
-
-        return ret;
-
+}
 
+/** @brief bytes of the body from fd_pos on that are mapped */
+static long long mapped_len(cli_cb_tcp_t *tcp_cb)
+{
+        long long end = tcp_cb->map_off + tcp_cb->map_len;
+        return (tcp_cb->fd_end < end ? tcp_cb->fd_end : end) - tcp_cb->fd_pos;
 }
 
+/**
+ * @brief whether the rest of the body is written by ssl_send_body
+ *        rather than copied into buf_out by fill_body
+ *
+ * Only a body sent as it is, from one range, qualifies; a deflated or
+ * multipart one is made up in buf_out.
+ */
+static int body_is_direct(cli_cb_tcp_t *tcp_cb)
+{
+        return tcp_cb->base.type == CONN_SSL && tcp_cb->is_send_pending &&
+               !tcp_cb->comp_stream && tcp_cb->range_ctr < 2;
+}
 
-static int handle_get_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
+/**
+ * @brief encrypt the body of a static response from where it lies
+ *
+ * Records are written from the mapping of the resource, or from the
+ * embedded or cached compressed body, without going through buf_out;
+ * SSL_write makes the only copy, into the record. fd_pos moves past a
+ * record only once it is taken, so a write that would block is retried
+ * from the same bytes. At most BUF_OUT_SIZE bytes go per wakeup, as
+ * much as one buf_out would have held; handle_pending_send finishes
+ * the response once fd_pos reaches fd_end.
+ *
+ * @param ssl_cb the connection, with buf_out empty
+ * @return 0 on success, ERR_SEND if the connection was closed
+ */
+static int ssl_send_body(cli_cb_ssl_t *ssl_cb)
 {
+        cli_cb_base_t *cb = (cli_cb_base_t *)ssl_cb;
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)ssl_cb;
+        int budget = BUF_OUT_SIZE;
+        long long left;
         int ret;
-        /* fill in the header to return to */
-        
-        char filename[FILENAME_MAX_LEN];
-        char buf_hdr[BUF_HDR_SIZE];
-        int ctr = 0; 
-        
-        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
 
-        /* copy the default folder */
-        strncpy(filename, DEFAULT_FD, FILENAME_MAX_LEN);
-        /* try to check whether the req url is / */
-        if(strstr(req_msg->req_line.url, CGI_PREFIX) 
-           == req_msg->req_line.url){
-                /* try to handle cgi */
-                if((ret = handle_cgi(req_msg, cb)) < 0){
-                        err_printf("handle cgi failed,"
-                                   "ret = 0x%x", -ret);
-                        return ret;                    
-                        }
-                return 0;
-        }else if(!strcmp(req_msg->req_line.url, FS_ROOT)){        
-                strncat(filename, "index.html", FILENAME_MAX_LEN);
-        }else{
-                strncat(filename, req_msg->req_line.url, 
-                        FILENAME_MAX_LEN);
-        }
-        
-        dbg_printf("filename %s", filename);
-        if((tcp_cb->rsrc_fd = open(filename, O_RDONLY)) < 0){
-                dbg_printf("file not exist");
-                /* return 404 not found */
-                snprintf(buf_hdr, BUF_HDR_SIZE, 
-                         "%s 404 Not Found\r\n\r\n", 
-                         req_msg->req_line.ver);        
-                
-                strncpy(tcp_cb->buf_out, buf_hdr, BUF_OUT_SIZE);
-                tcp_cb->buf_out_ctr = strlen(buf_hdr) + 1;
-                dbg_printf("(buf_out)%s",tcp_cb->buf_out);
-                        
-        }else{       
-                /* resource exist */
-                if(fstat(tcp_cb->rsrc_fd, &tcp_cb->statbuf) < 0){
-                        ret = ERR_FSTAT;
-                        goto out2;
-                }
-                
-                if((tcp_cb->faddr = mmap(0, tcp_cb->statbuf.st_size, 
-                                         PROT_READ, MAP_SHARED, 
-                                         tcp_cb->rsrc_fd, 0)) 
-                   == MAP_FAILED){
-                        dbg_printf("mmap failed");
-                        ret = ERR_MMAP;
-                        goto out2;
-                }
-                /* print out response line */
-                ctr += snprintf(buf_hdr, BUF_HDR_SIZE, "%s 200 OK\r\n", 
-                                req_msg->req_line.ver);
-                /* print out header field */
-                if(strstr(req_msg->req_line.url, "css")){
-                        ctr += snprintf(buf_hdr + ctr, 
-                                        BUF_HDR_SIZE - ctr,
-                                        "Content-Type: text/css\r\n");
-                }else if(strstr(req_msg->req_line.url, "png")){
-                        ctr += snprintf(buf_hdr + ctr, 
-                                        BUF_HDR_SIZE - ctr,
-                                        "Content-Type: image/png\r\n");
-                }else{
-                        ctr += snprintf(buf_hdr + ctr, 
-                                        BUF_HDR_SIZE - ctr,
-                                        "Content-Type: text/html\r\n");
+        while(tcp_cb->fd_pos < tcp_cb->fd_end && budget > 0){
+                if(map_window(tcp_cb) < 0){
+                        err_printf("map failed, conn(%d)", tcp_cb->cli_fd);
+                        cb->mthd.close(cb);
+                        return 0;
                 }
-                ctr += snprintf(buf_hdr + ctr, BUF_HDR_SIZE - ctr,
-                                "Content-Length: %d\r\n", 
-                                (int)tcp_cb->statbuf.st_size);
-                ctr += snprintf(buf_hdr + ctr, BUF_HDR_SIZE - ctr,
-                                "\r\n");
-                
-                int buf_hdr_len = strlen(buf_hdr);
-                        
-                if(buf_hdr_len > BUF_OUT_SIZE){
-                        ret = ERR_HDR_TOO_LONG;
-                        goto out2;                        
+                left = mapped_len(tcp_cb);
+                if(left > budget){
+                        left = budget;
                 }
-                        
-                memcpy(tcp_cb->buf_out, buf_hdr, buf_hdr_len);
-                tcp_cb->buf_out[buf_hdr_len] = 0;
-                dbg_printf("(but_out): %s", tcp_cb->buf_out);
-                
-                if(buf_hdr_len + tcp_cb->statbuf.st_size <= BUF_OUT_SIZE){
-                        /* we could send out response once */
-                        memcpy(tcp_cb->buf_out + buf_hdr_len, tcp_cb->faddr,
-                               tcp_cb->statbuf.st_size);
-                        tcp_cb->buf_out_ctr = buf_hdr_len + 
-                                tcp_cb->statbuf.st_size;
-                        tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
-                        if(munmap(tcp_cb->faddr, tcp_cb->statbuf.st_size) < 0){
-                                err_printf("munmap failed");
-                                ret = ERR_MMAP;
-                                goto out2;
-                        }
-                        close(tcp_cb->rsrc_fd);
-                        tcp_cb->is_send_pending = 0;
-                }else{
-                        /* we send the response multiple times */
-                        tcp_cb->fd_pos = BUF_OUT_SIZE - buf_hdr_len;
-                        memcpy(tcp_cb->buf_out + buf_hdr_len, tcp_cb->faddr,
-                               tcp_cb->fd_pos);
-                        tcp_cb->buf_out_ctr = BUF_OUT_SIZE;
-                        tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
-                        tcp_cb->is_send_pending = 1;
+                if((ret = ssl_write_rec(ssl_cb, tcp_cb->faddr +
+                                        (tcp_cb->fd_pos - tcp_cb->map_off),
+                                        left)) <= 0){
+                        return ret;
                 }
-                        
+                tcp_cb->fd_pos += ret;
+                budget -= ret;
         }
-        
         return 0;
- out2:
-        if(!tcp_cb->rsrc_fd)
-                close(tcp_cb->rsrc_fd);
-
-        return ret;
 }
 
-
-/* currently only handle cgi call */
-static int handle_post_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
+/** @brief append as much of the body as fits into buf_out
+ *
+ *  The body is [fd_pos, fd_end) of the resource, deflated into chunks
+ *  on the way if there is a comp stream. A multipart/byteranges body
+ *  moves the window from range to range, with the part headers in
+ *  between. Once all of it is in buf_out the body is released and
+ *  is_send_pending is cleared.
+ *
+ *  @param tcp_cb the connection
+ *  @return 0 on success, negative error code on failure
+ */
+static int fill_body(cli_cb_tcp_t *tcp_cb)
 {
+        int room = BUF_OUT_SIZE - tcp_cb->buf_out_ctr;
+        char part_hdr[BUF_HDR_SIZE];
+        byte_range_t *range;
+        long long len;
+        int is_done;
+        int consumed;
+        int ctr;
         int ret;
-        /* try to check whether the req url is / */
-        if(strstr(req_msg->req_line.url, CGI_PREFIX) 
-           == req_msg->req_line.url){
-                /* try to handle cgi */
-                if((ret = handle_cgi(req_msg, cb)) < 0){
-                        err_printf("handle cgi failed,"
-                                   "ret = 0x%x", -ret);
-                        return ret;                    
+
+        if(tcp_cb->comp_stream){
+                if((ret = map_window(tcp_cb)) < 0){
+                        release_body(tcp_cb);
+                        tcp_cb->is_send_pending = 0;
+                        return ret;
+                }
+                len = mapped_len(tcp_cb);
+                ctr = comp_deflate_chunk(tcp_cb->comp_stream,
+                                         tcp_cb->faddr + (tcp_cb->fd_pos -
+                                                          tcp_cb->map_off),
+                                         len, &consumed,
+                                         tcp_cb->fd_pos + len ==
+                                         tcp_cb->fd_end,
+                                         tcp_cb->buf_out + tcp_cb->buf_out_ctr,
+                                         room);
+                if(ctr < 0){
+                        release_body(tcp_cb);
+                        tcp_cb->is_send_pending = 0;
+                        return ctr;
+                }
+                tcp_cb->fd_pos += consumed;
+                is_done = tcp_cb->comp_stream->is_done;
+        }else{
+                ctr = 0;
+                while(1){
+                        if(tcp_cb->fd_pos == tcp_cb->fd_end &&
+                           tcp_cb->range_ctr > 1 &&
+                           tcp_cb->range_idx <= tcp_cb->range_ctr){
+                                /* between two parts of a multipart body */
+                                len = fill_part_hdr(tcp_cb, part_hdr,
+                                                    sizeof(part_hdr),
+                                                    tcp_cb->range_idx);
+                                if(len > room - ctr){
+                                        break;
+                                }
+                                memcpy(tcp_cb->buf_out + tcp_cb->buf_out_ctr
+                                       + ctr, part_hdr, len);
+                                ctr += len;
+                                if(tcp_cb->range_idx < tcp_cb->range_ctr){
+                                        range = &tcp_cb->ranges[tcp_cb->
+                                                                range_idx];
+                                        tcp_cb->fd_pos = range->start;
+                                        tcp_cb->fd_end = range->end + 1;
+                                }
+                                tcp_cb->range_idx++;
+                        }
+                        if(tcp_cb->fd_pos == tcp_cb->fd_end || ctr == room){
+                                break;
+                        }
+                        if((ret = map_window(tcp_cb)) < 0){
+                                release_body(tcp_cb);
+                                tcp_cb->is_send_pending = 0;
+                                return ret;
+                        }
+                        len = mapped_len(tcp_cb);
+                        if(len > room - ctr){
+                                len = room - ctr;
+                        }
+                        memcpy(tcp_cb->buf_out + tcp_cb->buf_out_ctr + ctr,
+                               tcp_cb->faddr + (tcp_cb->fd_pos -
+                                                tcp_cb->map_off), len);
+                        tcp_cb->fd_pos += len;
+                        ctr += len;
+                }
+                is_done = tcp_cb->fd_pos == tcp_cb->fd_end &&
+                        (tcp_cb->range_ctr < 2 ||
+                         tcp_cb->range_idx > tcp_cb->range_ctr);
+        }
+        tcp_cb->buf_out_ctr += ctr;
+        tcp_cb->buf_out[tcp_cb->buf_out_ctr] = 0;
+
+        if(!is_done){
+                tcp_cb->is_send_pending = 1;
+                return 0;
+        }
+        tcp_cb->is_send_pending = 0;
+        return release_body(tcp_cb);
+}
+
+/** @brief the pool read the next window of the body ahead */
+static int body_read_ahead(io_job_t *job)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)job->owner;
+
+        /* handle_pending_send picks up the body from here */
+        tcp_cb->io_job = NULL;
+        return 0;
+}
+
+/**
+ * @brief park the connection while the pool reads its body ahead
+ *
+ * Only a body mapped from the resource may fault on a cold disk. The
+ * pages the next sends read from are probed with mincore; if any is
+ * missing, IO_READAHEAD_LEN bytes from there are read ahead by the pool
+ * and not probed again.
+ *
+ * @param tcp_cb the connection, with the body mapped
+ * @return 1 if the connection was parked, 0 if the body can be sent
+ */
+static int park_for_readahead(cli_cb_tcp_t *tcp_cb)
+{
+        unsigned char vec[IO_PROBE_PAGES];
+        long page = sysconf(_SC_PAGESIZE);
+        long long start, len;
+        io_job_t *job;
+        int fd;
+        int i;
+
+        if(!io_pool_is_enabled() || tcp_cb->embed_var ||
+           tcp_cb->comp_entry || tcp_cb->fd_pos >= tcp_cb->fd_end ||
+           (tcp_cb->fd_pos >= tcp_cb->ra_start &&
+            (tcp_cb->fd_pos + BUF_OUT_SIZE <= tcp_cb->ra_end ||
+             tcp_cb->fd_end <= tcp_cb->ra_end))){
+                return 0;
+        }
+        if(map_window(tcp_cb) < 0){
+                /* fill_body runs into it again */
+                return 0;
+        }
+        start = tcp_cb->fd_pos & ~((long long)page - 1);
+        len = tcp_cb->fd_pos + mapped_len(tcp_cb) - start;
+        if(len > IO_PROBE_PAGES * page){
+                len = IO_PROBE_PAGES * page;
+        }
+        if(mincore(tcp_cb->faddr + (start - tcp_cb->map_off), len, vec) == 0){
+                for(i = 0; i < (len + page - 1) / page && (vec[i] & 1); i++);
+                if(i == (len + page - 1) / page){
+                        return 0;
+                }
+        }
+        tcp_cb->ra_start = start;
+        tcp_cb->ra_end = start + IO_READAHEAD_LEN;
+        /* the job reads from a fd of its own, the conn may close its
+         * one while a worker still has the job */
+        if((fd = dup(tcp_cb->rsrc_fd)) < 0){
+                /* fault the pages in then */
+                return 0;
+        }
+        if(!(job = io_job_new(IO_READAHEAD, tcp_cb, body_read_ahead))){
+                close(fd);
+                return 0;
+        }
+        job->fd = fd;
+        job->off = start;
+        job->len = IO_READAHEAD_LEN;
+        io_job_submit(job);
+        tcp_cb->io_job = job;
+        dbg_printf("conn(%d) parked for readahead at %lld", tcp_cb->cli_fd,
+                   start);
+        return 1;
+}
+
+static int handle_pending_send(cli_cb_base_t *cb)
+{
+        int ret = 0;
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+
+        if(!tcp_cb->is_send_pending){
+                /* don't touch anything, just forward 
+                 * the output from cgi executatble to client */
+                //dbg_printf("cgi pending, return");
+                return 0;
+        }
+        if(is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){ 
+                /* only when the buf_out is sent */
+                if(park_for_readahead(tcp_cb)){
+                        return 0;
+                }
+                if(!body_is_direct(tcp_cb)){
+                        ret = fill_body(tcp_cb);
+                }else if(tcp_cb->fd_pos == tcp_cb->fd_end){
+                        /* ssl_send_body wrote the last of it */
+                        tcp_cb->is_send_pending = 0;
+                        ret = release_body(tcp_cb);
+                }
+                if(!tcp_cb->is_send_pending){
+                        clear_req_msg(tcp_cb->curr_req_msg);
+                        free(tcp_cb->curr_req_msg);
+                }
+        }
+        return ret;
+}
+
+
+static int handle_pending_cgi_send(cli_cb_base_t *cb)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+
+        /* the cgi may be gone while its compressed output is not */
+        if(tcp_cb->comp_stream){
+                return cgi_comp_drain(tcp_cb);
+        }
+        return 0;
+}
+
+
+static void handle_not_found(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb)
+{
+        rsp_t rsp;
+
+        rsp_init(&rsp, tcp_cb->buf_out, BUF_OUT_SIZE);
+        rsp_status(&rsp, req_msg->req_line.ver, RSP_404);
+        rsp_date(&rsp);
+        rsp_lit(&rsp, "Content-Length: 0\r\n");
+        rsp_end(&rsp);
+        /* a version string too long to fit is cut short */
+        tcp_cb->buf_out_ctr = rsp.ctr;
+        tcp_cb->is_send_pending = 0;
+        dbg_printf("(buf_out)%s",tcp_cb->buf_out);
+}
+
+/** @brief open path read only, going through the negative cache
+ *  @return the fd, -1 if it can't be opened
+ */
+static int open_path(char *path)
+{
+        int fd;
+
+        if(neg_cache_lookup(path)){
+                errno = ENOENT;
+                return -1;
+        }
+        if((fd = docroot_open(path)) < 0 &&
+           (errno == ENOENT || errno == ENOTDIR)){
+                neg_cache_insert(path);
+        }
+        return fd;
+}
+
+/** @brief map the req url into the docroot
+ *  @param req_msg the req msg, its url is normalized in place
+ *  @param filename filled with the path of the resource
+ *  @return 0 on success, -1 if it is not origin-form or too long
+ */
+static int rsrc_path(req_msg_t *req_msg, char *filename)
+{
+        char *url = req_msg->req_line.url;
+
+        /* only origin-form targets map into the docroot: normalizing
+         * never climbs above a leading '/', but "../x" has none */
+        if(*url != '/'){
+                errno = EINVAL;
+                return -1;
+        }
+        normalize_path(url);
+        if(!strcmp(url, FS_ROOT)){
+                url = "/index.html";
+        }
+        if(snprintf(filename, FILENAME_MAX_LEN, "%s%s", DEFAULT_FD,
+                    url + (*url == '/')) >= FILENAME_MAX_LEN){
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        dbg_printf("filename %s", filename);
+        return 0;
+}
+
+/* the opaque part of the entity tag, from what identifies a version */
+static void fill_etag_base(struct stat *statbuf, char *etag)
+{
+        snprintf(etag, ETAG_MAX_LEN, "%llx-%llx-%llx",
+                 (unsigned long long)statbuf->st_ino,
+                 (unsigned long long)statbuf->st_size,
+                 (unsigned long long)statbuf->st_mtime);
+}
+
+/** @brief print the strong ETag of the representation being sent
+ *
+ *  Each content coding is a representation of its own, so it gets its
+ *  own tag: the coding name is appended to the tag of the resource.
+ *
+ *  @return # of bytes printed
+ */
+static int fill_etag(cli_cb_tcp_t *tcp_cb, char *buf, int size)
+{
+        if(tcp_cb->content_enc){
+                return snprintf(buf, size, "\"%s-%s\"", tcp_cb->etag,
+                                tcp_cb->content_enc);
+        }
+        return snprintf(buf, size, "\"%s\"", tcp_cb->etag);
+}
+
+/** @brief whether opaque tag, of len bytes, is base, plain or encoded */
+static int is_etag_match(char *tag, int len, char *base)
+{
+        int base_len = strlen(base);
+
+        if(len < base_len || strncmp(tag, base, base_len)){
+                return 0;
+        }
+        tag += base_len;
+        len -= base_len;
+        return !len ||
+                (len == 5 && !strncmp(tag, "-gzip", 5)) ||
+                (len == 8 && !strncmp(tag, "-deflate", 8)) ||
+                (len == 3 && !strncmp(tag, "-br", 3));
+}
+
+/**
+ * @brief find a tag in an If-None-Match list, by weak comparison
+ * @param field_value e.g. "\"a-b-c\", W/\"d-e-f\"" or "*"
+ * @param base the opaque tag of the resource
+ * @param match filled with the quoted tag that matched, at least
+ *        ETAG_MAX_LEN + 2 bytes
+ * @return 1 if a tag matched, 0 otherwise
+ */
+static int find_etag(char *field_value, char *base, char *match)
+{
+        char *pos = field_value;
+        char *end;
+
+        pos += strspn(pos, " \t");
+        if(*pos == '*'){
+                snprintf(match, ETAG_MAX_LEN + 2, "\"%s\"", base);
+                return 1;
+        }
+        while(*pos){
+                pos += strspn(pos, " \t,");
+                if(!strncmp(pos, "W/", 2)){
+                        pos += 2;
+                }
+                if(*pos != '"' || !(end = strchr(pos + 1, '"'))){
+                        return 0;
+                }
+                if(is_etag_match(pos + 1, end - pos - 1, base) &&
+                   end - pos + 1 < ETAG_MAX_LEN){
+                        memcpy(match, pos, end - pos + 1);
+                        match[end - pos + 1] = 0;
+                        return 1;
+                }
+                pos = end + 1;
+        }
+        return 0;
+}
+
+/* the Expires and Cache-Control fields of a caching policy, if any */
+static void rsp_cache_ctrl(rsp_t *rsp, const cache_rule_t *rule)
+{
+        if(!rule){
+                return;
+        }
+        if(rule->max_age >= 0){
+                rsp_field_date(rsp, "Expires", time(NULL) + rule->max_age);
+        }
+        rsp_field(rsp, "Cache-Control", rule->cache_ctrl);
+}
+
+/**
+ * @brief answer a conditional GET or HEAD with a 304 if it matches
+ *
+ * If-None-Match takes precedence over If-Modified-Since. The 304
+ * carries no body, only the validators and the caching policy.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection
+ * @param etag the opaque tag of the resource
+ * @param mtime the mtime of the resource
+ * @return 1 if a 304 was put in buf_out, 0 otherwise
+ */
+static int send_not_modified(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                             char *etag, time_t mtime)
+{
+        char *inm = get_field_value(req_msg, "If-None-Match");
+        char *ims = get_field_value(req_msg, "If-Modified-Since");
+        char match[ETAG_MAX_LEN + 2];
+        time_t since;
+        rsp_t rsp;
+
+        if(inm){
+                if(!find_etag(inm, etag, match)){
+                        return 0;
+                }
+        }else{
+                if(!ims || (since = parse_http_date(ims)) == -1 ||
+                   mtime > since){
+                        return 0;
+                }
+                snprintf(match, sizeof(match), "\"%s\"", etag);
+        }
+
+        rsp_init(&rsp, tcp_cb->buf_out, BUF_OUT_SIZE);
+        rsp_status(&rsp, req_msg->req_line.ver, RSP_304);
+        rsp_date(&rsp);
+        rsp_cache_ctrl(&rsp, tcp_cb->cache_rule);
+        rsp_field(&rsp, "ETag", match);
+        rsp_field_date(&rsp, "Last-Modified", mtime);
+        rsp_end(&rsp);
+        tcp_cb->buf_out_ctr = rsp.ctr;
+        tcp_cb->is_send_pending = 0;
+        dbg_printf("(buf_out)%s",tcp_cb->buf_out);
+        return 1;
+}
+
+/**
+ * @brief answer a conditional GET or HEAD before the resource is opened
+ *
+ * The resource is only stat'd, and only if the request is conditional
+ * at all.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection
+ * @param filename the path of the resource
+ * @return 1 if a 304 was put in buf_out, 0 otherwise
+ */
+static int handle_not_modified(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                               char *filename)
+{
+        char etag[ETAG_MAX_LEN];
+        struct stat statbuf;
+
+        if((!get_field_value(req_msg, "If-None-Match") &&
+            !get_field_value(req_msg, "If-Modified-Since")) ||
+           neg_cache_lookup(filename) ||
+           docroot_stat(filename, &statbuf) < 0 ||
+           !S_ISREG(statbuf.st_mode)){
+                return 0;
+        }
+        fill_etag_base(&statbuf, etag);
+        return send_not_modified(req_msg, tcp_cb, etag, statbuf.st_mtime);
+}
+
+
+/* precompressed sidecars, in order of preference */
+static struct{
+        int enc;
+        char *name;
+        char *suffix;
+} sidecars[] = {
+        {ENC_BR, "br", ".br"},
+        {ENC_GZIP, "gzip", ".gz"},
+};
+
+/** @brief swap the opened resource for a precompressed sidecar
+ *
+ *  A sidecar is only used if the client accepts its encoding and it is
+ *  not older than the resource itself. Missing sidecars end up in the
+ *  negative cache, so resources without one cost no extra syscall.
+ *
+ *  @param req_msg the req msg
+ *  @param tcp_cb its rsrc_fd and statbuf are replaced on success
+ *  @param filename the path of the resource
+ *  @return Void
+ */
+static void open_sidecar(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                         char *filename)
+{
+        char sidecar[FILENAME_MAX_LEN];
+        struct stat statbuf;
+        char *field_value;
+        int enc;
+        int fd;
+        int i;
+
+        tcp_cb->content_enc = NULL;
+        if(!comp_is_compressible(tcp_cb->mime_type) ||
+           !(field_value = get_field_value(req_msg, "Accept-Encoding"))){
+                return;
+        }
+        enc = parse_accept_encoding(field_value);
+        for(i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++){
+                if(!(enc & sidecars[i].enc) ||
+                   snprintf(sidecar, FILENAME_MAX_LEN, "%s%s", filename,
+                            sidecars[i].suffix) >= FILENAME_MAX_LEN){
+                        continue;
+                }
+                if((fd = open_path(sidecar)) < 0){
+                        continue;
+                }
+                if(fstat(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) ||
+                   statbuf.st_mtime < tcp_cb->statbuf.st_mtime){
+                        close(fd);
+                        continue;
+                }
+                dbg_printf("serve sidecar %s", sidecar);
+                close(tcp_cb->rsrc_fd);
+                tcp_cb->rsrc_fd = fd;
+                tcp_cb->statbuf = statbuf;
+                /* what was read ahead is of the resource */
+                tcp_cb->ra_start = tcp_cb->ra_end = 0;
+                tcp_cb->content_enc = sidecars[i].name;
+                return;
+        }
+}
+
+
+/** @brief compress the resource on the fly if no sidecar was found
+ *
+ *  A compressed body found in the cache is served with a Content-Length
+ *  (and the resource fd is closed). On a miss, a GET over http/1.1 is
+ *  answered chunked and deflated as buf_out drains, which fills the
+ *  cache on the way; anything else is sent as is.
+ *
+ *  @param req_msg the req msg
+ *  @param tcp_cb the connection, with the resource opened
+ *  @param filename the path of the resource
+ *  @return Void
+ */
+static void open_compressed(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                            char *filename)
+{
+        int enc;
+
+        tcp_cb->comp_entry = NULL;
+        tcp_cb->comp_stream = NULL;
+        if(tcp_cb->content_enc || tcp_cb->statbuf.st_size < COMP_MIN_SIZE ||
+           !comp_is_compressible(tcp_cb->mime_type) ||
+           !(enc = comp_choose_enc(req_msg))){
+                return;
+        }
+        if((tcp_cb->comp_entry = comp_cache_get(filename, &tcp_cb->statbuf,
+                                                enc))){
+                dbg_printf("comp cache hit (%s)", filename);
+                close(tcp_cb->rsrc_fd);
+                tcp_cb->content_enc = comp_enc_name(enc);
+                return;
+        }
+        if(req_msg->req_line.req != GET ||
+           strcmp(req_msg->req_line.ver, "HTTP/1.1")){
+                return;
+        }
+        if((tcp_cb->comp_stream = comp_stream_new(enc, COMP_STATIC, filename,
+                                                  &tcp_cb->statbuf))){
+                tcp_cb->content_enc = comp_enc_name(enc);
+        }
+}
+
+/** @brief point faddr at the body: the embedded or cached compressed
+ *         body, or nothing yet for the resource, which is mapped window
+ *         by window as it is sent; and [fd_pos, fd_end) at what to send */
+static int map_body(cli_cb_tcp_t *tcp_cb)
+{
+        tcp_cb->fd_pos = 0;
+        tcp_cb->faddr = NULL;
+        tcp_cb->map_entry = NULL;
+        tcp_cb->map_off = 0;
+        tcp_cb->map_len = 0;
+        if(tcp_cb->embed_var){
+                tcp_cb->faddr = (char *)tcp_cb->embed_var->body;
+                tcp_cb->fd_end = tcp_cb->embed_var->len;
+        }else if(tcp_cb->comp_entry){
+                tcp_cb->faddr = tcp_cb->comp_entry->data;
+                tcp_cb->fd_end = tcp_cb->comp_entry->len;
+        }else{
+                tcp_cb->fd_end = tcp_cb->statbuf.st_size;
+                /* let the kernel read ahead further */
+                posix_fadvise(tcp_cb->rsrc_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        tcp_cb->map_len = tcp_cb->fd_end;
+        if(tcp_cb->range_ctr == 1){
+                tcp_cb->fd_pos = tcp_cb->ranges[0].start;
+                tcp_cb->fd_end = tcp_cb->ranges[0].end + 1;
+        }else if(tcp_cb->range_ctr > 1){
+                /* fill_body starts with the first part header */
+                tcp_cb->fd_end = 0;
+                tcp_cb->range_idx = 0;
+        }
+        if(!tcp_cb->faddr){
+                tcp_cb->map_len = 0;
+        }
+        return 0;
+}
+
+
+/* length of the representation being sent */
+static long long rsrc_len(cli_cb_tcp_t *tcp_cb)
+{
+        if(tcp_cb->embed_var){
+                return tcp_cb->embed_var->len;
+        }
+        return tcp_cb->comp_entry ? tcp_cb->comp_entry->len :
+                tcp_cb->statbuf.st_size;
+}
+
+/** @brief whether If-Range, if any, still matches the resource */
+static int is_if_range_ok(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb)
+{
+        char etag[ETAG_MAX_LEN];
+        char *field_value;
+        int len;
+
+        if(!(field_value = get_field_value(req_msg, "If-Range"))){
+                return 1;
+        }
+        field_value += strspn(field_value, " \t");
+        if(*field_value == '"'){
+                /* strong comparison against the tag we would send */
+                len = fill_etag(tcp_cb, etag, sizeof(etag));
+                return !strncmp(field_value, etag, len) &&
+                        !field_value[len + strspn(field_value + len, " \t")];
+        }
+        if(!strncmp(field_value, "W/", 2)){
+                return 0;
+        }
+        return parse_http_date(field_value) == tcp_cb->mtime;
+}
+
+/** @brief release whatever the body would have been sent from */
+static void drop_body(cli_cb_tcp_t *tcp_cb)
+{
+        if(tcp_cb->comp_stream){
+                comp_stream_free(tcp_cb->comp_stream);
+                tcp_cb->comp_stream = NULL;
+        }
+        if(tcp_cb->embed_var){
+                tcp_cb->embed_var = NULL;
+        }else if(tcp_cb->comp_entry){
+                comp_entry_put(tcp_cb->comp_entry);
+                tcp_cb->comp_entry = NULL;
+        }else{
+                close(tcp_cb->rsrc_fd);
+        }
+}
+
+/**
+ * @brief pick up the byte ranges of a GET
+ *
+ * Ranges apply to the representation as sent, so a compressed one only
+ * qualifies if its length is known; a response that would be compressed
+ * on the fly is sent as is instead. If nothing requested is
+ * satisfiable, the 416 is put in buf_out and the resource released.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection, with the resource opened
+ * @return 1 if the 416 was sent, 0 otherwise
+ */
+static int open_range(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb)
+{
+        char *field_value;
+        rsp_t rsp;
+        int ctr;
+
+        tcp_cb->range_ctr = 0;
+        if(req_msg->req_line.req != GET ||
+           !(field_value = get_field_value(req_msg, "Range"))){
+                return 0;
+        }
+        /* settle the representation first: If-Range is compared
+         * against the tag of what is actually sent */
+        if(tcp_cb->comp_stream){
+                comp_stream_free(tcp_cb->comp_stream);
+                tcp_cb->comp_stream = NULL;
+                tcp_cb->content_enc = NULL;
+        }
+        if(!is_if_range_ok(req_msg, tcp_cb)){
+                return 0;
+        }
+        ctr = parse_range(field_value, rsrc_len(tcp_cb), tcp_cb->ranges);
+        if(ctr != ERR_RANGE_NOT_SATISFIABLE){
+                tcp_cb->range_ctr = ctr;
+                return 0;
+        }
+
+        rsp_init(&rsp, tcp_cb->buf_out, BUF_OUT_SIZE);
+        rsp_status(&rsp, req_msg->req_line.ver, RSP_416);
+        rsp_date(&rsp);
+        rsp_lit(&rsp, "Content-Range: bytes */");
+        rsp_num(&rsp, rsrc_len(tcp_cb));
+        rsp_lit(&rsp, "\r\nContent-Length: 0\r\n");
+        rsp_end(&rsp);
+        tcp_cb->buf_out_ctr = rsp.ctr;
+        tcp_cb->is_send_pending = 0;
+        drop_body(tcp_cb);
+        return 1;
+}
+
+/**
+ * @brief print the header in front of part idx of a multipart/byteranges
+ *        body, or the closing delimiter if idx is range_ctr
+ * @return # of bytes printed
+ */
+static int fill_part_hdr(cli_cb_tcp_t *tcp_cb, char *buf, int size, int idx)
+{
+        rsp_t rsp;
+
+        rsp_init(&rsp, buf, size);
+        rsp_lit(&rsp, "\r\n--" RANGE_BOUNDARY);
+        if(idx == tcp_cb->range_ctr){
+                rsp_lit(&rsp, "--\r\n");
+                return rsp.ctr;
+        }
+        rsp_lit(&rsp, "\r\n");
+        rsp_field(&rsp, "Content-Type", tcp_cb->mime_type);
+        rsp_lit(&rsp, "Content-Range: bytes ");
+        rsp_num(&rsp, tcp_cb->ranges[idx].start);
+        rsp_lit(&rsp, "-");
+        rsp_num(&rsp, tcp_cb->ranges[idx].end);
+        rsp_lit(&rsp, "/");
+        rsp_num(&rsp, rsrc_len(tcp_cb));
+        rsp_lit(&rsp, "\r\n");
+        rsp_end(&rsp);
+        return rsp.ctr;
+}
+
+/* Content-Length of the body being sent */
+static long long body_len(cli_cb_tcp_t *tcp_cb)
+{
+        char part_hdr[BUF_HDR_SIZE];
+        long long len = 0;
+        int i;
+
+        if(!tcp_cb->range_ctr){
+                return rsrc_len(tcp_cb);
+        }
+        for(i = 0; i < tcp_cb->range_ctr; i++){
+                len += tcp_cb->ranges[i].end - tcp_cb->ranges[i].start + 1;
+        }
+        if(tcp_cb->range_ctr > 1){
+                for(i = 0; i <= tcp_cb->range_ctr; i++){
+                        len += fill_part_hdr(tcp_cb, part_hdr,
+                                             sizeof(part_hdr), i);
+                }
+        }
+        return len;
+}
+
+
+/**
+ * @brief build the header of a 200 or 206 static response in buf_out
+ *
+ * The fields of a full 200 response are copied from the header cache
+ * when the representation was sent before, with only the Date patched
+ * in; otherwise they are built and remembered for next time.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection, with the body set up
+ * @param filename the path of the resource
+ * @return 0 on success, ERR_HDR_TOO_LONG if it does not fit
+ */
+static int fill_rsp_hdr(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                        char *filename)
+{
+        int is_tmpl = !tcp_cb->range_ctr && !tcp_cb->comp_stream;
+        const cache_rule_t *rule = tcp_cb->cache_rule;
+        char *cache_ctrl = rule ? (char *)rule->cache_ctrl : NULL;
+        char *mime_type = tcp_cb->mime_type;
+        char etag[ETAG_MAX_LEN + 2];
+        char *tmpl;
+        int tmpl_len;
+        int fields;
+        int ret;
+        rsp_t rsp;
+
+        rsp_init(&rsp, tcp_cb->buf_out, BUF_OUT_SIZE);
+        rsp_status(&rsp, req_msg->req_line.ver,
+                   tcp_cb->range_ctr ? RSP_206 : RSP_200);
+        fields = rsp.ctr;
+        fill_etag(tcp_cb, etag, sizeof(etag));
+
+        if(is_tmpl &&
+           (tmpl = hdr_cache_get(filename, tcp_cb->content_enc, etag,
+                                 body_len(tcp_cb), cache_ctrl, &tmpl_len))){
+                rsp_bytes(&rsp, tmpl, tmpl_len);
+                if(!rsp.is_overflow){
+                        memcpy(rsp.buf + fields + HDR_DATE_OFF,
+                               rsp_curr_date(), HTTP_DATE_LEN);
+                        if(rule && rule->max_age >= 0){
+                                fmt_http_date(time(NULL) + rule->max_age,
+                                              rsp.buf + fields +
+                                              HDR_EXPIRES_OFF);
+                                rsp.buf[fields + HDR_EXPIRES_OFF +
+                                        HTTP_DATE_LEN] = '\r';
+                        }
+                }
+                goto out1;
+        }
+
+        /* Date and Expires first, where a template has them patched */
+        rsp_date(&rsp);
+        rsp_cache_ctrl(&rsp, rule);
+        if(tcp_cb->range_ctr > 1){
+                rsp_lit(&rsp, "Content-Type: multipart/byteranges; "
+                        "boundary=" RANGE_BOUNDARY "\r\n");
+        }else{
+                rsp_field(&rsp, "Content-Type", mime_type);
+        }
+        if(tcp_cb->range_ctr == 1){
+                rsp_lit(&rsp, "Content-Range: bytes ");
+                rsp_num(&rsp, tcp_cb->ranges[0].start);
+                rsp_lit(&rsp, "-");
+                rsp_num(&rsp, tcp_cb->ranges[0].end);
+                rsp_lit(&rsp, "/");
+                rsp_num(&rsp, rsrc_len(tcp_cb));
+                rsp_lit(&rsp, "\r\n");
+        }
+        if(tcp_cb->content_enc){
+                rsp_field(&rsp, "Content-Encoding", tcp_cb->content_enc);
+        }
+        if(comp_is_compressible(mime_type)){
+                rsp_lit(&rsp, "Vary: Accept-Encoding\r\n");
+        }
+        rsp_field(&rsp, "ETag", etag);
+        rsp_field_date(&rsp, "Last-Modified", tcp_cb->mtime);
+        if(tcp_cb->hints){
+                rsp_field(&rsp, "Link", tcp_cb->hints);
+        }
+        if(tcp_cb->comp_stream){
+                rsp_lit(&rsp, "Transfer-Encoding: chunked\r\n");
+        }else{
+                rsp_lit(&rsp, "Accept-Ranges: bytes\r\n");
+                rsp_field_num(&rsp, "Content-Length", body_len(tcp_cb));
+        }
+        rsp_end(&rsp);
+        if(is_tmpl && !rsp.is_overflow){
+                hdr_cache_put(filename, tcp_cb->content_enc, etag,
+                              body_len(tcp_cb), cache_ctrl, rsp.buf + fields,
+                              rsp.ctr - fields);
+        }
+ out1:
+        if((ret = rsp_done(&rsp)) < 0){
+                return ret;
+        }
+        tcp_cb->buf_out_ctr = ret;
+        dbg_printf("(but_out): %s", tcp_cb->buf_out);
+        return 0;
+}
+
+/**
+ * @brief answer a GET or HEAD from the site compiled into the binary
+ *
+ * A full response over HTTP/1.x copies the header rendered at build
+ * time, with the date and minor version patched in; ranges and other
+ * versions get theirs printed. The body streams from read only memory.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection
+ * @param rsrc the embedded resource
+ * @return 0 on success, negative error code on failure
+ */
+static int handle_embedded(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                           const embed_rsrc_t *rsrc)
+{
+        const embed_var_t *var;
+        char *ver = req_msg->req_line.ver;
+        char *field_value;
+        int ret;
+
+        if(send_not_modified(req_msg, tcp_cb, (char *)rsrc->etag,
+                             rsrc->mtime)){
+                return 0;
+        }
+        field_value = get_field_value(req_msg, "Accept-Encoding");
+        var = embed_select(rsrc, field_value ?
+                           parse_accept_encoding(field_value) : 0);
+
+        tcp_cb->embed_var = var;
+        tcp_cb->comp_entry = NULL;
+        tcp_cb->comp_stream = NULL;
+        tcp_cb->mime_type = (char *)rsrc->mime_type;
+        tcp_cb->content_enc = comp_enc_name(var->enc);
+        snprintf(tcp_cb->etag, ETAG_MAX_LEN, "%s", rsrc->etag);
+        tcp_cb->mtime = rsrc->mtime;
+        if(open_range(req_msg, tcp_cb)){
+                return 0;
+        }
+
+        /* the header rendered at build time has no caching policy */
+        if(!tcp_cb->range_ctr && !tcp_cb->cache_rule &&
+           var->hdr_len <= BUF_OUT_SIZE &&
+           (!strcmp(ver, "HTTP/1.1") || !strcmp(ver, "HTTP/1.0"))){
+                memcpy(tcp_cb->buf_out, var->hdr, var->hdr_len);
+                memcpy(tcp_cb->buf_out + EMBED_DATE_OFF, rsp_curr_date(),
+                       HTTP_DATE_LEN);
+                tcp_cb->buf_out[EMBED_VER_OFF] = ver[EMBED_VER_OFF];
+                tcp_cb->buf_out_ctr = var->hdr_len;
+        }else if((ret = fill_rsp_hdr(req_msg, tcp_cb,
+                                     (char *)rsrc->path)) < 0){
+                tcp_cb->embed_var = NULL;
+                return ret;
+        }
+
+        if(req_msg->req_line.req == HEAD){
+                tcp_cb->embed_var = NULL;
+                tcp_cb->is_send_pending = 0;
+                return 0;
+        }
+        map_body(tcp_cb);
+        return fill_body(tcp_cb);
+}
+
+/**
+ * @brief answer a GET or HEAD for a static resource once it is opened
+ * @param req_msg the req msg
+ * @param tcp_cb the connection, with rsrc_fd and statbuf set
+ * @param filename the path of the resource
+ * @return 0 on success, negative error code on failure
+ */
+static int handle_opened(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                         char *filename)
+{
+        int is_head = req_msg->req_line.req == HEAD;
+        int ret;
+
+        hot_set_hit(filename);
+        /* validators describe the resource, not a sidecar */
+        fill_etag_base(&tcp_cb->statbuf, tcp_cb->etag);
+        tcp_cb->mtime = tcp_cb->statbuf.st_mtime;
+        /* preloads come from the document itself, before any swap */
+        if(!strcmp(tcp_cb->mime_type, "text/html")){
+                tcp_cb->hints = hints_get(filename, tcp_cb->etag,
+                                          tcp_cb->rsrc_fd);
+        }
+        /* serve a precompressed sidecar if there is one */
+        open_sidecar(req_msg, tcp_cb, filename);
+        /* otherwise compress on the fly; a HEAD only reports what
+         * is already in the cache */
+        open_compressed(req_msg, tcp_cb, filename);
+        if(open_range(req_msg, tcp_cb)){
+                return 0;
+        }
+
+        if(is_head){
+                ret = fill_rsp_hdr(req_msg, tcp_cb, filename);
+                tcp_cb->is_send_pending = 0;
+                drop_body(tcp_cb);
+                return ret;
+        }
+        if((ret = map_body(tcp_cb)) < 0){
+                drop_body(tcp_cb);
+                return ret;
+        }
+        if((ret = fill_rsp_hdr(req_msg, tcp_cb, filename)) < 0){
+                release_body(tcp_cb);
+                return ret;
+        }
+        if(park_for_readahead(tcp_cb)){
+                /* the header goes out meanwhile */
+                tcp_cb->is_send_pending = 1;
+                return 0;
+        }
+        /* the rest of the body goes out as buf_out drains */
+        return fill_body(tcp_cb);
+}
+
+/**
+ * @brief the pool opened a static resource, resume its request
+ *
+ * With the fstat at hand, the conditional headers are checked here
+ * rather than by handle_not_modified.
+ *
+ * @param job the IO_OPEN job
+ * @return 0 on success, negative error code on failure
+ */
+static int static_opened(io_job_t *job)
+{
+        cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)job->owner;
+        req_msg_t *req_msg = tcp_cb->curr_req_msg;
+        char etag[ETAG_MAX_LEN];
+        int ret = 0;
+
+        tcp_cb->io_job = NULL;
+        /* early hints go out ahead of the final response; as that is
+         * built from the head of buf_out, what the socket didn't take
+         * of them yet (ssl wanting to write) is set aside to go first */
+        if(!is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){
+                if(tcp_cb->base.mthd.send((cli_cb_base_t *)tcp_cb) < 0){
+                        /* the conn is closed */
+                        goto out2;
+                }
+                if(!batch_rsp(tcp_cb)){
+                        err_printf("early hints stuck, conn(%d)",
+                                   tcp_cb->cli_fd);
+                        tcp_cb->base.mthd.close((cli_cb_base_t *)tcp_cb);
+                        goto out2;
+                }
+        }
+        if(job->fd < 0){
+                dbg_printf("file not exist");
+                if(job->err == ENOENT || job->err == ENOTDIR){
+                        neg_cache_insert(job->path);
+                }
+                handle_not_found(req_msg, tcp_cb);
+                goto out1;
+        }
+        if(S_ISREG(job->statbuf.st_mode)){
+                fill_etag_base(&job->statbuf, etag);
+                if(send_not_modified(req_msg, tcp_cb, etag,
+                                     job->statbuf.st_mtime)){
+                        close(job->fd);
+                        goto out1;
+                }
+        }
+        tcp_cb->rsrc_fd = job->fd;
+        tcp_cb->statbuf = job->statbuf;
+        /* the pool read the head of it as well */
+        tcp_cb->ra_start = 0;
+        tcp_cb->ra_end = IO_READAHEAD_LEN;
+        if((ret = handle_opened(req_msg, tcp_cb, job->path)) < 0){
+                return ret;
+        }
+        goto out1;
+ out2:
+        if(job->fd >= 0){
+                close(job->fd);
+        }
+ out1:
+        if(!tcp_cb->is_send_pending && !tcp_cb->io_job){
+                clear_req_msg(req_msg);
+                free(req_msg);
+        }
+        return 0;
+}
+
+/**
+ * @brief answer 103 Early Hints with the preloads of a document
+ *
+ * Sent while the document is being opened, from the Link value of the
+ * version last scanned; the final response carries the current one.
+ * Only HTTP/1.1 clients are known to take an interim response.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection, with nothing in buf_out
+ * @param filename the path of the document
+ */
+static void send_early_hints(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb,
+                             char *filename)
+{
+        char *hints;
+        int ret;
+        rsp_t rsp;
+
+        if(!is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr) ||
+           strcmp(req_msg->req_line.ver, "HTTP/1.1") ||
+           strcmp(tcp_cb->mime_type, "text/html") ||
+           !(hints = hints_peek(filename))){
+                return;
+        }
+        rsp_init(&rsp, tcp_cb->buf_out, BUF_OUT_SIZE);
+        rsp_status(&rsp, req_msg->req_line.ver, RSP_103);
+        rsp_field(&rsp, "Link", hints);
+        rsp_end(&rsp);
+        if((ret = rsp_done(&rsp)) > 0){
+                tcp_cb->buf_out_ctr = ret;
+        }
+}
+
+/**
+ * @brief have the pool open and stat a static resource
+ * @param tcp_cb the connection, parked until static_opened
+ * @param filename the path of the resource
+ * @return 1 if the job was submitted, 0 if it is to be opened in the loop
+ */
+static int open_async(cli_cb_tcp_t *tcp_cb, char *filename)
+{
+        io_job_t *job;
+
+        if(neg_cache_lookup(filename) ||
+           !(job = io_job_new(IO_OPEN, tcp_cb, static_opened))){
+                return 0;
+        }
+        snprintf(job->path, FILENAME_MAX_LEN, "%s", filename);
+        io_job_submit(job);
+        tcp_cb->io_job = job;
+        return 1;
+}
+
+/**
+ * @brief answer a GET or HEAD for a static resource
+ *
+ * Resources compiled into the binary are served from memory. Otherwise,
+ * in order: the conditional headers are checked from a stat, the
+ * resource is opened, swapped for a sidecar or a compressed body if
+ * the client takes one, and cut to the requested ranges. A GET then
+ * sends the body as buf_out drains; a HEAD stops after the header.
+ * With the io pool up, the open and stat are done by a worker instead,
+ * and the request resumes in static_opened.
+ *
+ * @param req_msg the req msg
+ * @param tcp_cb the connection
+ * @return 0 on success, negative error code on failure
+ */
+static int handle_static(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb)
+{
+        char filename[FILENAME_MAX_LEN];
+        const embed_rsrc_t *rsrc;
+
+        tcp_cb->embed_var = NULL;
+        tcp_cb->hints = NULL;
+        tcp_cb->cache_rule = NULL;
+        if(rsrc_path(req_msg, filename) < 0){
+                handle_not_found(req_msg, tcp_cb);
+                return 0;
+        }
+        /* by the normalized url, as the resource itself is looked up */
+        tcp_cb->cache_rule = cache_policy_lookup(req_msg->req_line.url);
+        if((rsrc = embed_lookup(req_msg->req_line.url))){
+                return handle_embedded(req_msg, tcp_cb, rsrc);
+        }
+        tcp_cb->mime_type = hdr_mime_type(filename);
+        tcp_cb->ra_start = tcp_cb->ra_end = 0;
+        if(io_pool_is_enabled() && open_async(tcp_cb, filename)){
+                /* resumed by static_opened */
+                send_early_hints(req_msg, tcp_cb, filename);
+                return 0;
+        }
+        if(handle_not_modified(req_msg, tcp_cb, filename)){
+                /* answered from a stat, nothing opened */
+                return 0;
+        }
+        if((tcp_cb->rsrc_fd = open_path(filename)) < 0){
+                dbg_printf("file not exist");
+                /* return 404 not found */
+                handle_not_found(req_msg, tcp_cb);
+                return 0;
+        }
+        /* resource exist */
+        if(fstat(tcp_cb->rsrc_fd, &tcp_cb->statbuf) < 0){
+                close(tcp_cb->rsrc_fd);
+                return ERR_FSTAT;
+        }
+        return handle_opened(req_msg, tcp_cb, filename);
+}
+
+static int handle_head_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
+{
+        int ret;
+        
+        /* try to check whether the req url is / */
+        if(strstr(req_msg->req_line.url, CGI_PREFIX) 
+           == req_msg->req_line.url){
+                /* try to handle cgi */
+                if((ret = handle_cgi(req_msg, cb)) < 0){
+                        err_printf("handle cgi failed,"
+                                   "ret = 0x%x", -ret);
+                        return ret;                    
+                        }
+                return 0;
+        }
+        return handle_static(req_msg, (cli_cb_tcp_t *)cb);
+}
+
+
+static int handle_get_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
+{
+        int ret;
+        
+        /* try to check whether the req url is / */
+        if(strstr(req_msg->req_line.url, CGI_PREFIX) 
+           == req_msg->req_line.url){
+                /* try to handle cgi */
+                if((ret = handle_cgi(req_msg, cb)) < 0){
+                        err_printf("handle cgi failed,"
+                                   "ret = 0x%x", -ret);
+                        return ret;                    
+                        }
+                return 0;
+        }
+        return handle_static(req_msg, (cli_cb_tcp_t *)cb);
+}
+
+
+/* currently only handle cgi call */
+static int handle_post_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
+{
+        int ret;
+        /* try to check whether the req url is / */
+        if(strstr(req_msg->req_line.url, CGI_PREFIX) 
+           == req_msg->req_line.url){
+                /* try to handle cgi */
+                if((ret = handle_cgi(req_msg, cb)) < 0){
+                        err_printf("handle cgi failed,"
+                                   "ret = 0x%x", -ret);
+                        return ret;                    
                 }
         }
         return 0;
@@ -1394,63 +3148,167 @@ static int handle_unknown_mthd(req_msg_t *req_msg, cli_cb_base_t *cb)
     return 0;
 }
 
-static int handle_req_msg(cli_cb_base_t *cb)
+/**
+ * @brief switch to h2c as an HTTP/1.1 request asked to
+ *
+ * Requests pipelined after it are dropped; whatever followed it is the
+ * client preface, and is parsed as http/2.
+ *
+ * @param req_msg the request, answered as stream 1
+ * @param tcp_cb the connection
+ * @return 0 on success, negative error code on failure
+ */
+static int handle_upgrade(req_msg_t *req_msg, cli_cb_tcp_t *tcp_cb)
+{
+    int ret;
+
+    clear_req_msg_list(&tcp_cb->req_msg_list);
+    if((ret = h2_start(tcp_cb, req_msg)) < 0){
+            clear_req_msg(req_msg);
+            free(req_msg);
+            return ret;
+    }
+    if(tcp_cb->buf_proc_ctr <= BUF_IN_SIZE &&
+       is_buf_empty(tcp_cb->buf_in, tcp_cb->buf_in_ctr)){
+            memcpy(tcp_cb->buf_in, tcp_cb->buf_proc, tcp_cb->buf_proc_ctr);
+            tcp_cb->buf_in_ctr = tcp_cb->buf_proc_ctr;
+            tcp_cb->buf_in[tcp_cb->buf_in_ctr] = 0;
+    }
+    make_buf_empty(tcp_cb->buf_proc, &tcp_cb->buf_proc_ctr);
+    return 0;
+}
+
+/**
+ * @brief set the response in buf_out aside, so that the next request of
+ *        a pipeline is answered into buf_out while it waits to go out
+ * @return 1 if buf_out is empty now, 0 if it has to go out first
+ */
+static int batch_rsp(cli_cb_tcp_t *tcp_cb)
 {
+    if(is_buf_empty(tcp_cb->buf_out, tcp_cb->buf_out_ctr)){
+            return 1;
+    }
+    /* a stream takes a single request */
+    if(tcp_cb->base.type == H2_STREAM ||
+       tcp_cb->buf_batch_ctr + tcp_cb->buf_out_ctr > PIPE_BATCH_SIZE){
+            return 0;
+    }
+    if(!tcp_cb->buf_batch &&
+       !(tcp_cb->buf_batch = (char *)malloc(PIPE_BATCH_SIZE))){
+            return 0;
+    }
+    memcpy(tcp_cb->buf_batch + tcp_cb->buf_batch_ctr, tcp_cb->buf_out,
+           tcp_cb->buf_out_ctr);
+    tcp_cb->buf_batch_ctr += tcp_cb->buf_out_ctr;
+    make_buf_empty(tcp_cb->buf_out, &tcp_cb->buf_out_ctr);
+    return 1;
+}
+
+/**
+ * @brief answer the request at the head of the queue
+ * @return 1 if one was taken, 0 if there is none to take, negative
+ *         error code on failure
+ */
+static int handle_next_req(cli_cb_tcp_t *tcp_cb)
+{
+    cli_cb_base_t *cb = (cli_cb_base_t *)tcp_cb;
     req_msg_t *req_msg;
     int ret;
-    cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
-    /* if req msg list is empty */
-    if(!tcp_cb->is_send_pending && !tcp_cb->is_cgi_pending){
-            if(list_empty(&tcp_cb->req_msg_list)){
-                    //dbg_printf("conn(%d) no req_msg pending", cb->cli_fd);
-                    return 0;
-            }
 
-            /* if req msg list is not empty, try to handle one request */
-            req_msg = list_first_entry(&tcp_cb->req_msg_list, 
-                                       req_msg_t, req_msg_link);
-            list_del(&req_msg->req_msg_link);
-            
-            /* set current req msg */
-            tcp_cb->curr_req_msg = req_msg;
+    if(list_empty(&tcp_cb->req_msg_list)){
+            //dbg_printf("conn(%d) no req_msg pending", cb->cli_fd);
+            return 0;
+    }
 
-            switch(req_msg->req_line.req){
-            case HEAD:
-                    ret = handle_head_mthd(req_msg, cb);
-                    break;
-            case GET:
-                    ret = handle_get_mthd(req_msg, cb);
-                    break;
-            case POST:
-                    ret = handle_post_mthd(req_msg, cb);
-                    break;
-            default:
-                    ret = handle_unknown_mthd(req_msg, cb);
-                    break;
-            }
-            if(ret < 0){
-                    err_printf("ret = 0x%x", -ret);
-                    return ret;
-            }
-            if(!tcp_cb->is_send_pending && !tcp_cb->is_cgi_pending){
-                    dbg_printf("req_msg is freed");
-                    clear_req_msg(req_msg);
-                    free(req_msg);
-            }
-    }else if(tcp_cb->is_send_pending){
+    /* if req msg list is not empty, try to handle one request */
+    req_msg = list_first_entry(&tcp_cb->req_msg_list, 
+                               req_msg_t, req_msg_link);
+    /* a 0-RTT request may be replayed by an attacker, only
+     * safe methods are answered before the handshake is done */
+    if(tcp_cb->is_early && req_msg->req_line.req != GET &&
+       req_msg->req_line.req != HEAD){
+            return 0;
+    }
+    list_del(&req_msg->req_msg_link);
+
+    if(h2_is_upgrade(tcp_cb, req_msg)){
+            /* the rest is http/2, not for this loop */
+            return handle_upgrade(req_msg, tcp_cb);
+    }
+    
+    /* set current req msg */
+    tcp_cb->curr_req_msg = req_msg;
+
+    switch(req_msg->req_line.req){
+    case HEAD:
+            ret = handle_head_mthd(req_msg, cb);
+            break;
+    case GET:
+            ret = handle_get_mthd(req_msg, cb);
+            break;
+    case POST:
+            ret = handle_post_mthd(req_msg, cb);
+            break;
+    default:
+            ret = handle_unknown_mthd(req_msg, cb);
+            break;
+    }
+    if(ret < 0){
+            err_printf("ret = 0x%x", -ret);
+            return ret;
+    }
+    if(!tcp_cb->is_send_pending && !tcp_cb->is_cgi_pending &&
+       !tcp_cb->io_job){
+            dbg_printf("req_msg is freed");
+            clear_req_msg(req_msg);
+            free(req_msg);
+    }
+    return 1;
+}
+
+/**
+ * @brief answer what is queued on a connection
+ *
+ * Pipelined requests are answered in order, each response set aside
+ * for the next one to go into buf_out, so that they all go out with a
+ * single write. A response still being sent, or waiting for a cgi or
+ * the io pool, ends the run, and so do PIPE_BATCH_REQS of them or a
+ * full batch: the rest is answered on a later wakeup, after the other
+ * connections had theirs.
+ */
+static int handle_req_msg(cli_cb_base_t *cb)
+{
+    int ret, i;
+    cli_cb_tcp_t *tcp_cb = (cli_cb_tcp_t *)cb;
+    if(tcp_cb->io_job){
+            /* parked until the pool is done with its file io */
+            return 0;
+    }
+    if(tcp_cb->is_send_pending){
             if((ret = handle_pending_send(cb)) < 0){
                     err_printf("handle_pending_req_msg"
                                    " failed, ret = 0x%x",
                                -ret);
                     return ret;                    
             }       
-    }else{
+            return 0;
+    }
+    if(tcp_cb->is_cgi_pending){
             if((ret = handle_pending_cgi_send(cb)) < 0){
                     err_printf("handle pending cgi send failed, ret = 0x%x",
                                ret);
                     return ret;
             }
-
+            return 0;
+    }
+    for(i = 0; i < PIPE_BATCH_REQS && batch_rsp(tcp_cb); i++){
+            if((ret = handle_next_req(tcp_cb)) <= 0){
+                    return ret;
+            }
+            if(tcp_cb->is_send_pending || tcp_cb->is_cgi_pending ||
+               tcp_cb->io_job){
+                    break;
+            }
     }
     return 0;
 }
@@ -1552,6 +3410,8 @@ int main(int argc, char* argv[])
             /* if time out */
             cprintf(".");
             reset_timer(&time);
+            hot_set_tick();
+            ssl_cache_tick();
         }
         if(num < 0){
                 /*
@@ -1574,6 +3434,8 @@ int main(int argc, char* argv[])
             err_printf("error(0x%x) when processing request\n", -ret);
             return EXIT_FAILURE;
         }
+        hot_set_tick();
+        ssl_cache_tick();
     }
     /* should not reach here */ 
     err_printf("should not reach here");
@@ -0,0 +1,255 @@
+/** @file sni.c
+ *  @brief a certificate per host name, picked by SNI
+ *
+ *  The servername callback of the default context looks the name up in
+ *  a chained hash table of per-host contexts, loading the certificate
+ *  on a miss, and switches the connection over with SSL_set_SSL_CTX.
+ *  A per-host context is set up like the default one, since OpenSSL
+ *  takes some of the cipher choice from whichever context the connection
+ *  is on; its session cache and tickets stay those of the default one.
+ *
+ *  A name without a certificate is remembered too, so that its files
+ *  are looked for once, but apart: misses are kept in a set of their
+ *  own of at most SNI_MISSES_MAX names, the least recently asked for
+ *  making room, so that made up names can't crowd out the hosts that
+ *  have one. Once SNI_ENTRIES_MAX of those are known, new ones are
+ *  still loaded but not kept.
+ *
+ *  Handshakes run on the crypto workers as well as in the loop, so the
+ *  tables are guarded by a mutex. It is never held across the loading
+ *  of a certificate, which reads files and checks the key: that is done
+ *  unlocked, and the tables looked at again before the result is kept,
+ *  as another handshake may have loaded the same name meanwhile.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "list.h"
+#include "sni.h"
+#include "srv_log.h"
+#include "debug_define.h"
+
+
+struct sni_entry{
+        char host[SNI_HOST_MAX];
+        SSL_CTX *ctx;                    /* NULL in the misses */
+        struct list_head link;
+        struct list_head lru_link;       /* misses, most recent first */
+};
+
+typedef struct sni_entry sni_entry_t;
+
+
+static pthread_mutex_t sni_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guarded by sni_lock */
+static struct list_head sni_table[SNI_HASH_SIZE];  /* hosts with a cert */
+static int sni_entries = 0;
+static struct list_head sni_misses[SNI_HASH_SIZE]; /* hosts without one */
+static struct list_head sni_miss_lru;
+static int sni_miss_ctr = 0;
+static int (*sni_setup)(SSL_CTX *ctx);   /* versions, ciphers, options */
+
+
+static unsigned int hash_host(const char *host)
+{
+        uint32_t h = 2166136261U;
+        while(*host){
+                h ^= (unsigned char)*(host++);
+                h *= 16777619U;
+        }
+        return h % SNI_HASH_SIZE;
+}
+
+/**
+ * @brief lower case a server name into host, if it is a sane dns name
+ * @return 0 on success, -1 if the name is not to be looked up
+ */
+static int copy_host(char *host, const char *name)
+{
+        int i;
+
+        for(i = 0; name[i]; i++){
+                if(i == SNI_HOST_MAX - 1 ||
+                   !(isalnum((unsigned char)name[i]) || name[i] == '-' ||
+                     (name[i] == '.' && i && name[i - 1] != '.'))){
+                        return -1;
+                }
+                host[i] = tolower((unsigned char)name[i]);
+        }
+        host[i] = 0;
+        return i ? 0 : -1;
+}
+
+/**
+ * @brief make the context of a host from its certificate and key
+ * @return the context, or NULL if the host has none or it is unusable
+ */
+static SSL_CTX *load_host(const char *host)
+{
+        char cert_file[sizeof(SNI_CERT_DIR) + SNI_HOST_MAX + 4];
+        char key_file[sizeof(SNI_CERT_DIR) + SNI_HOST_MAX + 4];
+        FILE *fp;
+        SSL_CTX *ctx;
+
+        snprintf(cert_file, sizeof(cert_file), "%s%s.crt", SNI_CERT_DIR,
+                 host);
+        snprintf(key_file, sizeof(key_file), "%s%s.key", SNI_CERT_DIR, host);
+        if(!(fp = fopen(cert_file, "r"))){
+                return NULL;
+        }
+        fclose(fp);
+
+        if(!(ctx = SSL_CTX_new(TLS_server_method()))){
+                goto out1;
+        }
+        if(sni_setup(ctx) < 0 ||
+           SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0 ||
+           SSL_CTX_use_PrivateKey_file(ctx, key_file,
+                                       SSL_FILETYPE_PEM) <= 0 ||
+           !SSL_CTX_check_private_key(ctx)){
+                goto out2;
+        }
+        dbg_printf("cert of %s loaded", host);
+        return ctx;
+
+ out2:
+        SSL_CTX_free(ctx);
+ out1:
+        err_printf("cert of %s not loaded", host);
+        ERR_print_errors_fp(stderr);
+        return NULL;
+}
+
+/* the entry of host in a table, NULL if it has none; sni_lock held */
+static sni_entry_t *find_host(struct list_head *table, const char *host)
+{
+        sni_entry_t *entry;
+
+        list_for_each_entry(entry, &table[hash_host(host)], link){
+                if(!strcmp(entry->host, host)){
+                        return entry;
+                }
+        }
+        return NULL;
+}
+
+/* remember a host has no cert, in place of the least recent miss if
+ * there are SNI_MISSES_MAX of them; sni_lock held */
+static void add_miss(const char *host)
+{
+        sni_entry_t *entry;
+
+        if(sni_miss_ctr == SNI_MISSES_MAX){
+                entry = list_entry(sni_miss_lru.prev, sni_entry_t, lru_link);
+                list_del(&entry->link);
+                list_del(&entry->lru_link);
+        }else if((entry = (sni_entry_t *)malloc(sizeof(sni_entry_t)))){
+                sni_miss_ctr++;
+        }else{
+                return;
+        }
+        snprintf(entry->host, SNI_HOST_MAX, "%s", host);
+        entry->ctx = NULL;
+        list_add(&entry->link, &sni_misses[hash_host(host)]);
+        list_add(&entry->lru_link, &sni_miss_lru);
+}
+
+/**
+ * @brief find the context of a host, loading it on first use
+ * @return the context, with a reference for the caller, or NULL to go
+ *         on with the default one
+ */
+static SSL_CTX *lookup_host(const char *host)
+{
+        sni_entry_t *entry;
+        SSL_CTX *ctx;
+
+        pthread_mutex_lock(&sni_lock);
+        if((entry = find_host(sni_table, host))){
+                goto out1;
+        }
+        if((entry = find_host(sni_misses, host))){
+                list_del(&entry->lru_link);
+                list_add(&entry->lru_link, &sni_miss_lru);
+                pthread_mutex_unlock(&sni_lock);
+                return NULL;
+        }
+        pthread_mutex_unlock(&sni_lock);
+
+        /* the files are read without holding up the other handshakes */
+        ctx = load_host(host);
+
+        pthread_mutex_lock(&sni_lock);
+        if((entry = find_host(sni_table, host))){
+                /* loaded by another handshake meanwhile */
+                SSL_CTX_free(ctx);
+                goto out1;
+        }
+        if(!ctx){
+                if(!find_host(sni_misses, host)){
+                        add_miss(host);
+                }
+                pthread_mutex_unlock(&sni_lock);
+                return NULL;
+        }
+        if(sni_entries == SNI_ENTRIES_MAX ||
+           !(entry = (sni_entry_t *)malloc(sizeof(sni_entry_t)))){
+                /* not kept, the caller has the only reference */
+                pthread_mutex_unlock(&sni_lock);
+                return ctx;
+        }
+        snprintf(entry->host, SNI_HOST_MAX, "%s", host);
+        entry->ctx = ctx;
+        list_add(&entry->link, &sni_table[hash_host(host)]);
+        sni_entries++;
+ out1:
+        ctx = entry->ctx;
+        SSL_CTX_up_ref(ctx);
+        pthread_mutex_unlock(&sni_lock);
+        return ctx;
+}
+
+static int servername_cb(SSL *ssl, int *alert, void *arg)
+{
+        const char *name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+        char host[SNI_HOST_MAX];
+        SSL_CTX *ctx;
+
+        if(!name || copy_host(host, name) < 0 || !(ctx = lookup_host(host))){
+                return SSL_TLSEXT_ERR_OK;
+        }
+        /* the connection takes a reference of its own */
+        SSL_set_SSL_CTX(ssl, ctx);
+        SSL_CTX_free(ctx);
+        return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * @brief have the default context pick a certificate by server name
+ * @param ctx the default server context
+ * @param setup sets a context up as the default one was, before its
+ *        certificate is loaded; returns 0 on success, negative on failure
+ */
+void sni_init(SSL_CTX *ctx, int (*setup)(SSL_CTX *ctx))
+{
+        int i;
+
+        for(i = 0; i < SNI_HASH_SIZE; i++){
+                INIT_LIST_HEAD(&sni_table[i]);
+                INIT_LIST_HEAD(&sni_misses[i]);
+        }
+        INIT_LIST_HEAD(&sni_miss_lru);
+        sni_setup = setup;
+        SSL_CTX_set_tlsext_servername_callback(ctx, servername_cb);
+}
@@ -0,0 +1,400 @@
+/** @file ssl_cache.c
+ *  @brief tls session resumption: a shared session cache, session
+ *         tickets with rotating keys, and the resumption rate
+ *
+ *  The session cache replaces the one internal to OpenSSL: sessions
+ *  are serialized into direct mapped slots, hashed by session id, and
+ *  looked up by id when a client offers one. A slot taken by a newer
+ *  session, or older than SSL_CACHE_TIMEOUT, is a miss.
+ *
+ *  Tickets (RFC 5077) are sealed with AES-256-CBC and HMAC-SHA256 under
+ *  the current key, which is replaced every SSL_TICKET_ROTATE_SECS. The
+ *  previous key still opens tickets for one more period, and those get
+ *  a fresh ticket under the current key.
+ *
+ *  Early data is only let in once per psk: the digest of each psk that
+ *  carried some is kept for as long as its ticket lives, and a psk seen
+ *  before (or whose slot is still held by another) gets a full 1-RTT
+ *  handshake instead. OpenSSL's own anti-replay is off: it would make
+ *  every ticket stateful, and only works within one process.
+ *
+ *  The mapping is guarded by a process shared mutex; the critical
+ *  sections are a memcpy or a key lookup long.
+ *
+ *  @author Chen Chen
+ *  @bug no known bug
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+
+#include "ssl_cache.h"
+#include "srv_log.h"
+#include "err_code.h"
+#include "debug_define.h"
+
+
+#define TICKET_NAME_LEN 16
+#define TICKET_KEY_LEN  32
+#define REPLAY_ID_LEN   16
+
+
+struct sess_slot{
+        unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+        unsigned int id_len;             /* 0 if the slot is unused */
+        time_t stored;
+        int der_len;
+        unsigned char der[SSL_CACHE_DER_MAX];
+};
+
+struct ticket_key{
+        unsigned char name[TICKET_NAME_LEN];
+        unsigned char aes_key[TICKET_KEY_LEN];
+        unsigned char hmac_key[TICKET_KEY_LEN];
+        time_t created;
+};
+
+struct replay_slot{
+        unsigned char id[REPLAY_ID_LEN]; /* digest of the psk */
+        time_t used;                     /* 0 if the slot is unused */
+};
+
+struct ssl_shm{
+        pthread_mutex_t lock;
+        struct ticket_key keys[2];       /* current and previous */
+        int key_curr;
+        struct replay_slot replay[SSL_REPLAY_SLOTS];
+        /* resumption stats, since startup */
+        unsigned long handshakes;
+        unsigned long resumed;
+        unsigned long cache_hits;
+        unsigned long cache_misses;
+        struct sess_slot slots[SSL_CACHE_SLOTS];
+};
+
+typedef struct sess_slot sess_slot_t;
+typedef struct ticket_key ticket_key_t;
+
+
+static struct ssl_shm *shm = NULL;
+static time_t stats_logged = 0;
+static unsigned long stats_handshakes = 0;
+
+
+static sess_slot_t *get_slot(const unsigned char *id, unsigned int len)
+{
+        uint32_t h = 2166136261U;
+        unsigned int i;
+
+        for(i = 0; i < len; i++){
+                h ^= id[i];
+                h *= 16777619U;
+        }
+        return &shm->slots[h % SSL_CACHE_SLOTS];
+}
+
+static int new_session(SSL *ssl, SSL_SESSION *sess)
+{
+        const unsigned char *id;
+        unsigned char *der;
+        unsigned int id_len;
+        sess_slot_t *slot;
+        int der_len;
+
+        id = SSL_SESSION_get_id(sess, &id_len);
+        if(!id_len || (der_len = i2d_SSL_SESSION(sess, NULL)) <= 0 ||
+           der_len > SSL_CACHE_DER_MAX){
+                return 0;
+        }
+        slot = get_slot(id, id_len);
+        pthread_mutex_lock(&shm->lock);
+        der = slot->der;
+        i2d_SSL_SESSION(sess, &der);
+        slot->der_len = der_len;
+        memcpy(slot->id, id, id_len);
+        slot->id_len = id_len;
+        slot->stored = time(NULL);
+        pthread_mutex_unlock(&shm->lock);
+        /* the reference stays with OpenSSL */
+        return 0;
+}
+
+static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int len,
+                                int *copy)
+{
+        unsigned char der[SSL_CACHE_DER_MAX];
+        const unsigned char *p = der;
+        sess_slot_t *slot = get_slot(id, len);
+        SSL_SESSION *sess = NULL;
+        int der_len = 0;
+
+        *copy = 0;
+        pthread_mutex_lock(&shm->lock);
+        if(slot->id_len == len && !memcmp(slot->id, id, len) &&
+           time(NULL) - slot->stored < SSL_CACHE_TIMEOUT){
+                der_len = slot->der_len;
+                memcpy(der, slot->der, der_len);
+        }
+        if(der_len){
+                shm->cache_hits++;
+        }else{
+                shm->cache_misses++;
+        }
+        pthread_mutex_unlock(&shm->lock);
+
+        if(der_len){
+                sess = d2i_SSL_SESSION(NULL, &p, der_len);
+        }
+        return sess;
+}
+
+static void remove_session(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+        const unsigned char *id;
+        unsigned int id_len;
+        sess_slot_t *slot;
+
+        id = SSL_SESSION_get_id(sess, &id_len);
+        slot = get_slot(id, id_len);
+        pthread_mutex_lock(&shm->lock);
+        if(slot->id_len == id_len && !memcmp(slot->id, id, id_len)){
+                slot->id_len = 0;
+        }
+        pthread_mutex_unlock(&shm->lock);
+}
+
+/* make a new current key once the current one is due, under the lock */
+static int rotate_keys(void)
+{
+        ticket_key_t *key = &shm->keys[shm->key_curr];
+
+        if(key->created && time(NULL) - key->created < SSL_TICKET_ROTATE_SECS){
+                return 0;
+        }
+        key = &shm->keys[!shm->key_curr];
+        if(RAND_bytes(key->name, TICKET_NAME_LEN) <= 0 ||
+           RAND_bytes(key->aes_key, TICKET_KEY_LEN) <= 0 ||
+           RAND_bytes(key->hmac_key, TICKET_KEY_LEN) <= 0){
+                return -1;
+        }
+        key->created = time(NULL);
+        shm->key_curr = !shm->key_curr;
+        dbg_printf("ticket key rotated");
+        return 0;
+}
+
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+{
+        ticket_key_t key;
+        OSSL_PARAM params[3];
+        int ret = 1;
+        int i;
+
+        pthread_mutex_lock(&shm->lock);
+        if(enc){
+                if(rotate_keys() < 0){
+                        pthread_mutex_unlock(&shm->lock);
+                        return -1;
+                }
+                key = shm->keys[shm->key_curr];
+        }else{
+                for(i = 0; i < 2; i++){
+                        if(shm->keys[i].created &&
+                           !memcmp(name, shm->keys[i].name,
+                                   TICKET_NAME_LEN)){
+                                break;
+                        }
+                }
+                if(i == 2 || time(NULL) - shm->keys[i].created >=
+                   2 * SSL_TICKET_ROTATE_SECS){
+                        /* unknown or retired key, do a full handshake */
+                        pthread_mutex_unlock(&shm->lock);
+                        return 0;
+                }
+                key = shm->keys[i];
+                /* renew tickets under the previous key */
+                ret = i == shm->key_curr ? 1 : 2;
+        }
+        pthread_mutex_unlock(&shm->lock);
+
+        params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                      key.hmac_key,
+                                                      TICKET_KEY_LEN);
+        params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                     "SHA256", 0);
+        params[2] = OSSL_PARAM_construct_end();
+        if(enc){
+                memcpy(name, key.name, TICKET_NAME_LEN);
+                if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc()))
+                   <= 0 ||
+                   !EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL,
+                                       key.aes_key, iv)){
+                        return -1;
+                }
+        }else if(!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL,
+                                     key.aes_key, iv)){
+                return -1;
+        }
+        if(!EVP_MAC_CTX_set_params(hctx, params)){
+                return -1;
+        }
+        return ret;
+}
+
+/* let early data in only the first time its psk is seen, and not on h2
+ * sessions: early data is read as HTTP/1 requests */
+static int allow_early_data(SSL *ssl, void *arg)
+{
+        unsigned char psk[EVP_MAX_MD_SIZE];     /* as long as a tls 1.3 psk */
+        unsigned char md[EVP_MAX_MD_SIZE];
+        struct replay_slot *slot;
+        SSL_SESSION *sess;
+        const unsigned char *alpn;
+        size_t alpn_len;
+        unsigned int md_len;
+        uint32_t h;
+        size_t len;
+        int ret = 0;
+
+        if(!(sess = SSL_get_session(ssl))){
+                return 0;
+        }
+        SSL_SESSION_get0_alpn_selected(sess, &alpn, &alpn_len);
+        if((alpn_len == 2 && !memcmp(alpn, "h2", 2)) ||
+           !(len = SSL_SESSION_get_master_key(sess, psk, sizeof(psk))) ||
+           !EVP_Digest(psk, len, md, &md_len, EVP_sha256(), NULL)){
+                return 0;
+        }
+        memcpy(&h, md, sizeof(h));
+        slot = &shm->replay[h % SSL_REPLAY_SLOTS];
+
+        pthread_mutex_lock(&shm->lock);
+        if(!slot->used || time(NULL) - slot->used >= SSL_CACHE_TIMEOUT){
+                memcpy(slot->id, md, REPLAY_ID_LEN);
+                slot->used = time(NULL);
+                ret = 1;
+        }
+        pthread_mutex_unlock(&shm->lock);
+        if(!ret){
+                dbg_printf("early data refused, psk seen or slot taken");
+        }
+        return ret;
+}
+
+/**
+ * @brief take up to max bytes of TLS 1.3 early data on resumption
+ *
+ * Needs the shared mapping for replay protection, so ssl_cache_init
+ * must have succeeded.
+ *
+ * @param ctx the server context
+ * @param max the most early data taken per connection
+ * @return 0 on success, ERR_SSL_CACHE if 0-RTT stays off
+ */
+int ssl_cache_early_data(SSL_CTX *ctx, uint32_t max)
+{
+        if(!shm || !SSL_CTX_set_max_early_data(ctx, max) ||
+           !SSL_CTX_set_recv_max_early_data(ctx, max)){
+                return ERR_SSL_CACHE;
+        }
+        /* replays are caught by allow_early_data, across processes;
+         * OpenSSL's own check would make tickets stateful instead */
+        SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+        SSL_CTX_set_allow_early_data_cb(ctx, allow_early_data, NULL);
+        return 0;
+}
+
+/**
+ * @brief set up resumption on the server context
+ *
+ * To be called before any worker is forked. On failure the context is
+ * left as it was, without resumption.
+ *
+ * @param ctx the server context
+ * @return 0 on success, ERR_SSL_CACHE on failure
+ */
+int ssl_cache_init(SSL_CTX *ctx)
+{
+        static const unsigned char sid_ctx[] = "liso";
+        pthread_mutexattr_t attr;
+        struct ssl_shm *mem;
+
+        mem = mmap(NULL, sizeof(struct ssl_shm), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(mem == MAP_FAILED){
+                err_printf("mmap ssl cache failed");
+                return ERR_SSL_CACHE;
+        }
+        /* the mapping is zeroed: no sessions, no keys yet */
+        if(pthread_mutexattr_init(&attr) ||
+           pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+           pthread_mutex_init(&mem->lock, &attr)){
+                munmap(mem, sizeof(struct ssl_shm));
+                return ERR_SSL_CACHE;
+        }
+        pthread_mutexattr_destroy(&attr);
+        shm = mem;
+
+        SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+                                       SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_set_timeout(ctx, SSL_CACHE_TIMEOUT);
+        SSL_CTX_sess_set_new_cb(ctx, new_session);
+        SSL_CTX_sess_set_get_cb(ctx, get_session);
+        SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+        if(!SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb)){
+                err_printf("ticket key cb not set, tickets off");
+                SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        }
+        stats_logged = time(NULL);
+        return 0;
+}
+
+/** @brief count a finished handshake, resumed or full */
+void ssl_cache_count(SSL *ssl)
+{
+        if(!shm){
+                return;
+        }
+        pthread_mutex_lock(&shm->lock);
+        shm->handshakes++;
+        if(SSL_session_reused(ssl)){
+                shm->resumed++;
+        }
+        pthread_mutex_unlock(&shm->lock);
+}
+
+/** @brief called from the main loop, logs the resumption rate when due */
+void ssl_cache_tick(void)
+{
+        unsigned long handshakes, resumed, hits, misses;
+
+        if(!shm || time(NULL) - stats_logged < SSL_STATS_SECS){
+                return;
+        }
+        pthread_mutex_lock(&shm->lock);
+        handshakes = shm->handshakes;
+        resumed = shm->resumed;
+        hits = shm->cache_hits;
+        misses = shm->cache_misses;
+        pthread_mutex_unlock(&shm->lock);
+
+        stats_logged = time(NULL);
+        if(handshakes == stats_handshakes){
+                return;
+        }
+        stats_handshakes = handshakes;
+        cprintf("tls: %lu handshakes, %lu resumed (%lu%%), "
+                "cache %lu hits %lu misses\n", handshakes, resumed,
+                resumed * 100 / handshakes, hits, misses);
+}